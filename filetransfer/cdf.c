@@ -17,26 +17,41 @@ struct _CumulativeDistributionEntry {
 
 struct _CumulativeDistribution {
 	GQuark id;
-	GList* entries;
+	/* sorted by value (so by fraction too), searched with a binary search */
+	CumulativeDistributionEntry* entries;
+	guint nEntries;
+	/* optional alias table for sampling the entries in O(1), see cdf_buildAliasTable() */
+	gdouble* aliasProbabilities;
+	guint* aliases;
+	/* references handed out by cdf_acquire(), 0 if the cdf is not shared */
+	guint shares;
 };
 
-static CumulativeDistributionEntry* cdfentry_create() {
-	CumulativeDistributionEntry* entry = g_new0(CumulativeDistributionEntry, 1);
-	return entry;
-}
+/* the shared cdfs, by the quark of their path */
+static GHashTable* cdf_registry = NULL;
+G_LOCK_DEFINE_STATIC(cdf_registry);
 
 static gint cdfentry_compare(gconstpointer a, gconstpointer b) {
 	const CumulativeDistributionEntry* entryA = a;
 	const CumulativeDistributionEntry* entryB = b;
-	return entryA->value > entryB->value ? +1 : entryA->value == entryB->value ? 0 : -1;
+	if(entryA->value != entryB->value) {
+		return entryA->value > entryB->value ? +1 : -1;
+	}
+	return entryA->fraction > entryB->fraction ? +1 : entryA->fraction == entryB->fraction ? 0 : -1;
 }
 
-static void cdfentry_free(gpointer data) {
-	CumulativeDistributionEntry* entry = data;
-	g_free(entry);
+/* takes ownership of the array of entries, sorting them in O(n log n) */
+static CumulativeDistribution* _cdf_newFromArray(GQuark id, GArray* entries) {
+	g_array_sort(entries, cdfentry_compare);
+
+	CumulativeDistribution* cdf = g_new0(CumulativeDistribution, 1);
+	cdf->id = id;
+	cdf->nEntries = entries->len;
+	cdf->entries = (CumulativeDistributionEntry*) g_array_free(entries, FALSE);
+	return cdf;
 }
 
-static GList* cdf_parse(const gchar* filename) {
+static GArray* cdf_parse(const gchar* filename) {
 	if(filename == NULL) {
 		return NULL;
 	}
@@ -47,67 +62,54 @@ static GList* cdf_parse(const gchar* filename) {
 		return NULL;
 	}
 
-	/* start with an empty list of CDF entries */
-	GList* entries = NULL;
+	/* start with an empty array of CDF entries */
+	GArray* entries = g_array_new(FALSE, FALSE, sizeof(CumulativeDistributionEntry));
 
-	gint result = 0;
 	while(!feof(f) && !ferror(f)) {
-		CumulativeDistributionEntry* entry = cdfentry_create();
-		result = fscanf(f, "%lf %lf\n", &(entry->value), &(entry->fraction));
-		if(result != 2) {
-			cdfentry_free(entry);
-			g_list_free(entries);
+		CumulativeDistributionEntry entry;
+		if(fscanf(f, "%lf %lf\n", &(entry.value), &(entry.fraction)) != 2) {
+			/* stop at the first line that is not an entry */
 			break;
-		} else {
-			entries = g_list_insert_sorted(entries, entry, cdfentry_compare);
 		}
+		g_array_append_val(entries, entry);
 	}
 
 	fclose(f);
 
+	if(entries->len == 0) {
+		g_array_free(entries, TRUE);
+		return NULL;
+	}
 	return entries;
 }
 
 CumulativeDistribution* cdf_new(GQuark id, const gchar* filename) {
-	/* TODO We should use a binary tree for more efficient lookups */
-	GList* ol = cdf_parse(filename);
-	if(ol != NULL) {
-		CumulativeDistribution* cdf = g_new0(CumulativeDistribution, 1);
-		cdf->entries = ol;
-		cdf->id = id;
-		return cdf;
+	GArray* entries = cdf_parse(filename);
+	if(entries != NULL) {
+		return _cdf_newFromArray(id, entries);
 	} else {
 		return NULL;
 	}
 }
 
-static void _cdf_addEntry(gdouble* data, GList** list) {
-	assert(data && list && *list);
-	CumulativeDistributionEntry* entry = cdfentry_create();
-	entry->value = *data;
-	entry->fraction = 0.0;
-	*list = g_list_insert_sorted(*list, entry, cdfentry_compare);
-}
-
 CumulativeDistribution* cdf_newFromQueue(GQueue* doubleValues) {
 	assert(doubleValues);
-	CumulativeDistribution* cdf = g_new0(CumulativeDistribution, 1);
-
-	gdouble qLength = (gdouble)g_queue_get_length(doubleValues);
+	guint length = g_queue_get_length(doubleValues);
+	assert(length > 0);
+
+	GArray* entries = g_array_sized_new(FALSE, FALSE, sizeof(CumulativeDistributionEntry), length);
+	for(GList* item = g_queue_peek_head_link(doubleValues); item; item = item->next) {
+		CumulativeDistributionEntry entry;
+		entry.value = *((gdouble*) item->data);
+		entry.fraction = 0.0;
+		g_array_append_val(entries, entry);
+	}
 
-	/* start with an empty list of CDF entries */
-	GList* list = NULL;
-	g_queue_foreach(doubleValues, (GFunc) _cdf_addEntry, &list);
-	cdf->entries = list;
+	CumulativeDistribution* cdf = _cdf_newFromArray(0, entries);
 
-	gdouble increment = 1.0f / qLength;
-	gdouble cumFrac = increment;
-	while(list) {
-		CumulativeDistributionEntry* entry = list->data;
-		entry->fraction = cumFrac;
-		cumFrac += increment;
-		assert(cumFrac <= 1);
-		list = list->next;
+	/* every value weighs the same */
+	for(guint i = 0; i < cdf->nEntries; i++) {
+		cdf->entries[i].fraction = ((gdouble) (i + 1)) / ((gdouble) cdf->nEntries);
 	}
 
 	return cdf;
@@ -168,78 +170,199 @@ CumulativeDistribution* cdf_newFromQueue(GQueue* doubleValues) {
 //}
 
 CumulativeDistribution* cdf_generate(GQuark id, guint base_center, guint base_width, guint tail_width) {
-	CumulativeDistribution* cdf = g_new0(CumulativeDistribution, 1);
-	cdf->entries = NULL;
-	cdf->id = id;
+	GArray* entries = g_array_sized_new(FALSE, FALSE, sizeof(CumulativeDistributionEntry), 4);
 
 	/* TODO fix this - use model from vci?? */
-	CumulativeDistributionEntry* entry1 = cdfentry_create();
-	CumulativeDistributionEntry* entry2 = cdfentry_create();
-	CumulativeDistributionEntry* entry3 = cdfentry_create();
-	CumulativeDistributionEntry* entry4 = cdfentry_create();
-
-	entry1->fraction = 0.10;
-	entry1->value = (gdouble) (base_center - base_width);
-	entry2->fraction = 0.80;
-	entry2->value = (gdouble) (base_center);
-	entry3->fraction = 0.90;
-	entry3->value = (gdouble) (base_center + base_width);
-	entry4->fraction = 0.95;
-	entry4->value = (gdouble) (base_center + base_width + tail_width);
-
-	cdf->entries = g_list_insert_sorted(cdf->entries, entry1, cdfentry_compare);
-	cdf->entries = g_list_insert_sorted(cdf->entries, entry2, cdfentry_compare);
-	cdf->entries = g_list_insert_sorted(cdf->entries, entry3, cdfentry_compare);
-	cdf->entries = g_list_insert_sorted(cdf->entries, entry4, cdfentry_compare);
-
-	return cdf;
+	CumulativeDistributionEntry entry1, entry2, entry3, entry4;
+
+	entry1.fraction = 0.10;
+	entry1.value = (gdouble) (base_center - base_width);
+	entry2.fraction = 0.80;
+	entry2.value = (gdouble) (base_center);
+	entry3.fraction = 0.90;
+	entry3.value = (gdouble) (base_center + base_width);
+	entry4.fraction = 0.95;
+	entry4.value = (gdouble) (base_center + base_width + tail_width);
+
+	g_array_append_val(entries, entry1);
+	g_array_append_val(entries, entry2);
+	g_array_append_val(entries, entry3);
+	g_array_append_val(entries, entry4);
+
+	return _cdf_newFromArray(id, entries);
 }
 
 void cdf_free(gpointer data) {
 	CumulativeDistribution* cdf = data;
-	g_list_free_full(cdf->entries, cdfentry_free);
+	if(cdf == NULL) {
+		return;
+	}
+	g_free(cdf->entries);
+	g_free(cdf->aliasProbabilities);
+	g_free(cdf->aliases);
 	g_free(cdf);
 }
 
+/* index of the first entry whose fraction is at least percentile, or of the last
+ * entry if the cdf ends before percentile */
+static guint _cdf_search(CumulativeDistribution* cdf, gdouble percentile) {
+	guint low = 0, high = cdf->nEntries - 1;
+	while(low < high) {
+		guint middle = low + (high - low) / 2;
+		if(cdf->entries[middle].fraction >= percentile) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+	return low;
+}
+
 gdouble cdf_getValue(CumulativeDistribution* cdf, gdouble percentile) {
 	assert(percentile >= 0.0 && percentile <= 1.0);
+	return cdf->entries[_cdf_search(cdf, percentile)].value;
+}
+
+gdouble cdf_getInterpolatedValue(CumulativeDistribution* cdf, gdouble percentile) {
+	assert(percentile >= 0.0 && percentile <= 1.0);
+
+	guint i = _cdf_search(cdf, percentile);
+	CumulativeDistributionEntry* upper = &cdf->entries[i];
+	if(i == 0 || upper->fraction <= percentile) {
+		return upper->value;
+	}
+
+	/* linear between the two entries around percentile */
+	CumulativeDistributionEntry* lower = &cdf->entries[i - 1];
+	gdouble position = (percentile - lower->fraction) / (upper->fraction - lower->fraction);
+	return lower->value + position * (upper->value - lower->value);
+}
+
+gdouble cdf_getMinimumValue(CumulativeDistribution* cdf) {
+	return cdf->entries[0].value;
+}
+
+gdouble cdf_getMaximumValue(CumulativeDistribution* cdf) {
+	return cdf->entries[cdf->nEntries - 1].value;
+}
+
+void cdf_buildAliasTable(CumulativeDistribution* cdf) {
+	guint n = cdf->nEntries;
+	g_free(cdf->aliasProbabilities);
+	g_free(cdf->aliases);
+	cdf->aliasProbabilities = g_new(gdouble, n);
+	cdf->aliases = g_new(guint, n);
+
+	/* the probability of each entry is the jump of the cdf at its value, as
+	 * cdf_getValue() would pick it for a uniform percentile. the last entry
+	 * also gets whatever the cdf leaves above its last fraction. */
+	gdouble total = MAX(cdf->entries[n - 1].fraction, 1.0);
+	gdouble* scaled = g_new(gdouble, n);
+	for(guint i = 0; i < n; i++) {
+		gdouble previous = i > 0 ? cdf->entries[i - 1].fraction : 0.0;
+		gdouble current = i == n - 1 ? total : cdf->entries[i].fraction;
+		scaled[i] = MAX(current - previous, 0.0) * n / total;
+	}
+
+	/* Vose's method: pair every entry under the average with one over it */
+	guint* small = g_new(guint, n);
+	guint* large = g_new(guint, n);
+	guint nSmall = 0, nLarge = 0;
+	for(guint i = 0; i < n; i++) {
+		if(scaled[i] < 1.0) {
+			small[nSmall++] = i;
+		} else {
+			large[nLarge++] = i;
+		}
+	}
+	while(nSmall > 0 && nLarge > 0) {
+		guint s = small[--nSmall];
+		guint l = large[--nLarge];
+		cdf->aliasProbabilities[s] = scaled[s];
+		cdf->aliases[s] = l;
+		scaled[l] -= 1.0 - scaled[s];
+		if(scaled[l] < 1.0) {
+			small[nSmall++] = l;
+		} else {
+			large[nLarge++] = l;
+		}
+	}
+	/* what is left is at the average, up to rounding errors */
+	while(nLarge > 0) {
+		guint l = large[--nLarge];
+		cdf->aliasProbabilities[l] = 1.0;
+		cdf->aliases[l] = l;
+	}
+	while(nSmall > 0) {
+		guint s = small[--nSmall];
+		cdf->aliasProbabilities[s] = 1.0;
+		cdf->aliases[s] = s;
+	}
+
+	g_free(scaled);
+	g_free(small);
+	g_free(large);
+}
+
+gdouble cdf_sampleValue(CumulativeDistribution* cdf, gdouble random) {
+	assert(random >= 0.0 && random <= 1.0);
+	if(cdf->aliases == NULL) {
+		return cdf_getValue(cdf, random);
+	}
+
+	/* the integer part picks a column of the table, the fractional part a side */
+	gdouble x = random * cdf->nEntries;
+	guint column = MIN((guint) x, cdf->nEntries - 1);
+	gdouble side = x - column;
+	return side < cdf->aliasProbabilities[column] ?
+			cdf->entries[column].value : cdf->entries[cdf->aliases[column]].value;
+}
+
+CumulativeDistribution* cdf_acquire(const gchar* filename) {
+	if(filename == NULL) {
+		return NULL;
+	}
+	GQuark id = g_quark_from_string(filename);
+
+	G_LOCK(cdf_registry);
+
+	if(cdf_registry == NULL) {
+		cdf_registry = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	CumulativeDistribution* cdf = g_hash_table_lookup(cdf_registry, GUINT_TO_POINTER(id));
+	if(cdf == NULL) {
+		cdf = cdf_new(id, filename);
+		if(cdf != NULL) {
+			/* never changes from now on, so it is safe to sample from anywhere */
+			cdf_buildAliasTable(cdf);
+			g_hash_table_insert(cdf_registry, GUINT_TO_POINTER(id), cdf);
+		}
+	}
+	if(cdf != NULL) {
+		cdf->shares++;
+	}
+
+	G_UNLOCK(cdf_registry);
+
+	return cdf;
+}
+
+void cdf_release(CumulativeDistribution* cdf) {
+	if(cdf == NULL) {
+		return;
+	}
+
+	G_LOCK(cdf_registry);
+
+	assert(cdf->shares > 0);
+	cdf->shares--;
+	if(cdf->shares == 0) {
+		g_hash_table_remove(cdf_registry, GUINT_TO_POINTER(cdf->id));
+		cdf_free(cdf);
+	}
 
-	/* start from the back of the list if the percentile is high enough */
-	gboolean reverse = percentile > 0.5 ? TRUE : FALSE;
-
-	GList* item = reverse ? g_list_last(cdf->entries) : g_list_first(cdf->entries);
-
-	CumulativeDistributionEntry* prev_entry = NULL;
-	while(item) {
-		CumulativeDistributionEntry* entry = item->data;
-
-		if (reverse) {
-            if (entry->fraction == percentile) {
-                return entry->value;
-            } else if (entry->fraction < percentile) {
-                /* the first time we see an entry strictly less
-                 * than percentile, then return the entry we saw
-                 * in the previous iteration.
-                 */
-                return prev_entry->value;
-            } else {
-                prev_entry = entry;
-            }
-        } else {
-            if (entry->fraction >= percentile) {
-                return entry->value;
-            }
-        }
-
-        item = reverse ? g_list_previous(item) : g_list_next(item);
-	}
-
-	if (reverse) {
-        return prev_entry->value;
-    } else {
-        g_assert(FALSE); // should not be reached
-        return 0; // to silence 'may reach end non-void func' warning
-    }
+	G_UNLOCK(cdf_registry);
 }
 
 GQuark* cdf_getIDReference(CumulativeDistribution* cdf) {
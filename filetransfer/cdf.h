@@ -24,8 +24,8 @@ typedef struct _CumulativeDistribution CumulativeDistribution;
 
 /**
  * Create a new CumulativeDistribution with data from the given filename. The
- * file is parsed for lines of the form "value fraction". Each such entry will
- * be sorted internally.
+ * file is parsed for lines of the form "value fraction", up to the first line
+ * that is not. The entries are sorted internally by value.
  *
  * @param id
  * @param filename
@@ -45,10 +45,52 @@ CumulativeDistribution* cdf_newFromQueue(GQueue* doubleValues);
 void cdf_free(gpointer data);
 
 
+/**
+ * Returns the value of the first entry whose cumulative fraction is at least
+ * percentile (the last value if the cdf ends before percentile), found with a
+ * binary search in O(log n).
+ */
 gdouble cdf_getValue(CumulativeDistribution* cdf, gdouble percentile);
+
+/**
+ * Same as cdf_getValue(), but interpolated linearly between the two entries
+ * around percentile, for continuous distributions.
+ */
+gdouble cdf_getInterpolatedValue(CumulativeDistribution* cdf, gdouble percentile);
+
 gdouble cdf_getMinimumValue(CumulativeDistribution* cdf);
 gdouble cdf_getMaximumValue(CumulativeDistribution* cdf);
 
+/**
+ * Build an alias table so that cdf_sampleValue() draws the values of the cdf
+ * as a discrete distribution in O(1). Takes O(n) time and memory.
+ */
+void cdf_buildAliasTable(CumulativeDistribution* cdf);
+
+/**
+ * Draw a value of the cdf from a uniform random number in [0, 1]. Distributed
+ * as cdf_getValue() of a uniform percentile, but in O(1) once
+ * cdf_buildAliasTable() was called.
+ */
+gdouble cdf_sampleValue(CumulativeDistribution* cdf, gdouble random);
+
+/**
+ * Get the CumulativeDistribution of the given file, shared by every caller in
+ * the process: the file is parsed (and its alias table built) by the first
+ * caller only, and the others get a reference to the same cdf, identified by
+ * the quark of filename. The cdf must not be modified, and is given back with
+ * cdf_release() instead of cdf_free(). Returns NULL if the file can't be parsed.
+ *
+ * @param filename
+ */
+CumulativeDistribution* cdf_acquire(const gchar* filename);
+
+/**
+ * Release a reference obtained from cdf_acquire(). The cdf is freed along with
+ * its last reference.
+ */
+void cdf_release(CumulativeDistribution* cdf);
+
 GQuark* cdf_getIDReference(CumulativeDistribution* cdf);
 
 #endif /* SHD_CDF_H_ */
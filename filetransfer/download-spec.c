@@ -0,0 +1,435 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "download-spec.h"
+
+/* the layout of the file. counts and offsets are little endian, addresses and
+ * ports are in network order, the offsets are into the strings at the end */
+typedef struct downloadspec_header_s {
+	gchar magic[DS_MAGIC_LENGTH];
+	guint32 num_servers;
+	guint32 num_downloads;
+	guint32 strings_size;
+	guint32 reserved;
+} downloadspec_header_t;
+
+#define DS_SERVER_ONION 0x1
+
+typedef struct downloadspec_server_s {
+	guint32 hostname_offset;
+	guint32 hostname_length;
+	/* the downloads are grouped by server, these are the ones of the server */
+	guint32 first_download;
+	guint32 num_downloads;
+	/* 0 if the name must be looked up */
+	in_addr_t http_addr;
+	in_port_t http_port;
+	guint16 flags;
+} downloadspec_server_t;
+
+typedef struct downloadspec_entry_s {
+	guint32 server;
+	guint32 path_offset;
+} downloadspec_entry_t;
+
+struct downloadspec_s {
+	GQuark id;
+	gpointer map;
+	gsize map_size;
+	const downloadspec_server_t* servers;
+	const downloadspec_entry_t* entries;
+	const gchar* strings;
+	guint32 num_servers;
+	guint32 num_downloads;
+	guint32 strings_size;
+	/* the addresses looked up for the servers stored by name, 0 if not yet */
+	in_addr_t* lookups;
+	/* references handed out by downloadspec_acquire() */
+	guint shares;
+};
+
+/* the mapped specifications, by the quark of their path */
+static GHashTable* downloadspec_registry = NULL;
+G_LOCK_DEFINE_STATIC(downloadspec_registry);
+
+/* by server, and in the order of the text file within a server */
+static gint downloadspec_compare_entries(gconstpointer a, gconstpointer b) {
+	const downloadspec_entry_t* entryA = a;
+	const downloadspec_entry_t* entryB = b;
+	guint32 serverA = GUINT32_FROM_LE(entryA->server), serverB = GUINT32_FROM_LE(entryB->server);
+	if(serverA != serverB) {
+		return serverA > serverB ? +1 : -1;
+	}
+	guint32 pathA = GUINT32_FROM_LE(entryA->path_offset), pathB = GUINT32_FROM_LE(entryB->path_offset);
+	return pathA > pathB ? +1 : pathA == pathB ? 0 : -1;
+}
+
+/* get the index of the server in servers, adding it if it is new */
+static guint32 downloadspec_compile_server(GHashTable* indices, GArray* servers, GString* strings,
+		const gchar* host, const gchar* port) {
+	gchar* key = g_strdup_printf("%s:%s", host, port);
+	gpointer index = NULL;
+	if(g_hash_table_lookup_extended(indices, key, NULL, &index)) {
+		g_free(key);
+		return GPOINTER_TO_UINT(index);
+	}
+
+	downloadspec_server_t server;
+	memset(&server, 0, sizeof(downloadspec_server_t));
+	server.hostname_offset = GUINT32_TO_LE((guint32) strings->len);
+	server.hostname_length = GUINT32_TO_LE((guint32) strlen(host));
+	server.http_port = htons((in_port_t) atoi(port));
+
+	struct in_addr in;
+	if(g_strstr_len(host, -1, ".onion") != NULL) {
+		server.flags = GUINT16_TO_LE(DS_SERVER_ONION);
+	} else if(inet_aton(host, &in)) {
+		server.http_addr = in.s_addr;
+	}
+	g_string_append_len(strings, host, strlen(host) + 1);
+
+	guint32 new_index = servers->len;
+	g_array_append_val(servers, server);
+	g_hash_table_insert(indices, key, GUINT_TO_POINTER(new_index));
+	return new_index;
+}
+
+gint downloadspec_compile(const gchar* text_filename, const gchar* binary_filename) {
+	FILE* text = fopen(text_filename, "r");
+	if(text == NULL) {
+		perror(text_filename);
+		return -1;
+	}
+
+	GHashTable* indices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	GArray* servers = g_array_new(FALSE, FALSE, sizeof(downloadspec_server_t));
+	GArray* entries = g_array_new(FALSE, FALSE, sizeof(downloadspec_entry_t));
+	GString* strings = g_string_new(NULL);
+	gboolean valid = TRUE;
+	gint line = 0;
+
+	gchar linebuffer[512];
+	while(valid && fgets(linebuffer, sizeof(linebuffer), text) != NULL) {
+		line++;
+		g_strchomp(linebuffer);
+		if(linebuffer[0] == '\0') {
+			continue;
+		}
+
+		/* the same format as the text files the service reads */
+		gchar** tokens = g_strsplit((const gchar*) linebuffer, (const gchar*)":", 3);
+		if(tokens[0] == NULL || tokens[1] == NULL || tokens[2] == NULL ||
+				tokens[0][0] == '\0' || atoi(tokens[1]) <= 0 || atoi(tokens[1]) > 65535 ||
+				tokens[2][0] != '/' || g_strrstr(tokens[2], ":") != NULL) {
+			fprintf(stderr, "%s:%i: expected something like \"fileserver.shd:8080:/5mb.urnd\"\n", text_filename, line);
+			valid = FALSE;
+		} else {
+			downloadspec_entry_t entry;
+			entry.server = GUINT32_TO_LE(downloadspec_compile_server(indices, servers, strings, tokens[0], tokens[1]));
+			entry.path_offset = GUINT32_TO_LE((guint32) strings->len);
+			g_string_append_len(strings, tokens[2], strlen(tokens[2]) + 1);
+			g_array_append_val(entries, entry);
+		}
+
+		g_strfreev(tokens);
+	}
+
+	fclose(text);
+
+	if(valid && entries->len == 0) {
+		fprintf(stderr, "%s: no downloads specified\n", text_filename);
+		valid = FALSE;
+	}
+
+	if(valid) {
+		/* group the downloads of each server, for pipelining */
+		g_array_sort(entries, downloadspec_compare_entries);
+		for(guint i = 0; i < entries->len; i++) {
+			guint32 server_index = GUINT32_FROM_LE(g_array_index(entries, downloadspec_entry_t, i).server);
+			downloadspec_server_t* server = &g_array_index(servers, downloadspec_server_t, server_index);
+			if(server->num_downloads == 0) {
+				server->first_download = GUINT32_TO_LE(i);
+			}
+			server->num_downloads = GUINT32_TO_LE(GUINT32_FROM_LE(server->num_downloads) + 1);
+		}
+
+		downloadspec_header_t header;
+		memset(&header, 0, sizeof(downloadspec_header_t));
+		memcpy(header.magic, DS_MAGIC, DS_MAGIC_LENGTH);
+		header.num_servers = GUINT32_TO_LE(servers->len);
+		header.num_downloads = GUINT32_TO_LE(entries->len);
+		header.strings_size = GUINT32_TO_LE((guint32) strings->len);
+
+		FILE* binary = fopen(binary_filename, "wb");
+		if(binary == NULL) {
+			perror(binary_filename);
+			valid = FALSE;
+		} else {
+			valid = fwrite(&header, sizeof(downloadspec_header_t), 1, binary) == 1 &&
+					fwrite(servers->data, sizeof(downloadspec_server_t), servers->len, binary) == servers->len &&
+					fwrite(entries->data, sizeof(downloadspec_entry_t), entries->len, binary) == entries->len &&
+					fwrite(strings->str, 1, strings->len, binary) == strings->len;
+			if(fclose(binary) != 0 || !valid) {
+				perror(binary_filename);
+				valid = FALSE;
+			}
+		}
+	}
+
+	gint num_downloads = valid ? (gint) entries->len : -1;
+
+	g_hash_table_destroy(indices);
+	g_array_free(servers, TRUE);
+	g_array_free(entries, TRUE);
+	g_string_free(strings, TRUE);
+
+	return num_downloads;
+}
+
+gboolean downloadspec_is_compiled(const gchar* filename) {
+	if(filename == NULL) {
+		return FALSE;
+	}
+
+	FILE* f = fopen(filename, "rb");
+	if(f == NULL) {
+		return FALSE;
+	}
+
+	gchar magic[DS_MAGIC_LENGTH];
+	gboolean is_compiled = fread(magic, 1, DS_MAGIC_LENGTH, f) == DS_MAGIC_LENGTH &&
+			memcmp(magic, DS_MAGIC, DS_MAGIC_LENGTH) == 0;
+
+	fclose(f);
+	return is_compiled;
+}
+
+static downloadspec_tp downloadspec_map(GQuark id, const gchar* filename) {
+	gint fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		perror(filename);
+		return NULL;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(downloadspec_header_t)) {
+		fprintf(stderr, "%s: not a compiled download specification\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	gpointer map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		perror(filename);
+		return NULL;
+	}
+
+	/* check the sizes once, so that downloadspec_get() only checks offsets */
+	const downloadspec_header_t* header = map;
+	guint32 num_servers = GUINT32_FROM_LE(header->num_servers);
+	guint32 num_downloads = GUINT32_FROM_LE(header->num_downloads);
+	guint32 strings_size = GUINT32_FROM_LE(header->strings_size);
+	guint64 expected_size = sizeof(downloadspec_header_t) +
+			(guint64) num_servers * sizeof(downloadspec_server_t) +
+			(guint64) num_downloads * sizeof(downloadspec_entry_t) + strings_size;
+	const gchar* strings = (const gchar*) map + (st.st_size - strings_size);
+
+	if(memcmp(header->magic, DS_MAGIC, DS_MAGIC_LENGTH) != 0 || expected_size != (guint64) st.st_size ||
+			num_downloads == 0 || strings_size == 0 || strings[strings_size - 1] != '\0') {
+		fprintf(stderr, "%s: not a valid compiled download specification\n", filename);
+		munmap(map, (size_t) st.st_size);
+		return NULL;
+	}
+
+	downloadspec_tp ds = g_new0(downloadspec_t, 1);
+	ds->id = id;
+	ds->map = map;
+	ds->map_size = (gsize) st.st_size;
+	ds->num_servers = num_servers;
+	ds->num_downloads = num_downloads;
+	ds->strings_size = strings_size;
+	ds->servers = (const downloadspec_server_t*) (header + 1);
+	ds->entries = (const downloadspec_entry_t*) (ds->servers + num_servers);
+	ds->strings = strings;
+	return ds;
+}
+
+downloadspec_tp downloadspec_acquire(const gchar* filename) {
+	if(filename == NULL) {
+		return NULL;
+	}
+	GQuark id = g_quark_from_string(filename);
+
+	G_LOCK(downloadspec_registry);
+
+	if(downloadspec_registry == NULL) {
+		downloadspec_registry = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	downloadspec_tp ds = g_hash_table_lookup(downloadspec_registry, GUINT_TO_POINTER(id));
+	if(ds == NULL) {
+		ds = downloadspec_map(id, filename);
+		if(ds != NULL) {
+			g_hash_table_insert(downloadspec_registry, GUINT_TO_POINTER(id), ds);
+		}
+	}
+	if(ds != NULL) {
+		ds->shares++;
+	}
+
+	G_UNLOCK(downloadspec_registry);
+
+	return ds;
+}
+
+void downloadspec_release(downloadspec_tp ds) {
+	if(ds == NULL) {
+		return;
+	}
+
+	G_LOCK(downloadspec_registry);
+
+	assert(ds->shares > 0);
+	ds->shares--;
+	if(ds->shares == 0) {
+		g_hash_table_remove(downloadspec_registry, GUINT_TO_POINTER(ds->id));
+		munmap(ds->map, ds->map_size);
+		g_free(ds->lookups);
+		g_free(ds);
+	}
+
+	G_UNLOCK(downloadspec_registry);
+}
+
+guint downloadspec_count(downloadspec_tp ds) {
+	return ds != NULL ? ds->num_downloads : 0;
+}
+
+/* get the server at server_index, looking up its address with hostbyname_cb
+ * if it was stored by name and not looked up yet */
+static const downloadspec_server_t* downloadspec_server(downloadspec_tp ds, guint32 server_index,
+		downloadspec_hostbyname_cb hostbyname_cb, in_addr_t* addr_out, const gchar** hostname_out) {
+	if(server_index >= ds->num_servers) {
+		return NULL;
+	}
+
+	const downloadspec_server_t* server = &ds->servers[server_index];
+	guint32 hostname_offset = GUINT32_FROM_LE(server->hostname_offset);
+	guint32 hostname_length = GUINT32_FROM_LE(server->hostname_length);
+	if(hostname_offset >= ds->strings_size || hostname_length >= ds->strings_size - hostname_offset) {
+		return NULL;
+	}
+	*hostname_out = ds->strings + hostname_offset;
+	*addr_out = server->http_addr;
+
+	if(*addr_out != 0 || (GUINT16_FROM_LE(server->flags) & DS_SERVER_ONION)) {
+		return server;
+	}
+
+	/* stored by name, look it up for all the clients once */
+	G_LOCK(downloadspec_registry);
+	if(ds->lookups != NULL) {
+		*addr_out = ds->lookups[server_index];
+	}
+	G_UNLOCK(downloadspec_registry);
+
+	if(*addr_out == 0) {
+		if(hostbyname_cb == NULL) {
+			return NULL;
+		}
+		in_addr_t addr = (*hostbyname_cb)(*hostname_out);
+		if(addr == 0 || addr == INADDR_NONE) {
+			return NULL;
+		}
+		*addr_out = addr;
+
+		G_LOCK(downloadspec_registry);
+		if(ds->lookups == NULL) {
+			ds->lookups = g_new0(in_addr_t, ds->num_servers);
+		}
+		ds->lookups[server_index] = addr;
+		G_UNLOCK(downloadspec_registry);
+	}
+
+	return server;
+}
+
+gboolean downloadspec_check_servers(downloadspec_tp ds, downloadspec_hostbyname_cb hostbyname_cb,
+		gboolean has_proxy, const gchar** hostname_out) {
+	if(ds == NULL) {
+		return FALSE;
+	}
+
+	for(guint32 i = 0; i < ds->num_servers; i++) {
+		in_addr_t addr = 0;
+		const gchar* hostname = NULL;
+		const downloadspec_server_t* server = downloadspec_server(ds, i, hostbyname_cb, &addr, &hostname);
+		if(server == NULL || (!has_proxy && (GUINT16_FROM_LE(server->flags) & DS_SERVER_ONION))) {
+			if(hostname_out != NULL) {
+				*hostname_out = hostname;
+			}
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+guint downloadspec_count_server(downloadspec_tp ds, guint index, guint* first_out) {
+	if(ds == NULL || index >= ds->num_downloads) {
+		return 0;
+	}
+
+	guint32 server_index = GUINT32_FROM_LE(ds->entries[index].server);
+	if(server_index >= ds->num_servers) {
+		return 0;
+	}
+
+	const downloadspec_server_t* server = &ds->servers[server_index];
+	guint32 first = GUINT32_FROM_LE(server->first_download);
+	guint32 count = GUINT32_FROM_LE(server->num_downloads);
+	if(first >= ds->num_downloads || count > ds->num_downloads - first) {
+		return 0;
+	}
+
+	*first_out = first;
+	return count;
+}
+
+gboolean downloadspec_get(downloadspec_tp ds, guint index,
+		downloadspec_hostbyname_cb hostbyname_cb, downloadspec_download_tp download_out) {
+	if(ds == NULL || index >= ds->num_downloads || download_out == NULL) {
+		return FALSE;
+	}
+
+	const downloadspec_entry_t* entry = &ds->entries[index];
+	guint32 path_offset = GUINT32_FROM_LE(entry->path_offset);
+	if(path_offset >= ds->strings_size) {
+		return FALSE;
+	}
+
+	const downloadspec_server_t* server = downloadspec_server(ds, GUINT32_FROM_LE(entry->server),
+			hostbyname_cb, &download_out->http_addr, &download_out->hostname);
+	if(server == NULL) {
+		return FALSE;
+	}
+
+	download_out->hostname_length = GUINT32_FROM_LE(server->hostname_length);
+	download_out->path = ds->strings + path_offset;
+	download_out->http_port = server->http_port;
+	download_out->onion = (GUINT16_FROM_LE(server->flags) & DS_SERVER_ONION) ? TRUE : FALSE;
+	return TRUE;
+}
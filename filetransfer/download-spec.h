@@ -0,0 +1,77 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#ifndef SHD_DOWNLOAD_SPEC_H_
+#define SHD_DOWNLOAD_SPEC_H_
+
+#include <glib.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+/*
+ * A compiled download specification: the lines "server:port:/path" of a text
+ * download specification file, converted once with downloadspec_compile() to
+ * a binary file that is mapped read-only and shared by all the clients of the
+ * process. Opening it costs the same for any number of lines.
+ *
+ * The file holds a header, a table of the distinct servers, a table of the
+ * downloads (an index in the server table and the offset of the path) grouped
+ * by server, and the host names and paths. Servers given by address, and .onion servers,
+ * need no lookup. The other names are only known inside the simulation, so
+ * they are looked up there, once per server for all the clients.
+ */
+
+/* the first bytes of a compiled download specification file */
+#define DS_MAGIC "FTDSPEC2"
+#define DS_MAGIC_LENGTH 8
+
+typedef struct downloadspec_s downloadspec_t, *downloadspec_tp;
+
+typedef in_addr_t (*downloadspec_hostbyname_cb)(const gchar* hostname);
+
+/* a download of the specification. the strings point into the mapped file */
+typedef struct downloadspec_download_s {
+	const gchar* hostname;
+	gsize hostname_length;
+	const gchar* path;
+	/* both in network order. the address is 0 for .onion servers */
+	in_addr_t http_addr;
+	in_port_t http_port;
+	gboolean onion;
+} downloadspec_download_t, *downloadspec_download_tp;
+
+/* compile the text specification file to the binary one. returns the number
+ * of downloads written, or -1 if the text is malformed or a file fails */
+gint downloadspec_compile(const gchar* text_filename, const gchar* binary_filename);
+
+/* TRUE if the file starts like a compiled download specification */
+gboolean downloadspec_is_compiled(const gchar* filename);
+
+/* map the compiled specification in filename, or get another reference to it
+ * if it is already mapped. returns NULL if it can't be mapped or is not valid */
+downloadspec_tp downloadspec_acquire(const gchar* filename);
+
+/* release a reference from downloadspec_acquire(), the last one unmaps it */
+void downloadspec_release(downloadspec_tp ds);
+
+guint downloadspec_count(downloadspec_tp ds);
+
+/* look up the address of every server stored by name, so that downloads don't
+ * fail later. returns FALSE if one can't be looked up or is a .onion server
+ * while there is no proxy, setting hostname_out to its name if it has one */
+gboolean downloadspec_check_servers(downloadspec_tp ds, downloadspec_hostbyname_cb hostbyname_cb,
+		gboolean has_proxy, const gchar** hostname_out);
+
+/* the number of downloads from the server of the download at index, which
+ * are the ones from first_out on. 0 if index is out of range or corrupt */
+guint downloadspec_count_server(downloadspec_tp ds, guint index, guint* first_out);
+
+/* get the download at index, looking up the address of its server with
+ * hostbyname_cb if it was not yet. returns FALSE if index is out of range, the
+ * entry is corrupt, or the lookup failed */
+gboolean downloadspec_get(downloadspec_tp ds, guint index,
+		downloadspec_hostbyname_cb hostbyname_cb, downloadspec_download_tp download_out);
+
+#endif /* SHD_DOWNLOAD_SPEC_H_ */
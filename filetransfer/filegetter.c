@@ -32,10 +32,10 @@ static const gchar* filegetter_code_strings[] = {
 	"FG_OK_200", "FG_ERR_404"
 };
 
-#define FG_ASSERTBUF(fg, retcode) \
+#define FG_ASSERTBUF(fg, bytes, space) \
 	if(bytes < 0) { \
 		return filegetter_die(fg, "filegetter fatal error: internal io error\n"); \
-	} else if(bytes >= sizeof(fg->buf)) { \
+	} else if(bytes >= space) { \
 		/* truncated, our buffer is way too small, just give up */ \
 		return filegetter_die(fg, "filegetter fatal error: error writing request\n"); \
 	}
@@ -142,7 +142,31 @@ static enum filegetter_code filegetter_disconnect(filegetter_tp fg) {
 	}
 }
 
+static void filegetter_metrics_elapsed(struct timespec* start, struct timespec* end, struct timespec* elapsed) {
+	elapsed->tv_sec = end->tv_sec - start->tv_sec;
+	elapsed->tv_nsec = end->tv_nsec - start->tv_nsec;
+	while(elapsed->tv_nsec < 0) {
+		elapsed->tv_sec--;
+		elapsed->tv_nsec += 1000000000;
+	}
+}
+
+static void filegetter_metrics_connection(filegetter_tp fg) {
+	/* connection statistics, the proxy was done when it was connected if there is none */
+	if(fg->download_connected.tv_sec == 0) {
+		return;
+	}
+	if(fg->download_proxied.tv_sec == 0) {
+		fg->download_proxied = fg->download_connected;
+	}
+
+	filegetter_metrics_elapsed(&fg->download_start, &fg->download_connected, &fg->curstats.connect_time);
+	filegetter_metrics_elapsed(&fg->download_connected, &fg->download_proxied, &fg->curstats.socks_time);
+}
+
 static void filegetter_metrics_first(filegetter_tp fg) {
+	filegetter_metrics_connection(fg);
+
 	/* first byte statistics */
 	fg->curstats.first_byte_time.tv_sec = fg->download_first_byte.tv_sec - fg->download_start.tv_sec;
 	fg->curstats.first_byte_time.tv_nsec = fg->download_first_byte.tv_nsec - fg->download_start.tv_nsec;
@@ -195,14 +219,46 @@ enum filegetter_code filegetter_start(filegetter_tp fg, gint epolld) {
 	return FG_SUCCESS;
 }
 
-static enum filegetter_code filegetter_set_specs(filegetter_tp fg, filegetter_serverspec_tp sspec, filegetter_filespec_tp fspec) {
-	if(fg == NULL || sspec == NULL || fspec == NULL || fg->state != FG_SPEC) {
-		return FG_ERR_INVALID;
+static void filegetter_sink_clear(filegetter_tp fg) {
+	if(fg->sink.checksum != NULL) {
+		g_checksum_free(fg->sink.checksum);
+		fg->sink.checksum = NULL;
+	}
+	if(fg->sink.prefix != NULL) {
+		g_string_free(fg->sink.prefix, TRUE);
+		fg->sink.prefix = NULL;
 	}
+}
 
-	fg->sspec = *sspec;
+static void filegetter_sink_write(filegetter_tp fg, const gchar* body, size_t length) {
+	if(fg->sink.checksum != NULL) {
+		g_checksum_update(fg->sink.checksum, (const guchar*) body, (gssize) length);
+	}
+	if(fg->sink.prefix != NULL && fg->sink.prefix->len < fg->fspec.sink_prefix_size) {
+		size_t space = fg->fspec.sink_prefix_size - fg->sink.prefix->len;
+		g_string_append_len(fg->sink.prefix, body, MIN(length, space));
+	}
+}
+
+const gchar* filegetter_sink_digest(filegetter_tp fg) {
+	return fg->sink.checksum != NULL ? g_checksum_get_string(fg->sink.checksum) : NULL;
+}
+
+const GString* filegetter_sink_prefix(filegetter_tp fg) {
+	return fg->sink.prefix;
+}
+
+static enum filegetter_code filegetter_set_fspec(filegetter_tp fg, filegetter_filespec_tp fspec) {
 	fg->fspec = *fspec;
 
+	/* the sink of the previous file is dropped only now, so it could be read */
+	filegetter_sink_clear(fg);
+	if(fg->fspec.sink == FG_SINK_HASH) {
+		fg->sink.checksum = g_checksum_new(fg->fspec.sink_hash);
+	} else if(fg->fspec.sink == FG_SINK_PREFIX) {
+		fg->sink.prefix = g_string_sized_new(MIN(fg->fspec.sink_prefix_size, FT_BUF_SIZE));
+	}
+
 	if (fg->fspec.save_to_memory) {
 		/* they want us to save what we get to a string */
 		fg->content = g_string_new("");
@@ -216,8 +272,6 @@ static enum filegetter_code filegetter_set_specs(filegetter_tp fg, filegetter_se
 		}
 	}
 
-	fg->buf_read_offset = 0;
-	fg->buf_write_offset = 0;
 	fg->curstats.body_bytes_expected = 0;
 	fg->curstats.body_bytes_downloaded = 0;
 	fg->curstats.bytes_downloaded = 0;
@@ -226,10 +280,90 @@ static enum filegetter_code filegetter_set_specs(filegetter_tp fg, filegetter_se
 	fg->curstats.download_time.tv_nsec = 0;
 	fg->curstats.first_byte_time.tv_sec = 0;
 	fg->curstats.first_byte_time.tv_nsec = 0;
+	memset(&fg->curstats.connect_time, 0, sizeof(struct timespec));
+	memset(&fg->curstats.socks_time, 0, sizeof(struct timespec));
 
 	return FG_SUCCESS;
 }
 
+/* account for body bytes of the current file, and save them where asked */
+static gboolean filegetter_save_body(filegetter_tp fg, const gchar* body, size_t length) {
+	if(length == 0) {
+		return TRUE;
+	}
+
+	if(fg->curstats.body_bytes_downloaded == 0) {
+		/* got first bytes, get timestamp */
+		clock_gettime(CLOCK_REALTIME, &fg->download_first_byte);
+
+		/* compute metrics */
+		filegetter_metrics_first(fg);
+	}
+
+	fg->curstats.body_bytes_downloaded += length;
+	fg->allstats.body_bytes_downloaded += length;
+
+	/* progressed since last time */
+	filegetter_metrics_progress(fg);
+
+	filegetter_sink_write(fg, body, length);
+
+	if (fg->content != NULL) {
+		fg->content = g_string_append_len(fg->content, body, length);
+	}
+
+	if(fg->f != NULL) {
+		size_t bytes_written = fwrite(body, 1, length, fg->f);
+
+		if(bytes_written != length || ferror(fg->f) != 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static void filegetter_clear_pipeline(filegetter_tp fg) {
+	if(fg->pipeline != NULL) {
+		g_queue_free_full(fg->pipeline, g_free);
+		fg->pipeline = NULL;
+	}
+}
+
+static enum filegetter_code filegetter_set_specs(filegetter_tp fg, filegetter_serverspec_tp sspec, filegetter_filespec_tp fspec) {
+	if(fg == NULL || sspec == NULL || fspec == NULL || fg->state != FG_SPEC) {
+		return FG_ERR_INVALID;
+	}
+
+	fg->sspec = *sspec;
+	filegetter_clear_pipeline(fg);
+
+	fg->buf_read_offset = 0;
+	fg->buf_write_offset = 0;
+
+	return filegetter_set_fspec(fg, fspec);
+}
+
+/* move on to the reply of the next pipelined file, whose beginning may
+ * already be in our buffer */
+static enum filegetter_code filegetter_next_pipelined(filegetter_tp fg) {
+	if(fg->f != NULL) {
+		fclose(fg->f);
+		fg->f = NULL;
+	}
+
+	filegetter_filespec_tp fspec = g_queue_pop_head(fg->pipeline);
+	enum filegetter_code result = filegetter_set_fspec(fg, fspec);
+	g_free(fspec);
+
+	/* it was requested with the previous ones, but it only starts now */
+	clock_gettime(CLOCK_REALTIME, &fg->download_start);
+	fg->download_connected = fg->download_start;
+	fg->download_proxied = fg->download_start;
+
+	return result;
+}
+
 static void filegetter_changeEpoll(filegetter_tp fg, gint eventType){
 	struct epoll_event ev;
 	ev.events = eventType;
@@ -244,11 +378,16 @@ enum filegetter_code filegetter_download(filegetter_tp fg, filegetter_serverspec
 
 	/* if connection is still established, we are ready for the HTTP request */
 	if (fg->sspec.persistent && fg->sockd > 0) {
+		clock_gettime(CLOCK_REALTIME, &fg->download_start);
+		fg->download_connected = fg->download_start;
+		fg->download_proxied = fg->download_start;
 		fg->state = FG_REQUEST_HTTP;
 		result = FG_SUCCESS;
 	} else if (result == FG_SUCCESS) {
 		/* start the timer for the download */
 		clock_gettime(CLOCK_REALTIME, &fg->download_start);
+		memset(&fg->download_connected, 0, sizeof(struct timespec));
+		memset(&fg->download_proxied, 0, sizeof(struct timespec));
 		
 		/* if the server spec has socks info, we connect there.
 		 * otherwise we do a direct connection to the fileserver.
@@ -280,6 +419,75 @@ enum filegetter_code filegetter_download(filegetter_tp fg, filegetter_serverspec
 	return result;
 }
 
+enum filegetter_code filegetter_download_pipelined(filegetter_tp fg, filegetter_serverspec_tp sspec, GQueue* fspecs) {
+	if(fspecs == NULL || g_queue_is_empty(fspecs) || g_queue_get_length(fspecs) > FG_PIPELINE_MAX) {
+		return FG_ERR_INVALID;
+	}
+
+	/* the first file is downloaded as usual */
+	GList* item = g_queue_peek_head_link(fspecs);
+	enum filegetter_code result = filegetter_download(fg, sspec, item->data);
+	if(result != FG_SUCCESS) {
+		return result;
+	}
+
+	/* the others are requested along with it */
+	for(item = item->next; item; item = item->next) {
+		if(fg->pipeline == NULL) {
+			fg->pipeline = g_queue_new();
+		}
+		g_queue_push_tail(fg->pipeline, g_memdup(item->data, sizeof(filegetter_filespec_t)));
+	}
+
+	return FG_SUCCESS;
+}
+
+gint filegetter_detach(filegetter_tp fg) {
+	if(fg == NULL || fg->state != FG_SPEC || fg->sockd <= 0) {
+		return -1;
+	}
+
+	if(fg->buf_write_offset > fg->buf_read_offset) {
+		/* the server sent more than we asked for, don't trust it */
+		filegetter_disconnect(fg);
+		return -1;
+	}
+
+	if(fg->f != NULL) {
+		fclose(fg->f);
+		fg->f = NULL;
+	}
+
+	epoll_ctl(fg->epolld, EPOLL_CTL_DEL, fg->sockd, NULL);
+	gint sockd = fg->sockd;
+	fg->sockd = 0;
+	fg->buf_read_offset = 0;
+	fg->buf_write_offset = 0;
+	return sockd;
+}
+
+enum filegetter_code filegetter_attach(filegetter_tp fg, gint sockd) {
+	if(fg == NULL || sockd <= 0 || fg->sockd > 0 || fg->state != FG_SPEC) {
+		return FG_ERR_INVALID;
+	}
+
+	fg->sockd = sockd;
+
+	/* start watching socket */
+	struct epoll_event ev;
+	ev.events = EPOLLOUT;
+	ev.data.fd = sockd;
+	if(epoll_ctl(fg->epolld, EPOLL_CTL_ADD, sockd, &ev) < 0) {
+		perror("epoll_ctl");
+	}
+
+	return FG_SUCCESS;
+}
+
+guint filegetter_pending(filegetter_tp fg) {
+	return fg->pipeline != NULL ? g_queue_get_length(fg->pipeline) : 0;
+}
+
 enum filegetter_code filegetter_activate(filegetter_tp fg) {
 	FG_ASSERTSTATE(fg);
 
@@ -427,6 +635,7 @@ start:
 			}
 
 			/* now we are ready to send the http request */
+			clock_gettime(CLOCK_REALTIME, &fg->download_proxied);
 			fg->state = FG_REQUEST_HTTP;
 			fg->nextstate = FG_REQUEST_HTTP;
 
@@ -434,15 +643,31 @@ start:
 			}
 
 		case FG_REQUEST_HTTP: {
+			/* the replies come next */
+			httpparser_init(&fg->parser, HP_REPLY);
+
 			/* write the request to our buffer */
 			ssize_t space = sizeof(fg->buf) - fg->buf_write_offset;
 			assert(space > 0);
 			gint bytes = snprintf(fg->buf + fg->buf_write_offset, (size_t) space, FT_HTTP_GET_FMT, fg->fspec.remote_path, fg->sspec.http_hostname);
 
-			FG_ASSERTBUF(fg, bytes);
+			FG_ASSERTBUF(fg, bytes, space);
 
 			fg->buf_write_offset += bytes;
 
+			/* and the requests of the pipelined files right behind it */
+			if(fg->pipeline != NULL) {
+				for(GList* item = g_queue_peek_head_link(fg->pipeline); item; item = item->next) {
+					filegetter_filespec_tp fspec = item->data;
+					space = sizeof(fg->buf) - fg->buf_write_offset;
+					bytes = snprintf(fg->buf + fg->buf_write_offset, (size_t) space, FT_HTTP_GET_FMT, fspec->remote_path, fg->sspec.http_hostname);
+
+					FG_ASSERTBUF(fg, bytes, space);
+
+					fg->buf_write_offset += bytes;
+				}
+			}
+
 			/* we are ready to send, then transition to http reply */
 			filegetter_changeEpoll(fg, EPOLLOUT);
 			fg->state = FG_SEND;
@@ -459,13 +684,63 @@ start:
 			}
 
 		case FG_REPLY_HTTP: {
-			fg->buf[fg->buf_write_offset] = '\0';
+			/* the parser keeps its place, so only the new bytes are looked at */
+			enum httpparser_code code = HP_NEED_MORE;
+			while(TRUE) {
+				size_t consumed = 0;
+				code = httpparser_execute(&fg->parser, fg->buf + fg->buf_read_offset,
+						fg->buf_write_offset - fg->buf_read_offset, &consumed);
+				fg->buf_read_offset += consumed;
+
+				if(code == HP_HEADERS_DONE && fg->parser.status == 200) {
+					if(fg->parser.content_length < 0 && !fg->parser.chunked) {
+						/* we need to know where the file ends */
+						return filegetter_die(fg, "filegetter fatal error: malformed http reply\n");
+					}
+					/* chunked replies tell their length at the end */
+					if(fg->parser.content_length > 0) {
+						fg->curstats.body_bytes_expected = (size_t) fg->parser.content_length;
+						fg->allstats.body_bytes_expected += fg->curstats.body_bytes_expected;
+					}
+				} else if(code == HP_BODY && fg->parser.status == 200) {
+					if(!filegetter_save_body(fg, fg->parser.body, fg->parser.body_length)) {
+						return filegetter_die(fg, "filegetter fatal error: file io error\n");
+					}
+				} else if(code != HP_HEADERS_DONE && code != HP_BODY) {
+					break;
+				}
+			}
+
+			if(code == HP_ERROR) {
+				/* malformed reply! */
+				return filegetter_die(fg, "filegetter fatal error: malformed http reply\n");
+			} else if(code == HP_NEED_MORE) {
+				/* we parsed everything, need more, come back here after */
+				fg->buf_read_offset = 0;
+				fg->buf_write_offset = 0;
+				fg->state = FG_RECEIVE;
+				fg->nextstate = FG_REPLY_HTTP;
+				goto start;
+			}
+
+			/* the reply is complete, what follows is the next pipelined one */
+			size_t leftover = fg->buf_write_offset - fg->buf_read_offset;
+			memmove(fg->buf, fg->buf + fg->buf_read_offset, leftover);
+			fg->buf_write_offset = leftover;
+			fg->buf_read_offset = 0;
 
-			/* check for status code */
-			gchar* err404 = strcasestr(fg->buf + fg->buf_read_offset, FT_HTTP_404);
-			if(err404) {
+			if(fg->parser.status != 200) {
 				/* well, that sucks but no file for us */
-				fg->buf_read_offset += FT_HTTP_404_LEN;
+				if(filegetter_pending(fg) > 0) {
+					/* the next reply follows */
+					fg->state = FG_PIPELINE_NEXT;
+					return FG_ERR_404;
+				}
+
+				filegetter_clear_pipeline(fg);
+				if (!fg->sspec.persistent) {
+					filegetter_disconnect(fg);
+				}
 
 				/* need another file spec, then send another http req */
 				fg->state = FG_SPEC;
@@ -474,38 +749,36 @@ start:
 				return FG_ERR_404;
 			}
 
-			/* check if we have the entire reply header */
-			gchar* ok200 = strcasestr(fg->buf + fg->buf_read_offset, FT_HTTP_200);
-			gchar* content = strcasestr(fg->buf + fg->buf_read_offset, FT_2CRLF);
-
-			if(!ok200 || !content) {
-				/* need more, come back here after */
-				fg->state = FG_RECEIVE;
-				fg->nextstate = FG_REPLY_HTTP;
-				goto start;
+			if(fg->parser.chunked) {
+				fg->curstats.body_bytes_expected = fg->curstats.body_bytes_downloaded;
+				fg->allstats.body_bytes_expected += fg->curstats.body_bytes_expected;
 			}
 
-			gchar* payload = content + FT_2CRLF_LEN;
+			/* done downloading, get timestamp */
+			clock_gettime(CLOCK_REALTIME, &fg->download_end);
 
-			/* so now we have the entire header, extract the content length */
-			gchar* cl = strcasestr(fg->buf + fg->buf_read_offset, FT_CONTENT);
+			/* compute metrics */
+			filegetter_metrics_connection(fg);
+			filegetter_metrics_complete(fg);
 
-			if(!cl) {
-				/* malformed reply! */
-				return filegetter_die(fg, "filegetter fatal error: malformed http reply\n");
+			if(filegetter_pending(fg) > 0) {
+				/* the connection carries on with the next reply. the
+				 * caller reads our stats, then activates us again. */
+				fg->state = FG_PIPELINE_NEXT;
+				return FG_OK_200;
 			}
+			filegetter_clear_pipeline(fg);
 
-			cl += FT_CONTENT_LEN;
-			content[0] = '\0';
-			fg->curstats.body_bytes_expected = (size_t) atoi(cl);
-			fg->allstats.body_bytes_expected += fg->curstats.body_bytes_expected;
+			/* if connection is not supposed to be persistent ... */
+			if (!fg->sspec.persistent) {
+				/* ... close it */
+				filegetter_disconnect(fg);
+			}
 
-			/* start reading the buf from the payload */
-			fg->buf_read_offset = payload - fg->buf;
+			/* wait for the next file */
+			fg->state = FG_SPEC;
 
-			/* proceed to finish downloading */
-			fg->state = FG_CHECK_DOWNLOAD;
-			goto start;
+			return FG_OK_200;
 		}
 
 		case FG_SEND: {
@@ -518,6 +791,11 @@ start:
 
 			FG_ASSERTIO(fg, bytes, errno == EWOULDBLOCK || errno == ENOTCONN || errno == EALREADY, FG_ERR_SEND);
 
+			if(bytes > 0 && fg->download_connected.tv_sec == 0) {
+				/* the first bytes that go out, so the connection is established */
+				clock_gettime(CLOCK_REALTIME, &fg->download_connected);
+			}
+
 			fg->buf_read_offset += bytes;
 			fg->curstats.bytes_uploaded += bytes;
 			fg->allstats.bytes_uploaded += bytes;
@@ -536,7 +814,8 @@ start:
 		}
 
 		case FG_RECEIVE: {
-			size_t space = sizeof(fg->buf) - fg->buf_write_offset;
+			/* keep a byte free, our offsets stay within the buffer */
+			size_t space = sizeof(fg->buf) - fg->buf_write_offset - 1;
 
 			/* we will recv from socket and write to buf */
 			gpointer recvpos = fg->buf + fg->buf_write_offset;
@@ -554,65 +833,19 @@ start:
 			goto start;
 		}
 
-		case FG_CHECK_DOWNLOAD: {
-			/* save any bytes from our buffer, and check if we're done */
-			size_t bytes_avail = fg->buf_write_offset - fg->buf_read_offset;
-
-			if(fg->curstats.body_bytes_downloaded == 0 && bytes_avail > 0) {
-				/* got first bytes, get timestamp */
-				clock_gettime(CLOCK_REALTIME, &fg->download_first_byte);
-
-				/* compute metrics */
-				filegetter_metrics_first(fg);
+		case FG_PIPELINE_NEXT: {
+			if(filegetter_next_pipelined(fg) != FG_SUCCESS) {
+				return filegetter_die(fg, "filegetter fatal error: file io error\n");
 			}
 
-			fg->curstats.body_bytes_downloaded += bytes_avail;
-			fg->allstats.body_bytes_downloaded += bytes_avail;
-
-			if(bytes_avail > 0) {
-				/* progressed since last time */
-				filegetter_metrics_progress(fg);
-			}
-			
-			if (fg->content != NULL) {
-				 fg->content = g_string_append_len(fg->content, fg->buf + fg->buf_read_offset, bytes_avail);
-			}
-
-			if(fg->f != NULL) {
-				size_t bytes_written = fwrite(fg->buf + fg->buf_read_offset, 1, (size_t)bytes_avail, fg->f);
-
-				if(bytes_written != bytes_avail || ferror(fg->f) != 0) {
-					return filegetter_die(fg, "filegetter fatal error: file io error\n");
-				}
-			}
-
-			/* we emptied our buffer */
-			fg->buf_write_offset = 0;
-			fg->buf_read_offset = 0;
-
-			if(fg->curstats.body_bytes_downloaded >= fg->curstats.body_bytes_expected) {
-				/* done downloading, get timestamp */
-				clock_gettime(CLOCK_REALTIME, &fg->download_end);
-
-				/* compute metrics */
-				filegetter_metrics_complete(fg);
-
-				/* if connection is not supposed to be persistent ... */
-				if (!fg->sspec.persistent) {
-					/* ... close it */
-					filegetter_disconnect(fg);
-				}
-
-				/* wait for the next file */
-				fg->state = FG_SPEC;
-
-				return FG_OK_200;
+			/* its header may already be here */
+			if(fg->buf_write_offset > 0) {
+				fg->state = FG_REPLY_HTTP;
 			} else {
-				/* need to recv more data */
 				fg->state = FG_RECEIVE;
-				fg->nextstate = FG_CHECK_DOWNLOAD;
-				goto start;
+				fg->nextstate = FG_REPLY_HTTP;
 			}
+			goto start;
 		}
 
 		default:
@@ -630,6 +863,8 @@ enum filegetter_code filegetter_shutdown(filegetter_tp fg) {
 	}
 
 	fg->state = FG_IDLE;
+	filegetter_clear_pipeline(fg);
+	filegetter_sink_clear(fg);
 
 	return filegetter_disconnect(fg);
 }
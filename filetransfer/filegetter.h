@@ -16,6 +16,7 @@
 #include <time.h>
 
 #include "filetransfer-defs.h"
+#include "http-parser.h"
 
 /* TODO explain what these codes mean.
  * Note - they MUST be synced with fileserver_code_strings */
@@ -28,13 +29,17 @@ enum filegetter_code {
 };
 
 enum filegetter_state {
-	FG_IDLE, FG_SPEC, FG_SEND, FG_RECEIVE, FG_CHECK_DOWNLOAD,
+	FG_IDLE, FG_SPEC, FG_SEND, FG_RECEIVE,
 	FG_REQUEST_SOCKS_INIT, FG_TOREPLY_SOCKS_INIT, FG_REPLY_SOCKS_INIT,
 	FG_REQUEST_SOCKS_CONN, FG_TOREPLY_SOCKS_CONN, FG_REPLY_SOCKS_CONN,
-	FG_REQUEST_HTTP, FG_TOREPLY_HTTP, FG_REPLY_HTTP
+	FG_REQUEST_HTTP, FG_TOREPLY_HTTP, FG_REPLY_HTTP, FG_PIPELINE_NEXT
 };
 
 typedef struct filegetter_filestats_s {
+	/* to connect to the first hop and through the socks proxy. both 0 for a
+	 * download on a connection that was already established */
+	struct timespec connect_time;
+	struct timespec socks_time;
 	struct timespec first_byte_time;
 	struct timespec download_time;
 	size_t body_bytes_downloaded;
@@ -43,13 +48,32 @@ typedef struct filegetter_filestats_s {
 	size_t bytes_uploaded;
 } filegetter_filestats_t, *filegetter_filestats_tp;
 
+/* where the body bytes go, besides the file or string of do_save and
+ * save_to_memory. all of them take constant memory. */
+enum filegetter_sink_type {
+	/* only count them */
+	FG_SINK_DISCARD,
+	/* hash them as they come, see filegetter_sink_digest() */
+	FG_SINK_HASH,
+	/* keep the first sink_prefix_size of them, see filegetter_sink_prefix() */
+	FG_SINK_PREFIX
+};
+
 typedef struct filegetter_filespec_s {
 	gchar remote_path[FT_STR_SIZE];
 	gchar local_path[FT_STR_SIZE];
 	guint8 do_save;
 	gboolean save_to_memory;
+	enum filegetter_sink_type sink;
+	GChecksumType sink_hash;
+	size_t sink_prefix_size;
 } filegetter_filespec_t, *filegetter_filespec_tp;
 
+typedef struct filegetter_sink_s {
+	GChecksum* checksum;
+	GString* prefix;
+} filegetter_sink_t, *filegetter_sink_tp;
+
 typedef struct filegetter_serverspec_s {
 	gchar http_hostname[FT_STR_SIZE];
 	in_addr_t http_addr;
@@ -61,19 +85,30 @@ typedef struct filegetter_serverspec_s {
 	gint hostnameLength;
 } filegetter_serverspec_t, *filegetter_serverspec_tp;
 
+/* the most GETs a filegetter writes back-to-back, see filegetter_download_pipelined() */
+#define FG_PIPELINE_MAX 32
+
 typedef struct filegetter_s {
 	filegetter_serverspec_t sspec;
 	filegetter_filespec_t fspec;
+	/* the files requested after fspec on this connection, whose replies come next */
+	GQueue* pipeline;
 	filegetter_filestats_t curstats;
 	filegetter_filestats_t allstats;
+	/* parses the replies as they come in buf */
+	httpparser_t parser;
 	gint sockd;
 	gint epolld;
 	FILE* f;
 	GString* content;
+	filegetter_sink_t sink;
 	gchar buf[FT_BUF_SIZE];
 	size_t buf_write_offset;
 	size_t buf_read_offset;
 	struct timespec download_start;
+	/* 0 until the connection is established and the socks handshake is done */
+	struct timespec download_connected;
+	struct timespec download_proxied;
 	struct timespec download_first_byte;
 	struct timespec download_end;
 	enum filegetter_state state;
@@ -85,10 +120,37 @@ enum filegetter_code filegetter_start(filegetter_tp fg, gint epolld);
 
 enum filegetter_code filegetter_download(filegetter_tp fg, filegetter_serverspec_tp sspec, filegetter_filespec_tp fspec);
 
+/* like filegetter_download(), but for a queue of at most FG_PIPELINE_MAX
+ * filespecs from the same server: all the GETs are written back-to-back on the
+ * connection, and the replies are read in order. filegetter_activate()
+ * returns FG_OK_200 (or FG_ERR_404) once for each of them, and the files are
+ * all done when filegetter_pending() is 0. */
+enum filegetter_code filegetter_download_pipelined(filegetter_tp fg, filegetter_serverspec_tp sspec, GQueue* fspecs);
+
+/* the number of requested files whose reply is still to be read after the current one */
+guint filegetter_pending(filegetter_tp fg);
+
+/* take the connection of a persistent download that completed (state FG_SPEC)
+ * out of the filegetter, to keep it idle elsewhere: it is removed from our
+ * epoll. returns -1 if there is no such connection. */
+gint filegetter_detach(filegetter_tp fg);
+
+/* give the filegetter an established connection (one that was detached), on
+ * which the next persistent download is requested without connecting. */
+enum filegetter_code filegetter_attach(filegetter_tp fg, gint sockd);
+
 enum filegetter_code filegetter_activate(filegetter_tp fg);
 
 enum filegetter_code filegetter_shutdown(filegetter_tp fg);
 
+/* the hex digest of the body of the current (or last completed) file, with
+ * the FG_SINK_HASH sink. NULL with other sinks. */
+const gchar* filegetter_sink_digest(filegetter_tp fg);
+
+/* the first bytes of the body of the current (or last completed) file, with
+ * the FG_SINK_PREFIX sink. NULL with other sinks. */
+const GString* filegetter_sink_prefix(filegetter_tp fg);
+
 enum filegetter_code filegetter_stat_download(filegetter_tp fg, filegetter_filestats_tp stats_out);
 
 enum filegetter_code filegetter_stat_aggregate(filegetter_tp fg, filegetter_filestats_tp stats_out);
@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <errno.h>
@@ -38,6 +39,73 @@ const gchar* fileserver_codetoa(enum fileserver_code fsc) {
 }
 
 
+/* the content of synthetic files, generated once for the whole process */
+static gchar* fileserver_synthetic_block = NULL;
+G_LOCK_DEFINE_STATIC(fileserver_synthetic_block);
+
+static void fileserver_synthetic_init() {
+	G_LOCK(fileserver_synthetic_block);
+	if(fileserver_synthetic_block == NULL) {
+		/* fixed seed, so that every run serves the same bytes */
+		GRand* rand = g_rand_new_with_seed(0);
+		guint32* block = g_malloc(FS_SYNTHETIC_BLOCK_SIZE);
+		for(gint i = 0; i < FS_SYNTHETIC_BLOCK_SIZE / sizeof(guint32); i++) {
+			block[i] = g_rand_int(rand);
+		}
+		g_rand_free(rand);
+		fileserver_synthetic_block = (gchar*) block;
+	}
+	G_UNLOCK(fileserver_synthetic_block);
+}
+
+/* the size of the synthetic file at path: a number of bytes, optionally
+ * followed by a unit and/or an extension. returns FALSE if path is not one. */
+static gboolean fileserver_synthetic_length(const gchar* path, size_t* length_out) {
+	if(path[0] != '/' || !g_ascii_isdigit(path[1])) {
+		return FALSE;
+	}
+
+	gchar* unit = NULL;
+	errno = 0;
+	guint64 length = g_ascii_strtoull(path + 1, &unit, 10);
+	if(errno != 0) {
+		return FALSE;
+	}
+
+	gchar* extension = strchr(unit, '.');
+	size_t unit_len = extension ? (size_t) (extension - unit) : strlen(unit);
+
+	guint64 multiplier = 1;
+	if(unit_len == 0 || (unit_len == 5 && g_ascii_strncasecmp(unit, "bytes", 5) == 0) ||
+			(unit_len == 1 && g_ascii_strncasecmp(unit, "b", 1) == 0)) {
+		multiplier = 1;
+	} else if(unit_len == 3 && g_ascii_strncasecmp(unit, "KiB", 3) == 0) {
+		multiplier = G_GUINT64_CONSTANT(1) << 10;
+	} else if(unit_len == 3 && g_ascii_strncasecmp(unit, "MiB", 3) == 0) {
+		multiplier = G_GUINT64_CONSTANT(1) << 20;
+	} else if(unit_len == 3 && g_ascii_strncasecmp(unit, "GiB", 3) == 0) {
+		multiplier = G_GUINT64_CONSTANT(1) << 30;
+	} else {
+		return FALSE;
+	}
+
+	if(length > G_MAXSIZE / multiplier) {
+		return FALSE;
+	}
+	*length_out = (size_t) (length * multiplier);
+	return TRUE;
+}
+
+static void fileserver_reply_done(fileserver_tp fs, fileserver_connection_tp c, fileserver_progress_tp progress) {
+	c->reply.done = 1;
+	fs->replies_sent++;
+	if(progress) {
+		progress->reply_done = TRUE;
+		progress->changed = TRUE;
+	}
+	c->state = FS_IDLE;
+}
+
 static void fileserver_connection_destroy_cb(gpointer data) {
 	/* cant call fileserve_connection_close since we are walking the ht */
 	fileserver_connection_tp c = data;
@@ -94,6 +162,10 @@ enum fileserver_code fileserver_start(fileserver_tp fs, gint epolld, in_addr_t l
 	fs->listen_port = listen_port;
 	fs->listen_sockd = sockd;
 	strncpy(fs->docroot, docroot, FT_STR_SIZE);
+	fs->synthetic = g_ascii_strcasecmp(docroot, FS_SYNTHETIC_DOCROOT) == 0;
+	if(fs->synthetic) {
+		fileserver_synthetic_init();
+	}
 	fs->connections = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, fileserver_connection_destroy_cb);
 	fs->bytes_sent = 0;
 	fs->bytes_received = 0;
@@ -147,6 +219,7 @@ enum fileserver_code fileserver_accept_one(fileserver_tp fs, gint* sockd_out) {
 	fileserver_connection_tp c = g_new0(fileserver_connection_t, 1);
 	c->sockd = sockd;
 	c->state = FS_IDLE;
+	httpparser_init(&c->request.parser, HP_REQUEST);
 
 	/* start watching socket */
 	struct epoll_event ev;
@@ -212,12 +285,18 @@ start:
 	switch (c->state) {
 
 		case FS_IDLE: {
-			/* reset current state */
-			c->request.buf_write_offset = 0;
+			/* reset current state, keeping what the client already sent of
+			 * its next requests (it may pipeline them) */
+			size_t leftover = c->request.buf_write_offset - c->request.buf_read_offset;
+			memmove(c->request.buf, c->request.buf + c->request.buf_read_offset, leftover);
+			c->request.buf_write_offset = leftover;
 			c->request.buf_read_offset = 0;
+			c->request.buf[leftover] = '\0';
 			c->reply.f = NULL;
 			c->reply.f_length = 0;
 			c->reply.f_read_offset = 0;
+			c->reply.synthetic = FALSE;
+			c->reply.zerocopy = FALSE;
 			c->reply.buf_read_offset = 0;
 			c->reply.buf_write_offset = 0;
 
@@ -231,14 +310,18 @@ start:
 		}
 
 		case FS_REQUEST: {
-			gint space = sizeof(c->request.buf) - c->request.buf_write_offset - 1;
-			if(space <= 0) {
-				/* the request wont fit in our buffer, just give up */
-				c->state = FS_REPLY_404_START;
+			if(c->request.buf_write_offset > c->request.buf_read_offset) {
+				/* the client already sent more, maybe a pipelined request */
+				c->state = FS_REQUEST_PARSE;
 				goto start;
 			}
 
-			ssize_t bytes = recv(c->sockd, c->request.buf + c->request.buf_write_offset, space, 0);
+			/* everything before was parsed, read into a fresh buffer */
+			c->request.buf_read_offset = 0;
+			c->request.buf_write_offset = 0;
+			gint space = sizeof(c->request.buf) - 1;
+
+			ssize_t bytes = recv(c->sockd, c->request.buf, space, 0);
 
 			/* check result */
 			if(bytes < 0) {
@@ -257,7 +340,6 @@ start:
 			c->request.buf_write_offset += bytes;
 			c->request.bytes_received += bytes;
 			fs->bytes_received += bytes;
-			c->request.buf[c->request.buf_write_offset] = '\0';
 
 			if(progress) {
 				progress->bytes_read = c->request.bytes_received;
@@ -265,55 +347,52 @@ start:
 			}
 
 			/* check if the request is all here */
-			gchar* found = strcasestr(c->request.buf, FT_2CRLF);
+			c->state = FS_REQUEST_PARSE;
+			goto start;
+		}
 
-			if(!found) {
+		case FS_REQUEST_PARSE: {
+			/* the parser picks up where it stopped with the previous bytes */
+			enum httpparser_code code = HP_NEED_MORE;
+			do {
+				size_t consumed = 0;
+				code = httpparser_execute(&c->request.parser, c->request.buf + c->request.buf_read_offset,
+						c->request.buf_write_offset - c->request.buf_read_offset, &consumed);
+				c->request.buf_read_offset += consumed;
+			} while(code == HP_HEADERS_DONE || code == HP_BODY);
+
+			if(code == HP_NEED_MORE) {
 				/* need to read more */
 				c->state = FS_REQUEST;
-			} else {
-				/* extract the file path, check http version */
-				gchar* relpath = strcasestr(c->request.buf, "GET ");
-				if(relpath == NULL) {
-					/* malformed */
-					c->state = FS_REPLY_404_START;
-					goto start;
-				}
-
-				relpath += 4;
-
-				gchar* relpath_end = strcasestr(relpath, " ");
-				if(relpath_end == NULL) {
-					/* malformed */
-					c->state = FS_REPLY_404_START;
-					goto start;
-				}
-
-				size_t relpath_len = relpath_end - relpath;
-				size_t filepath_len = sizeof(c->request.filepath) - 1;
-
-				if(relpath_len == 0 || relpath_len > filepath_len) {
-					/* the filename is too long */
-					c->state = FS_REPLY_404_START;
-					goto start;
-				}
-
-				size_t copy_len = relpath_len < filepath_len ? relpath_len : filepath_len;
+				break;
+			} else if(code == HP_ERROR) {
+				/* malformed, forget about what we have */
+				httpparser_init(&c->request.parser, HP_REQUEST);
+				c->request.buf_read_offset = c->request.buf_write_offset;
+				c->state = FS_REPLY_404_START;
+				goto start;
+			}
 
-				strncpy(c->request.filepath, relpath, copy_len);
-				c->request.filepath[copy_len] = '\0';
+			/* we have a complete request, the rest of the buffer is for the next one */
+			httpparser_tp parser = &c->request.parser;
+			if(g_ascii_strcasecmp(parser->method, "GET") != 0 || parser->target_truncated ||
+					strlen(parser->target) >= sizeof(c->request.filepath)) {
+				/* not a GET, or the filename is too long */
+				c->state = FS_REPLY_404_START;
+				goto start;
+			}
 
-				c->request.done = 1;
-				if(progress) {
-					progress->request_done = TRUE;
-					progress->changed = TRUE;
-				}
+			g_strlcpy(c->request.filepath, parser->target, sizeof(c->request.filepath));
 
-				/* re-enter the state machine so we can reply */
-				c->state = FS_REPLY_FILE_START;
-				goto start;
+			c->request.done = 1;
+			if(progress) {
+				progress->request_done = TRUE;
+				progress->changed = TRUE;
 			}
 
-			break;
+			/* re-enter the state machine so we can reply */
+			c->state = FS_REPLY_FILE_START;
+			goto start;
 		}
 
 		case FS_REPLY_404_START: {
@@ -339,6 +418,28 @@ start:
 			ev.data.fd = c->sockd;
 			epoll_ctl(fs->epolld, EPOLL_CTL_MOD, c->sockd, &ev);
 
+			if(fs->synthetic) {
+				if(!fileserver_synthetic_length(c->request.filepath, &c->reply.f_length)) {
+					c->state = FS_REPLY_404_START;
+					goto start;
+				}
+
+				/* only the header goes through the reply buffer */
+				gint bytes = snprintf(c->reply.buf, sizeof(c->reply.buf), FT_HTTP_200_FMT, c->reply.f_length);
+				if(bytes < 0 || bytes >= sizeof(c->reply.buf)) {
+					fileserve_connection_close(fs, c);
+					return FS_ERR_BUFSPACE;
+				}
+				c->reply.buf_write_offset = bytes;
+				c->reply.synthetic = TRUE;
+				if(progress) {
+					progress->reply_length = c->reply.f_length;
+				}
+
+				c->state = FS_REPLY_SEND;
+				goto start;
+			}
+
 			size_t docroot_len = strnlen(fs->docroot, sizeof(fs->docroot));
 			size_t filepath_len = strnlen(c->request.filepath, sizeof(c->request.filepath));
 
@@ -384,6 +485,11 @@ start:
 				c->reply.f = NULL;
 				c->state = FS_REPLY_SEND;
 				goto start;
+			} else if(!fs->sendfile_unsupported) {
+				/* send the header, then let the kernel send the file */
+				c->reply.zerocopy = TRUE;
+				c->state = FS_REPLY_SEND;
+				goto start;
 			} else {
 				/* We need to read and send the file, follow through */
 				c->state = FS_REPLY_FILE_CONTINUE;
@@ -452,15 +558,19 @@ start:
 				c->reply.buf_read_offset = 0;
 				c->reply.buf_write_offset = 0;
 
+				if(c->reply.synthetic && c->reply.f_read_offset < c->reply.f_length) {
+					/* the header is out, now the body */
+					c->state = FS_REPLY_SYNTHETIC_SEND;
+					goto start;
+				}
+				if(c->reply.zerocopy && c->reply.f != NULL) {
+					c->state = FS_REPLY_FILE_SENDFILE;
+					goto start;
+				}
+
 				/* we can exit if we've now sent everything */
 				if(c->reply.f == NULL) {
-					c->reply.done = 1;
-					fs->replies_sent++;
-					if(progress) {
-						progress->reply_done = TRUE;
-						progress->changed = TRUE;
-					}
-					c->state = FS_IDLE;
+					fileserver_reply_done(fs, c, progress);
 					break;
 				}
 			}
@@ -469,6 +579,94 @@ start:
 			goto start;
 		}
 
+		case FS_REPLY_SYNTHETIC_SEND: {
+			/* send straight from the shared block, no copy */
+			size_t offset = c->reply.f_read_offset % FS_SYNTHETIC_BLOCK_SIZE;
+			size_t sendlen = MIN(c->reply.f_length - c->reply.f_read_offset, FS_SYNTHETIC_BLOCK_SIZE - offset);
+
+			ssize_t bytes = send(c->sockd, fileserver_synthetic_block + offset, sendlen, 0);
+
+			/* check result */
+			if(bytes < 0) {
+				if(errno == EWOULDBLOCK) {
+					return FS_ERR_WOULDBLOCK;
+				} else {
+					fileserve_connection_close(fs, c);
+					return FS_ERR_SEND;
+				}
+			} else if(bytes == 0) {
+				/* other side closed */
+				fileserve_connection_close(fs, c);
+				return FS_CLOSED;
+			}
+
+			c->reply.f_read_offset += bytes;
+			c->reply.bytes_sent += bytes;
+			fs->bytes_sent += bytes;
+			if(progress) {
+				progress->bytes_written = c->reply.bytes_sent;
+				progress->changed = TRUE;
+			}
+
+			if(c->reply.f_read_offset == c->reply.f_length) {
+				fileserver_reply_done(fs, c, progress);
+				break;
+			}
+
+			/* send more */
+			goto start;
+		}
+
+		case FS_REPLY_FILE_SENDFILE: {
+			/* sendfile moves the offset we give it, not the one of the stream */
+			off_t offset = (off_t) c->reply.f_read_offset;
+			size_t sendlen = c->reply.f_length - c->reply.f_read_offset;
+
+			ssize_t bytes = sendfile(c->sockd, fileno(c->reply.f), &offset, sendlen);
+
+			/* check result */
+			if(bytes < 0) {
+				if(errno == EWOULDBLOCK) {
+					/* resume from f_read_offset when writable */
+					return FS_ERR_WOULDBLOCK;
+				} else if(errno == EINVAL || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP) {
+					/* the socket does not take sendfile (e.g., it is emulated by
+					 * shadow). copy the rest of this file and the next ones. */
+					fs->sendfile_unsupported = TRUE;
+					c->reply.zerocopy = FALSE;
+					fseek(c->reply.f, (long) c->reply.f_read_offset, SEEK_SET);
+					c->state = FS_REPLY_FILE_CONTINUE;
+					goto start;
+				} else {
+					fileserve_connection_close(fs, c);
+					return FS_ERR_SEND;
+				}
+			} else if(bytes == 0) {
+				/* the file is shorter than when we started */
+				fileserve_connection_close(fs, c);
+				fprintf(stderr, "fileserver fatal error: file io error\n");
+				return FS_ERR_FATAL;
+			}
+
+			c->reply.f_read_offset += bytes;
+			c->reply.bytes_sent += bytes;
+			fs->bytes_sent += bytes;
+			if(progress) {
+				progress->bytes_written = c->reply.bytes_sent;
+				progress->changed = TRUE;
+			}
+
+			if(c->reply.f_read_offset == c->reply.f_length) {
+				fclose(c->reply.f);
+				c->reply.f = NULL;
+				fileserver_reply_done(fs, c, progress);
+				break;
+			}
+
+			/* send more */
+			goto start;
+		}
+
 		default:
 			fprintf(stderr, "fileserver fatal error: unknown connection state\n");
 			return FS_ERR_FATAL;
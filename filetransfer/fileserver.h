@@ -15,6 +15,7 @@
 #include <glib-2.0/glib.h>
 
 #include "filetransfer-defs.h"
+#include "http-parser.h"
 
 /*
  * A minimal http server.
@@ -28,9 +29,16 @@ enum fileserver_code {
 };
 
 enum fileserver_state {
-	FS_IDLE, FS_REQUEST, FS_REPLY_404_START, FS_REPLY_FILE_START, FS_REPLY_FILE_CONTINUE, FS_REPLY_SEND
+	FS_IDLE, FS_REQUEST, FS_REQUEST_PARSE, FS_REPLY_404_START, FS_REPLY_FILE_START, FS_REPLY_FILE_CONTINUE, FS_REPLY_SEND,
+	FS_REPLY_SYNTHETIC_SEND, FS_REPLY_FILE_SENDFILE
 };
 
+/* the docroot that makes the server generate the files instead of reading
+ * them, see fileserver_start() */
+#define FS_SYNTHETIC_DOCROOT "none"
+/* synthetic files repeat a block of this many pseudo-random bytes */
+#define FS_SYNTHETIC_BLOCK_SIZE 65536
+
 typedef struct fileserver_progress_s {
 	gint sockd;
 	gsize bytes_read;
@@ -49,11 +57,17 @@ typedef struct fileserver_reply_s {
 	size_t buf_read_offset;
 	size_t buf_write_offset;
 	size_t bytes_sent;
+	/* the body comes from the synthetic block, f_read_offset bytes of it sent */
+	gboolean synthetic;
+	/* the body goes from f to the socket with sendfile(), f_read_offset bytes of it sent */
+	gboolean zerocopy;
 	gboolean done;
 } fileserver_reply_t, *fileserver_reply_tp;
 
 typedef struct fileserver_request_s {
 	gchar filepath[FT_STR_SIZE];
+	/* parses the requests as they come in buf */
+	httpparser_t parser;
 	gchar buf[FT_STR_SIZE];
 	size_t buf_read_offset;
 	size_t buf_write_offset;
@@ -78,6 +92,10 @@ typedef struct fileserver_s {
 	gint listen_sockd;
 	gint epolld;
 	gchar docroot[FT_STR_SIZE];
+	/* serve generated content instead of the files of the docroot */
+	gboolean synthetic;
+	/* set once sendfile() failed on our sockets, files are then copied through the reply buffer */
+	gboolean sendfile_unsupported;
 	/* client connections keyed by sockd */
 	GHashTable *connections;
 	/* global stats for this server */
@@ -90,6 +108,11 @@ typedef struct fileserver_s {
  *
  * fs must not be null, addr and port are in network order, docroot must be at
  * most FS_STRBUFFER_SIZE including the null byte.
+ *
+ * if docroot is FS_SYNTHETIC_DOCROOT, no file is read: a request for a path
+ * starting with a size, like '/<N>bytes', '/50KiB' or '/1MiB.urnd', is
+ * answered with that many bytes sent straight from one pre-generated block
+ * shared by all connections and servers. other paths get a 404.
  */
 enum fileserver_code fileserver_start(fileserver_tp fs, gint epolld, in_addr_t listen_addr, in_port_t listen_port,
 		gchar* docroot, gint max_connections);
@@ -0,0 +1,27 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#include <glib.h>
+#include <stdio.h>
+
+#include "download-spec.h"
+
+/* converts a text download specification file for the multi client to the
+ * compiled one that clients map instead of parsing it */
+gint main(gint argc, gchar *argv[])
+{
+	if(argc != 3) {
+		fprintf(stderr, "usage: %s pathToDownloadSpec pathToCompiledDownloadSpec\n", argv[0]);
+		return -1;
+	}
+
+	gint num_downloads = downloadspec_compile(argv[1], argv[2]);
+	if(num_downloads < 0) {
+		return -1;
+	}
+
+	printf("compiled %i downloads from %s to %s\n", num_downloads, argv[1], argv[2]);
+	return 0;
+}
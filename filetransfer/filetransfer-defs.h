@@ -17,8 +17,8 @@
 
 #define FT_HTTP_200 "HTTP/1.1 200 OK\r\n"
 #define FT_HTTP_200_LEN 17
-#define FT_HTTP_404 "HTTP/1.1 404 NOT FOUND\r\n"
-#define FT_HTTP_404_LEN 24
+#define FT_HTTP_404 "HTTP/1.1 404 NOT FOUND\r\nContent-Length: 0\r\n\r\n"
+#define FT_HTTP_404_LEN 45
 
 #define FT_2CRLF "\r\n\r\n"
 #define FT_2CRLF_LEN 4
@@ -86,9 +86,10 @@ void filetransfer_new(int argc, char* argv[]) {
 	ft->server = NULL;
 
 	const gchar* USAGE = "\nFiletransfer usage:\n"
-			"\t'server serverListenPort pathToDocRoot'\n"
-			"\t'client single fileServerHostname fileServerPort socksServerHostname(or 'none') socksServerPort nDownloads pathToFile'\n"
-			"\t'client multi pathToDownloadSpec socksServerHostname(or 'none') socksServerPort pathToThinktimeCDF(or 'none') secondsRunTime(or '-1') [nDownloads(or '-1')]'\n";
+			"\t'server serverListenPort pathToDocRoot(or 'none' for synthetic files)'\n"
+			"\t'client single fileServerHostname fileServerPort socksServerHostname(or 'none') socksServerPort nDownloads pathToFile [sink] [keepAliveSeconds] [summarySeconds]'\n"
+			"\t'client multi pathToDownloadSpec socksServerHostname(or 'none') socksServerPort pathToThinktimeCDF(or 'none') secondsRunTime(or '-1') [nDownloads(or '-1')] [pipelineDepth] [sink] [keepAliveSeconds] [nParallel] [summarySeconds]'\n"
+			"\twhere sink is 'discard' (default), 'md5', 'sha1', 'sha256' or 'prefix:N'\n";
 	if(argc < 2) goto printUsage;
 
 	/* parse command line args, first is program name */
@@ -120,6 +121,9 @@ void filetransfer_new(int argc, char* argv[]) {
 			args.socks_proxy.port = argv[6];
 			args.num_downloads = argv[7];
 			args.filepath = _filetransfer_getHomePath(argv[8]);
+			args.sink = argc > 9 ? argv[9] : NULL;
+			args.keepalive_seconds = argc > 10 ? argv[10] : NULL;
+			args.summary_seconds = argc > 11 ? argv[11] : NULL;
 
 			args.log_cb = &_filetransfer_logCallback;
 			args.hostbyname_cb = &_filetransfer_HostnameCallback;
@@ -147,6 +151,21 @@ void filetransfer_new(int argc, char* argv[]) {
 			if(argc > 8) {
 				args.num_downloads = argv[8];
 			}
+			if(argc > 9) {
+				args.pipeline_depth = argv[9];
+			}
+			if(argc > 10) {
+				args.sink = argv[10];
+			}
+			if(argc > 11) {
+				args.keepalive_seconds = argv[11];
+			}
+			if(argc > 12) {
+				args.num_parallel = argv[12];
+			}
+			if(argc > 13) {
+				args.summary_seconds = argv[13];
+			}
 
 			if(g_ascii_strncasecmp(args.thinktimes_cdf_filepath, "none", 4) == 0) {
 				args.thinktimes_cdf_filepath = NULL;
@@ -15,8 +15,11 @@
  * 	"GET /path/to/file HTTP/1.1\r\nHost: www.somehost.com\r\n\r\n"
  *
  * Example http reply we support:
- *  "HTTP/1.1 404 NOT FOUND\r\n"
+ *  "HTTP/1.1 404 NOT FOUND\r\nContent-Length: 0\r\n\r\n"
  *  "HTTP/1.1 200 OK\r\nContent-Length: 17\r\n\r\nSome data payload"
+ *
+ * Both are parsed with the incremental parser of http-parser.h, which also
+ * takes chunked replies.
  */
 
 #include <glib.h>
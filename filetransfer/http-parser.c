@@ -0,0 +1,261 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#include <glib.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "http-parser.h"
+
+static void httpparser_reset(httpparser_tp p) {
+	enum httpparser_type type = p->type;
+	memset(p, 0, sizeof(httpparser_t));
+	p->type = type;
+	p->state = HP_START_LINE;
+	p->content_length = -1;
+}
+
+void httpparser_init(httpparser_tp p, enum httpparser_type type) {
+	p->type = type;
+	httpparser_reset(p);
+}
+
+/* "GET /path HTTP/1.1" or "HTTP/1.1 200 OK" */
+static gboolean httpparser_start_line(httpparser_tp p) {
+	gchar* space = strchr(p->line, ' ');
+	if(space == NULL) {
+		return FALSE;
+	}
+
+	if(p->type == HP_REPLY) {
+		if(g_ascii_strncasecmp(p->line, "HTTP/", 5) != 0 || !g_ascii_isdigit(space[1])) {
+			return FALSE;
+		}
+		p->status = atoi(space + 1);
+		return TRUE;
+	}
+
+	size_t method_len = space - p->line;
+	if(method_len == 0 || method_len >= sizeof(p->method)) {
+		return FALSE;
+	}
+	memcpy(p->method, p->line, method_len);
+	p->method[method_len] = '\0';
+
+	gchar* target = space + 1;
+	gchar* target_end = strchr(target, ' ');
+	if(target_end == NULL) {
+		/* the version is missing, or the line was cut in the target */
+		if(!p->line_truncated) {
+			return FALSE;
+		}
+		target_end = target + strlen(target);
+	}
+
+	size_t target_len = target_end - target;
+	if(target_len == 0) {
+		return FALSE;
+	}
+	if(target_len >= sizeof(p->target) || p->line_truncated) {
+		p->target_truncated = TRUE;
+		target_len = MIN(target_len, sizeof(p->target) - 1);
+	}
+	memcpy(p->target, target, target_len);
+	p->target[target_len] = '\0';
+	return TRUE;
+}
+
+static gboolean httpparser_header_line(httpparser_tp p) {
+	gchar* colon = strchr(p->line, ':');
+	if(colon == NULL) {
+		return FALSE;
+	}
+	*colon = '\0';
+	gchar* name = g_strstrip(p->line);
+	gchar* value = g_strstrip(colon + 1);
+
+	if(g_ascii_strcasecmp(name, "Content-Length") == 0) {
+		gchar* end = NULL;
+		errno = 0;
+		guint64 length = g_ascii_strtoull(value, &end, 10);
+		if(errno != 0 || end == value || *end != '\0' || length > G_MAXINT64) {
+			return FALSE;
+		}
+		p->content_length = (gint64) length;
+	} else if(g_ascii_strcasecmp(name, "Transfer-Encoding") == 0) {
+		/* chunked must be the last coding, the others we don't care about */
+		size_t value_len = strlen(value);
+		p->chunked = value_len >= 7 && g_ascii_strcasecmp(value + value_len - 7, "chunked") == 0;
+	}
+	return TRUE;
+}
+
+/* the state after the header: where and how the body ends */
+static enum httpparser_state httpparser_body_state(httpparser_tp p) {
+	if(p->type == HP_REPLY && (p->status / 100 == 1 || p->status == 204 || p->status == 304)) {
+		return HP_COMPLETE;
+	}
+	if(p->chunked) {
+		return HP_CHUNK_SIZE;
+	}
+	if(p->content_length >= 0) {
+		p->remaining = (guint64) p->content_length;
+		return p->remaining > 0 ? HP_BODY_LENGTH : HP_COMPLETE;
+	}
+	/* a request without length has no body, a reply runs until the close */
+	return p->type == HP_REQUEST ? HP_COMPLETE : HP_BODY_UNTIL_CLOSE;
+}
+
+/* handle the complete line in p->line, according to the state */
+static enum httpparser_code httpparser_line(httpparser_tp p) {
+	switch(p->state) {
+		case HP_START_LINE: {
+			if(p->line_length == 0) {
+				/* tolerate empty lines between messages */
+				return HP_NEED_MORE;
+			}
+			if(!httpparser_start_line(p)) {
+				return HP_ERROR;
+			}
+			p->state = HP_HEADER_LINE;
+			return HP_NEED_MORE;
+		}
+
+		case HP_HEADER_LINE: {
+			if(p->line_length == 0) {
+				p->state = httpparser_body_state(p);
+				return HP_HEADERS_DONE;
+			}
+			/* truncated lines are not ones we need */
+			if(!p->line_truncated && !httpparser_header_line(p)) {
+				return HP_ERROR;
+			}
+			return HP_NEED_MORE;
+		}
+
+		case HP_CHUNK_SIZE: {
+			gchar* end = NULL;
+			errno = 0;
+			p->remaining = g_ascii_strtoull(p->line, &end, 16);
+			if(errno != 0 || end == p->line || (*end != '\0' && *end != ';' && *end != ' ')) {
+				return HP_ERROR;
+			}
+			p->state = p->remaining > 0 ? HP_CHUNK_DATA : HP_CHUNK_TRAILER;
+			return HP_NEED_MORE;
+		}
+
+		case HP_CHUNK_DATA_END: {
+			if(p->line_length != 0) {
+				return HP_ERROR;
+			}
+			p->state = HP_CHUNK_SIZE;
+			return HP_NEED_MORE;
+		}
+
+		case HP_CHUNK_TRAILER: {
+			if(p->line_length == 0) {
+				p->state = HP_COMPLETE;
+			}
+			return HP_NEED_MORE;
+		}
+
+		default:
+			return HP_ERROR;
+	}
+}
+
+enum httpparser_code httpparser_execute(httpparser_tp p, const gchar* data, size_t length, size_t* consumed) {
+	size_t offset = 0;
+	*consumed = 0;
+
+	if(p->state == HP_COMPLETE) {
+		/* the last bytes were handed out, now tell it is over */
+		p->state = HP_FINISHED;
+		return HP_MESSAGE_DONE;
+	}
+	if(p->state == HP_FINISHED) {
+		httpparser_reset(p);
+	}
+
+	while(offset < length) {
+		switch(p->state) {
+			case HP_BODY_LENGTH:
+			case HP_CHUNK_DATA:
+			case HP_BODY_UNTIL_CLOSE: {
+				size_t available = length - offset;
+				size_t body_length = available;
+				if(p->state != HP_BODY_UNTIL_CLOSE && p->remaining < available) {
+					body_length = (size_t) p->remaining;
+				}
+
+				p->body = data + offset;
+				p->body_length = body_length;
+				p->body_bytes += body_length;
+				offset += body_length;
+
+				if(p->state != HP_BODY_UNTIL_CLOSE) {
+					p->remaining -= body_length;
+					if(p->remaining == 0) {
+						p->state = p->state == HP_CHUNK_DATA ? HP_CHUNK_DATA_END : HP_COMPLETE;
+					}
+				}
+
+				*consumed = offset;
+				return HP_BODY;
+			}
+
+			case HP_COMPLETE: {
+				/* whatever follows belongs to the next message */
+				*consumed = offset;
+				p->state = HP_FINISHED;
+				return HP_MESSAGE_DONE;
+			}
+
+			default: {
+				/* take the bytes up to the end of the line, without rescanning them later */
+				const gchar* newline = memchr(data + offset, '\n', length - offset);
+				size_t take = newline ? (size_t) (newline - (data + offset)) : length - offset;
+
+				size_t space = sizeof(p->line) - 1 - p->line_length;
+				if(take > space) {
+					p->line_truncated = TRUE;
+				}
+				memcpy(p->line + p->line_length, data + offset, MIN(take, space));
+				p->line_length += MIN(take, space);
+				offset += take;
+
+				if(newline == NULL) {
+					break;
+				}
+				offset++;
+
+				/* drop the \r of \r\n */
+				if(p->line_length > 0 && p->line[p->line_length - 1] == '\r') {
+					p->line_length--;
+				}
+				p->line[p->line_length] = '\0';
+
+				enum httpparser_code code = httpparser_line(p);
+				p->line_length = 0;
+				p->line_truncated = FALSE;
+
+				if(code != HP_NEED_MORE) {
+					*consumed = offset;
+					return code;
+				}
+				break;
+			}
+		}
+	}
+
+	*consumed = offset;
+	if(p->state == HP_COMPLETE) {
+		p->state = HP_FINISHED;
+		return HP_MESSAGE_DONE;
+	}
+	return HP_NEED_MORE;
+}
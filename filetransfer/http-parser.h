@@ -0,0 +1,82 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#ifndef SHD_HTTP_PARSER_H_
+#define SHD_HTTP_PARSER_H_
+
+#include <glib.h>
+#include <stddef.h>
+
+#include "filetransfer-defs.h"
+
+/*
+ * An incremental HTTP/1.1 message parser, shared by the fileserver (requests)
+ * and the filegetter (replies). Bytes are fed as they are received, each of
+ * them is looked at once, and the parser keeps its position between calls, so
+ * a header may be split across any number of reads. Only the start line and
+ * the header line being parsed are kept, never the whole header.
+ *
+ * Bodies are delimited by Content-Length, by the chunked transfer coding, or
+ * by the end of the connection for replies that have neither.
+ */
+
+/* header lines longer than this are truncated (only the start line matters) */
+#define HP_LINE_SIZE 512
+
+enum httpparser_type {
+	HP_REQUEST, HP_REPLY
+};
+
+enum httpparser_code {
+	/* all the given bytes were parsed, more are needed */
+	HP_NEED_MORE,
+	/* the header is complete, the start line and body info can be read */
+	HP_HEADERS_DONE,
+	/* body and body_length point to body bytes in the given buffer */
+	HP_BODY,
+	/* the message is complete, the next call starts the next message */
+	HP_MESSAGE_DONE,
+	/* the message is malformed */
+	HP_ERROR
+};
+
+enum httpparser_state {
+	HP_START_LINE, HP_HEADER_LINE,
+	HP_BODY_LENGTH, HP_BODY_UNTIL_CLOSE,
+	HP_CHUNK_SIZE, HP_CHUNK_DATA, HP_CHUNK_DATA_END, HP_CHUNK_TRAILER,
+	HP_COMPLETE, HP_FINISHED
+};
+
+typedef struct httpparser_s {
+	enum httpparser_type type;
+	enum httpparser_state state;
+	/* the line being parsed */
+	gchar line[HP_LINE_SIZE];
+	size_t line_length;
+	gboolean line_truncated;
+	/* from the start line */
+	gchar method[16];
+	gchar target[FT_STR_SIZE];
+	gboolean target_truncated;
+	gint status;
+	/* from the header, content_length is -1 if there is none */
+	gint64 content_length;
+	gboolean chunked;
+	/* body bytes left in the current chunk or Content-Length body */
+	guint64 remaining;
+	/* set with HP_BODY */
+	const gchar* body;
+	size_t body_length;
+	guint64 body_bytes;
+} httpparser_t, *httpparser_tp;
+
+/* get ready to parse messages of the given type */
+void httpparser_init(httpparser_tp p, enum httpparser_type type);
+
+/* parse the length bytes at data, up to the next event. consumed is set to the
+ * number of bytes used, the rest must be given again in the next call. */
+enum httpparser_code httpparser_execute(httpparser_tp p, const gchar* data, size_t length, size_t* consumed);
+
+#endif /* SHD_HTTP_PARSER_H_ */
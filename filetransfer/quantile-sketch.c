@@ -0,0 +1,113 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#include <glib.h>
+#include <math.h>
+#include <string.h>
+
+#include "quantile-sketch.h"
+
+/* the bounds of bucket i are gamma^(i-1) and gamma^i */
+static gdouble quantilesketch_gamma(void) {
+	return (1.0 + QS_RELATIVE_ACCURACY) / (1.0 - QS_RELATIVE_ACCURACY);
+}
+
+static gint quantilesketch_index(gdouble value) {
+	return (gint) ceil(log(value) / log(quantilesketch_gamma()));
+}
+
+/* the value of bucket i, within the relative accuracy of all those it counts */
+static gdouble quantilesketch_value(gint index) {
+	gdouble gamma = quantilesketch_gamma();
+	return 2.0 * pow(gamma, (gdouble) index) / (gamma + 1.0);
+}
+
+/* make room for the buckets from first to last, keeping the ones we have */
+static void quantilesketch_extend(quantilesketch_tp qs, gint first, gint last) {
+	if(qs->counts != NULL) {
+		if(first >= qs->offset && last < qs->offset + (gint) qs->length) {
+			return;
+		}
+		first = MIN(first, qs->offset);
+		last = MAX(last, qs->offset + (gint) qs->length - 1);
+	}
+
+	guint length = (guint) (last - first + 1);
+	guint32* counts = g_new0(guint32, length);
+	if(qs->counts != NULL) {
+		memcpy(&counts[qs->offset - first], qs->counts, qs->length * sizeof(guint32));
+		g_free(qs->counts);
+	}
+
+	qs->counts = counts;
+	qs->offset = first;
+	qs->length = length;
+}
+
+static void quantilesketch_add_range(quantilesketch_tp qs, gdouble min, gdouble max, gdouble sum, guint64 count) {
+	if(qs->count == 0) {
+		qs->min = min;
+		qs->max = max;
+	} else {
+		qs->min = MIN(qs->min, min);
+		qs->max = MAX(qs->max, max);
+	}
+	qs->sum += sum;
+	qs->count += count;
+}
+
+void quantilesketch_add(quantilesketch_tp qs, gdouble value) {
+	g_assert(qs);
+
+	quantilesketch_add_range(qs, value, value, value, 1);
+
+	if(value < QS_MIN_VALUE) {
+		qs->zeros++;
+		return;
+	}
+
+	gint index = quantilesketch_index(MIN(value, QS_MAX_VALUE));
+	quantilesketch_extend(qs, index, index);
+	qs->counts[index - qs->offset]++;
+}
+
+gdouble quantilesketch_quantile(const quantilesketch_t* qs, gdouble q) {
+	g_assert(qs);
+
+	if(qs->count == 0) {
+		return 0.0;
+	}
+
+	q = CLAMP(q, 0.0, 1.0);
+	guint64 rank = (guint64) (q * (gdouble) (qs->count - 1));
+
+	if(rank < qs->zeros) {
+		return MAX(qs->min, 0.0);
+	}
+
+	guint64 seen = qs->zeros;
+	for(guint i = 0; i < qs->length; i++) {
+		seen += qs->counts[i];
+		if(seen > rank) {
+			/* the exact extremes are known */
+			return CLAMP(quantilesketch_value(qs->offset + (gint) i), qs->min, qs->max);
+		}
+	}
+
+	return qs->max;
+}
+
+gdouble quantilesketch_mean(const quantilesketch_t* qs) {
+	g_assert(qs);
+	return qs->count > 0 ? qs->sum / (gdouble) qs->count : 0.0;
+}
+
+void quantilesketch_clear(quantilesketch_tp qs) {
+	if(qs == NULL) {
+		return;
+	}
+	g_free(qs->counts);
+	memset(qs, 0, sizeof(quantilesketch_t));
+}
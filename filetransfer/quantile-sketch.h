@@ -0,0 +1,50 @@
+/*
+ * The Shadow Simulator
+ * See LICENSE for licensing information
+ */
+
+#ifndef SHD_QUANTILE_SKETCH_H_
+#define SHD_QUANTILE_SKETCH_H_
+
+#include <glib.h>
+
+/*
+ * A streaming quantile sketch for positive values such as durations. Values
+ * are counted in buckets whose bounds grow geometrically, so that any
+ * quantile is given within QS_RELATIVE_ACCURACY of its true value, whatever
+ * the number of values. Only the buckets between the smallest and the largest
+ * value are kept (a few hundred for values spread over a few orders of
+ * magnitude).
+ *
+ * A zeroed quantilesketch_t is an empty sketch.
+ */
+
+#define QS_RELATIVE_ACCURACY 0.01
+/* values below this one are counted as 0 */
+#define QS_MIN_VALUE 1e-3
+/* values above this one are counted as this one */
+#define QS_MAX_VALUE 1e9
+
+typedef struct quantilesketch_s {
+	/* counts[i] is the number of values in bucket offset + i */
+	guint32* counts;
+	gint offset;
+	guint length;
+	guint64 zeros;
+	guint64 count;
+	gdouble min;
+	gdouble max;
+	gdouble sum;
+} quantilesketch_t, *quantilesketch_tp;
+
+void quantilesketch_add(quantilesketch_tp qs, gdouble value);
+
+/* the value at quantile q in [0, 1], 0 if the sketch is empty */
+gdouble quantilesketch_quantile(const quantilesketch_t* qs, gdouble q);
+
+gdouble quantilesketch_mean(const quantilesketch_t* qs);
+
+/* free the buckets, leaving an empty sketch */
+void quantilesketch_clear(quantilesketch_tp qs);
+
+#endif /* SHD_QUANTILE_SKETCH_H_ */
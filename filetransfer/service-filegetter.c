@@ -13,6 +13,9 @@
 #include <time.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
 /* this service implements a filegetter and may be used inside or outside of shadow */
 #include "service-filegetter.h"
@@ -34,6 +37,11 @@ static void service_filegetter_log(service_filegetter_tp sfg, enum service_fileg
 	}
 }
 
+/* the service a slot belongs to, or the service itself */
+static service_filegetter_tp service_filegetter_root(service_filegetter_tp sfg) {
+	return sfg->parent != NULL ? sfg->parent : sfg;
+}
+
 static void service_filegetter_report(service_filegetter_tp sfg, enum service_filegetter_loglevel level, gchar* preamble, filegetter_filestats_tp stats, gint current_download, gint total_downloads) {
 	if(preamble != NULL && stats != NULL) {
 		GString* reportStringBuffer = g_string_new("");
@@ -56,6 +64,107 @@ static void service_filegetter_report(service_filegetter_tp sfg, enum service_fi
 	}
 }
 
+static const gchar* service_filegetter_size_classes[SFG_SIZE_CLASSES] = {
+	"64KiB", "2MiB", "8MiB", "larger"
+};
+
+static const gchar* service_filegetter_timings[SFG_TIMINGS] = {
+	"connect", "socks", "firstbyte", "download"
+};
+
+static gint service_filegetter_size_class(size_t bytes) {
+	if(bytes <= 64 * 1024) {
+		return 0;
+	} else if(bytes <= 2 * 1024 * 1024) {
+		return 1;
+	} else if(bytes <= 8 * 1024 * 1024) {
+		return 2;
+	} else {
+		return 3;
+	}
+}
+
+static gdouble service_filegetter_milliseconds(struct timespec* t) {
+	return ((gdouble) t->tv_sec) * 1000.0 + ((gdouble) t->tv_nsec) / 1000000.0;
+}
+
+/* count the times of a completed download in the summary */
+static void service_filegetter_record(service_filegetter_tp sfg, filegetter_filestats_tp stats) {
+	quantilesketch_tp timings = sfg->timings[service_filegetter_size_class(stats->body_bytes_downloaded)];
+	quantilesketch_add(&timings[SFG_TIMING_CONNECT], service_filegetter_milliseconds(&stats->connect_time));
+	quantilesketch_add(&timings[SFG_TIMING_SOCKS], service_filegetter_milliseconds(&stats->socks_time));
+	quantilesketch_add(&timings[SFG_TIMING_FIRST_BYTE], service_filegetter_milliseconds(&stats->first_byte_time));
+	quantilesketch_add(&timings[SFG_TIMING_DOWNLOAD], service_filegetter_milliseconds(&stats->download_time));
+}
+
+/* log a line with the median, 90th and 99th percentile of each time, for each
+ * size class that had downloads */
+static void service_filegetter_summarize(service_filegetter_tp sfg) {
+	for(gint c = 0; c < SFG_SIZE_CLASSES; c++) {
+		quantilesketch_tp timings = sfg->timings[c];
+		if(timings[SFG_TIMING_DOWNLOAD].count == 0) {
+			continue;
+		}
+
+		GString* summaryStringBuffer = g_string_new("");
+		g_string_printf(summaryStringBuffer, "[fg-summary] %s: %" G_GUINT64_FORMAT " downloads",
+				service_filegetter_size_classes[c], timings[SFG_TIMING_DOWNLOAD].count);
+
+		for(gint t = 0; t < SFG_TIMINGS; t++) {
+			g_string_append_printf(summaryStringBuffer, ", %s p50/p90/p99 %.1f/%.1f/%.1f ms",
+					service_filegetter_timings[t],
+					quantilesketch_quantile(&timings[t], 0.5),
+					quantilesketch_quantile(&timings[t], 0.9),
+					quantilesketch_quantile(&timings[t], 0.99));
+		}
+
+		service_filegetter_log(sfg, SFG_NOTICE, "%s", summaryStringBuffer->str);
+		g_string_free(summaryStringBuffer, TRUE);
+	}
+}
+
+/* log the final summary in one JSON object, for scripts */
+static void service_filegetter_summarize_json(service_filegetter_tp sfg) {
+	GString* jsonStringBuffer = g_string_new("");
+	g_string_printf(jsonStringBuffer, "{\"downloads\":%i,\"classes\":{", sfg->downloads_completed);
+
+	gboolean first_class = TRUE;
+	for(gint c = 0; c < SFG_SIZE_CLASSES; c++) {
+		quantilesketch_tp timings = sfg->timings[c];
+		if(timings[SFG_TIMING_DOWNLOAD].count == 0) {
+			continue;
+		}
+
+		g_string_append_printf(jsonStringBuffer, "%s\"%s\":{\"count\":%" G_GUINT64_FORMAT,
+				first_class ? "" : ",", service_filegetter_size_classes[c], timings[SFG_TIMING_DOWNLOAD].count);
+		first_class = FALSE;
+
+		for(gint t = 0; t < SFG_TIMINGS; t++) {
+			g_string_append_printf(jsonStringBuffer,
+					",\"%s\":{\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+					service_filegetter_timings[t],
+					quantilesketch_mean(&timings[t]),
+					quantilesketch_quantile(&timings[t], 0.5),
+					quantilesketch_quantile(&timings[t], 0.9),
+					quantilesketch_quantile(&timings[t], 0.99),
+					timings[t].max);
+		}
+		g_string_append(jsonStringBuffer, "}");
+	}
+	g_string_append(jsonStringBuffer, "}}");
+
+	service_filegetter_log(sfg, SFG_NOTICE, "[fg-summary-json] %s", jsonStringBuffer->str);
+	g_string_free(jsonStringBuffer, TRUE);
+}
+
+static void service_filegetter_parse_summary(service_filegetter_tp sfg, const gchar* summary_seconds) {
+	sfg->summary_seconds = summary_seconds ? atoi(summary_seconds) : 0;
+	if(sfg->summary_seconds > 0) {
+		clock_gettime(CLOCK_REALTIME, &sfg->next_summary);
+		sfg->next_summary.tv_sec += sfg->summary_seconds;
+	}
+}
+
 static in_addr_t service_filegetter_getaddr(service_filegetter_tp sfg, service_filegetter_server_args_tp server,
 		service_filegetter_hostbyname_cb hostname_cb) {
 	/* check if we have an address as a string */
@@ -75,6 +184,25 @@ static in_addr_t service_filegetter_getaddr(service_filegetter_tp sfg, service_f
 	}
 }
 
+static void service_filegetter_fill_download(service_filegetter_tp sfg, service_filegetter_download_tp dl,
+		const gchar* hostname, gint hostlength, const gchar* filepath, in_addr_t http_addr, in_port_t http_port,
+		in_addr_t socks_addr, in_port_t socks_port, gboolean isOnionAddress) {
+	memset(dl, 0, sizeof(service_filegetter_download_t));
+	strncpy(dl->fspec.remote_path, filepath, sizeof(dl->fspec.remote_path));
+	dl->fspec.sink = sfg->sink;
+	dl->fspec.sink_hash = sfg->sink_hash;
+	dl->fspec.sink_prefix_size = sfg->sink_prefix_size;
+	/* keep the connection open after the download, for the pool */
+	dl->sspec.persistent = sfg->keepalive_seconds > 0;
+	strncpy(dl->sspec.http_hostname, hostname, sizeof(dl->sspec.http_hostname));
+	dl->sspec.http_addr = http_addr;
+	dl->sspec.http_port = http_port;
+	dl->sspec.socks_addr = socks_addr;
+	dl->sspec.socks_port = socks_port;
+	dl->sspec.useHostname = isOnionAddress;
+	dl->sspec.hostnameLength = hostlength;
+}
+
 static service_filegetter_download_tp service_filegetter_get_download_from_args(
 		service_filegetter_tp sfg, service_filegetter_server_args_tp http_server,
 		service_filegetter_server_args_tp socks_proxy, gchar* filepath,
@@ -122,17 +250,240 @@ static service_filegetter_download_tp service_filegetter_get_download_from_args(
 
 	/* validation successful */
 	service_filegetter_download_tp dl = calloc(1, sizeof(service_filegetter_download_t));
-	strncpy(dl->fspec.remote_path, filepath, sizeof(dl->fspec.remote_path));
-	strncpy(dl->sspec.http_hostname, http_server->host, sizeof(dl->sspec.http_hostname));
-	dl->sspec.http_addr = http_addr;
-	dl->sspec.http_port = http_port;
-	dl->sspec.socks_addr = socks_addr;
-	dl->sspec.socks_port = socks_port;
-	dl->sspec.useHostname = isOnionAddress;
-	dl->sspec.hostnameLength = hostlength;
+	service_filegetter_fill_download(sfg, dl, http_server->host, hostlength, filepath,
+			http_addr, http_port, socks_addr, socks_port, isOnionAddress);
 	return dl;
 }
 
+/* the download at position of the compiled specification, built in buffer */
+static service_filegetter_download_tp service_filegetter_get_compiled_download(service_filegetter_tp sfg,
+		guint position, service_filegetter_download_tp buffer) {
+	downloadspec_download_t download;
+	if(!downloadspec_get(sfg->compiled_downloads, position, sfg->hostbyname_cb, &download)) {
+		service_filegetter_log(sfg, SFG_WARNING, "download %u of the compiled specification is not valid or its server is unknown", position);
+		return NULL;
+	}
+
+	if(download.onion && !sfg->socks_addr) {
+		service_filegetter_log(sfg, SFG_WARNING, "it probably wont work to specify an .onion address without a Tor socks proxy");
+		return NULL;
+	}
+
+	service_filegetter_fill_download(sfg, buffer, download.hostname, (gint) download.hostname_length, download.path,
+			download.http_addr, download.http_port, sfg->socks_addr, sfg->socks_port, download.onion);
+	return buffer;
+}
+
+/* a random download of the specification. the downloads of a compiled one are
+ * built in buffer, and their position is stored in position_out, the others
+ * are the ones of the tree */
+static service_filegetter_download_tp service_filegetter_pick_download(service_filegetter_tp sfg,
+		service_filegetter_download_tp buffer, guint* position_out) {
+	if(sfg->compiled_downloads == NULL) {
+		const gint position = (gint) (rand() % g_tree_nnodes(sfg->downloads));
+		return g_tree_lookup(sfg->downloads, &position);
+	}
+
+	*position_out = (guint) rand() % downloadspec_count(sfg->compiled_downloads);
+	return service_filegetter_get_compiled_download(sfg, *position_out, buffer);
+}
+
+static gboolean service_filegetter_same_server(filegetter_serverspec_tp a, filegetter_serverspec_tp b) {
+	return a->http_addr == b->http_addr && a->http_port == b->http_port &&
+			a->socks_addr == b->socks_addr && a->socks_port == b->socks_port &&
+			g_ascii_strcasecmp(a->http_hostname, b->http_hostname) == 0;
+}
+
+static guint service_filegetter_server_hash(gconstpointer key) {
+	const filegetter_serverspec_t* sspec = key;
+	guint hash = sspec->http_addr ^ ((guint) sspec->http_port << 16) ^ sspec->socks_addr ^ sspec->socks_port;
+	/* the names are compared without case */
+	for(const gchar* c = sspec->http_hostname; *c != '\0'; c++) {
+		hash = hash * 31 + (guint) g_ascii_tolower(*c);
+	}
+	return hash;
+}
+
+static gboolean service_filegetter_server_equal(gconstpointer a, gconstpointer b) {
+	return service_filegetter_same_server((filegetter_serverspec_tp) a, (filegetter_serverspec_tp) b);
+}
+
+static gboolean service_filegetter_index_download(gpointer key, gpointer value, gpointer data) {
+	GHashTable* server_downloads = data;
+	service_filegetter_download_tp dl = value;
+
+	GPtrArray* same_server = g_hash_table_lookup(server_downloads, &dl->sspec);
+	if(same_server == NULL) {
+		same_server = g_ptr_array_new();
+		g_hash_table_insert(server_downloads, &dl->sspec, same_server);
+	}
+	g_ptr_array_add(same_server, dl);
+
+	/* keep going */
+	return FALSE;
+}
+
+static void service_filegetter_free_server_downloads(gpointer data) {
+	g_ptr_array_free((GPtrArray*) data, TRUE);
+}
+
+static void service_filegetter_pool_close(service_filegetter_connection_tp connection) {
+	close(connection->sockd);
+	g_free(connection);
+}
+
+/* close the connections that have been idle for too long */
+static void service_filegetter_pool_expire(service_filegetter_tp sfg) {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	/* oldest first, so we stop at the first one still fresh */
+	service_filegetter_connection_tp connection;
+	while((connection = g_queue_peek_head(sfg->pool)) != NULL &&
+			now.tv_sec - connection->idle_since.tv_sec >= sfg->keepalive_seconds) {
+		g_queue_pop_head(sfg->pool);
+		service_filegetter_log(sfg, SFG_DEBUG, "closing connection to %s idle for %i seconds",
+				connection->sspec.http_hostname, sfg->keepalive_seconds);
+		service_filegetter_pool_close(connection);
+	}
+}
+
+/* keep the connection of the download that just completed, if it is still open */
+static void service_filegetter_pool_park(service_filegetter_tp sfg) {
+	if(sfg->pool == NULL) {
+		return;
+	}
+
+	gint sockd = filegetter_detach(&sfg->fg);
+	if(sockd < 0) {
+		return;
+	}
+
+	service_filegetter_pool_expire(sfg);
+	if(g_queue_get_length(sfg->pool) >= SFG_POOL_MAX) {
+		service_filegetter_pool_close(g_queue_pop_head(sfg->pool));
+	}
+
+	service_filegetter_connection_tp connection = g_new0(service_filegetter_connection_t, 1);
+	connection->sspec = sfg->fg.sspec;
+	connection->sockd = sockd;
+	clock_gettime(CLOCK_REALTIME, &connection->idle_since);
+	g_queue_push_tail(sfg->pool, connection);
+}
+
+/* hand an idle connection to the server of sspec to the filegetter, so the
+ * download skips the connection and socks handshakes */
+static void service_filegetter_pool_take(service_filegetter_tp sfg, filegetter_serverspec_tp sspec) {
+	if(sfg->pool == NULL) {
+		return;
+	}
+
+	service_filegetter_pool_expire(sfg);
+
+	/* the most recently used first */
+	for(GList* item = g_queue_peek_tail_link(sfg->pool); item; item = item->prev) {
+		service_filegetter_connection_tp connection = item->data;
+		if(!service_filegetter_same_server(&connection->sspec, sspec)) {
+			continue;
+		}
+		g_queue_delete_link(sfg->pool, item);
+
+		/* the server may have closed it in the meantime */
+		gchar byte;
+		ssize_t bytes = recv(connection->sockd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+		if(bytes < 0 && (errno == EWOULDBLOCK || errno == EAGAIN) &&
+				filegetter_attach(&sfg->fg, connection->sockd) == FG_SUCCESS) {
+			service_filegetter_log(sfg, SFG_DEBUG, "reusing connection to %s", sspec->http_hostname);
+			g_free(connection);
+		} else {
+			service_filegetter_pool_close(connection);
+		}
+		return;
+	}
+}
+
+/* request the current download along with other random ones from the same
+ * server, all at once on the same connection */
+static enum filegetter_code service_filegetter_download_pipelined(service_filegetter_tp sfg) {
+	service_filegetter_tp root = service_filegetter_root(sfg);
+	gint depth = MIN(sfg->pipeline_depth, FG_PIPELINE_MAX);
+	if(root->downloads_requested > 0) {
+		depth = MAX(1, MIN(depth, root->downloads_requested - root->downloads_completed));
+	}
+
+	GQueue* fspecs = g_queue_new();
+	g_queue_push_tail(fspecs, &sfg->current_download->fspec);
+
+	/* the others are random downloads of the same server. those of a compiled
+	 * specification need a place until they are requested */
+	service_filegetter_download_tp buffers = NULL;
+	GPtrArray* same_server = NULL;
+	guint first = 0, count = 0;
+	if(sfg->compiled_downloads != NULL) {
+		buffers = g_new(service_filegetter_download_t, depth);
+		count = downloadspec_count_server(sfg->compiled_downloads, sfg->current_position, &first);
+	} else {
+		same_server = g_hash_table_lookup(sfg->server_downloads, &sfg->current_download->sspec);
+		count = same_server != NULL ? same_server->len : 0;
+	}
+
+	for(gint i = 1; i < depth && count > 0; i++) {
+		const guint position = (guint) rand() % count;
+		service_filegetter_download_tp dl = same_server != NULL ? g_ptr_array_index(same_server, position) :
+				service_filegetter_get_compiled_download(sfg, first + position, &buffers[i]);
+		if(dl != NULL) {
+			g_queue_push_tail(fspecs, &dl->fspec);
+		}
+	}
+
+	service_filegetter_pool_take(sfg, &sfg->current_download->sspec);
+	enum filegetter_code result = filegetter_download_pipelined(&sfg->fg, &sfg->current_download->sspec, fspecs);
+	service_filegetter_log(sfg, SFG_DEBUG, "filegetter set specs code: %s for %u pipelined files",
+			filegetter_codetoa(result), g_queue_get_length(fspecs));
+	g_queue_free(fspecs);
+	g_free(buffers);
+
+	if(result == FG_SUCCESS) {
+		sfg->state = SFG_DOWNLOADING;
+	}
+
+	return result;
+}
+
+/* the sink is 'discard' (the default), 'md5', 'sha1', 'sha256' (hash the
+ * files), or 'prefix:N' (keep their first N bytes) */
+static gboolean service_filegetter_parse_sink(service_filegetter_tp sfg, const gchar* sink) {
+	sfg->sink = FG_SINK_DISCARD;
+
+	if(sink == NULL || g_ascii_strcasecmp(sink, "discard") == 0) {
+		return TRUE;
+	} else if(g_ascii_strcasecmp(sink, "md5") == 0) {
+		sfg->sink = FG_SINK_HASH;
+		sfg->sink_hash = G_CHECKSUM_MD5;
+	} else if(g_ascii_strcasecmp(sink, "sha1") == 0) {
+		sfg->sink = FG_SINK_HASH;
+		sfg->sink_hash = G_CHECKSUM_SHA1;
+	} else if(g_ascii_strcasecmp(sink, "sha256") == 0) {
+		sfg->sink = FG_SINK_HASH;
+		sfg->sink_hash = G_CHECKSUM_SHA256;
+	} else if(g_ascii_strncasecmp(sink, "prefix:", 7) == 0 && atoi(sink + 7) > 0) {
+		sfg->sink = FG_SINK_PREFIX;
+		sfg->sink_prefix_size = (size_t) atoi(sink + 7);
+	} else {
+		service_filegetter_log(sfg, SFG_CRITICAL, "unknown sink '%s', expected discard, md5, sha1, sha256 or prefix:N", sink);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void service_filegetter_parse_keepalive(service_filegetter_tp sfg, const gchar* keepalive_seconds) {
+	if(keepalive_seconds != NULL && atoi(keepalive_seconds) > 0) {
+		sfg->keepalive_seconds = atoi(keepalive_seconds);
+		sfg->pool = g_queue_new();
+	}
+}
+
 static enum filegetter_code service_filegetter_download_next(service_filegetter_tp sfg) {
 	assert(sfg);
 
@@ -140,18 +491,21 @@ static enum filegetter_code service_filegetter_download_next(service_filegetter_
 
 		case SFG_MULTI: {
 			/* get a new random download */
-			const gint position = (gint) (rand() % g_tree_nnodes(sfg->downloads));
-
-			sfg->current_download = g_tree_lookup(sfg->downloads, &position);
+			sfg->current_download = service_filegetter_pick_download(sfg, &sfg->download_buffer, &sfg->current_position);
 
 			if(sfg->current_download == NULL) {
 				return FG_ERR_INVALID;
 			}
 
+			if(sfg->pipeline_depth > 1) {
+				return service_filegetter_download_pipelined(sfg);
+			}
+
 			/* follow through to set the download */
 		}
 
 		case SFG_SINGLE: {
+			service_filegetter_pool_take(sfg, &sfg->current_download->sspec);
 			enum filegetter_code result = filegetter_download(&sfg->fg, &sfg->current_download->sspec, &sfg->current_download->fspec);
 			service_filegetter_log(sfg, SFG_DEBUG, "filegetter set specs code: %s", filegetter_codetoa(result));
 
@@ -198,6 +552,13 @@ enum filegetter_code service_filegetter_start_single(service_filegetter_tp sfg,
 	sfg->hostbyname_cb = args->hostbyname_cb;
 	sfg->sleep_cb = args->sleep_cb;
 
+	if(!service_filegetter_parse_sink(sfg, args->sink)) {
+		return FG_ERR_INVALID;
+	}
+
+	service_filegetter_parse_keepalive(sfg, args->keepalive_seconds);
+	service_filegetter_parse_summary(sfg, args->summary_seconds);
+
 	/* we download a single file, store our specification in current */
 	sfg->current_download = service_filegetter_get_download_from_args(sfg, &args->http_server, &args->socks_proxy, args->filepath, args->hostbyname_cb);
 	if(sfg->current_download == NULL) {
@@ -280,6 +641,120 @@ static GTree* service_filegetter_import_download_specs(service_filegetter_tp sfg
 	return dlTree;
 }
 
+/* restart the filegetter and try the next download in 60 seconds */
+static enum filegetter_code service_filegetter_pause(service_filegetter_tp sfg) {
+	filegetter_shutdown(&sfg->fg);
+	filegetter_start(&sfg->fg, sfg->fg.epolld);
+
+	/* set wakeup timer and call the sleep function  */
+	sfg->state = SFG_THINKING;
+	clock_gettime(CLOCK_REALTIME, &sfg->wakeup);
+	sfg->wakeup.tv_sec += 60;
+	(*sfg->sleep_cb)(service_filegetter_root(sfg), 60);
+	service_filegetter_log(sfg, SFG_NOTICE, "[fg-pause] pausing for 60 seconds");
+
+	return FG_ERR_WOULDBLOCK;
+}
+
+/* start num_slots downloads in parallel, each in a slot configured like sfg.
+ * the slots that fail to start pause, it is an error if none started */
+static enum filegetter_code service_filegetter_launch_slots(service_filegetter_tp sfg, gint num_slots, gint epolld, gint* sockd_out) {
+	/* we only hold the epoll the slots share */
+	enum filegetter_code result = filegetter_start(&sfg->fg, epolld);
+	sfg->state = SFG_DOWNLOADING;
+
+	sfg->num_slots = num_slots;
+	sfg->slots = g_new0(service_filegetter_t, num_slots);
+	gint num_started = 0;
+
+	for(gint i = 0; i < num_slots; i++) {
+		service_filegetter_tp slot = &sfg->slots[i];
+		slot->parent = sfg;
+		slot->type = sfg->type;
+		slot->state = SFG_NONE;
+		slot->log_cb = sfg->log_cb;
+		slot->hostbyname_cb = sfg->hostbyname_cb;
+		slot->sleep_cb = sfg->sleep_cb;
+		slot->downloads = sfg->downloads;
+		slot->server_downloads = sfg->server_downloads;
+		slot->compiled_downloads = sfg->compiled_downloads;
+		slot->socks_addr = sfg->socks_addr;
+		slot->socks_port = sfg->socks_port;
+		slot->think_times = sfg->think_times;
+		slot->expire = sfg->expire;
+		slot->pipeline_depth = sfg->pipeline_depth;
+		slot->sink = sfg->sink;
+		slot->sink_hash = sfg->sink_hash;
+		slot->sink_prefix_size = sfg->sink_prefix_size;
+		slot->keepalive_seconds = sfg->keepalive_seconds;
+		slot->summary_seconds = sfg->summary_seconds;
+		if(slot->keepalive_seconds > 0) {
+			slot->pool = g_queue_new();
+		}
+
+		gint sockd = -1;
+		enum filegetter_code slot_result = service_filegetter_launch(slot, epolld, &sockd);
+		if(slot_result != FG_SUCCESS) {
+			service_filegetter_log(sfg, SFG_WARNING, "download slot %i not started: %s", i, filegetter_codetoa(slot_result));
+			result = slot_result;
+		} else {
+			num_started++;
+			if(sockd_out != NULL && *sockd_out < 0) {
+				*sockd_out = sockd;
+			}
+		}
+	}
+
+	if(num_started == 0) {
+		service_filegetter_log(sfg, SFG_CRITICAL, "none of the %i download slots started", num_slots);
+		service_filegetter_stop(sfg);
+		return result;
+	}
+
+	/* the others try again later, like after a failed download */
+	for(gint i = 0; i < num_slots; i++) {
+		if(sfg->slots[i].state == SFG_NONE) {
+			service_filegetter_pause(&sfg->slots[i]);
+		}
+	}
+
+	service_filegetter_log(sfg, SFG_NOTICE, "downloading with %i of %i parallel slots", num_started, num_slots);
+	return FG_SUCCESS;
+}
+
+/* the aggregate stats of the service, over all its slots if any */
+static void service_filegetter_stat_aggregate(service_filegetter_tp sfg, filegetter_filestats_tp total) {
+	if(sfg->slots == NULL) {
+		filegetter_stat_aggregate(&sfg->fg, total);
+		return;
+	}
+
+	memset(total, 0, sizeof(filegetter_filestats_t));
+	for(gint i = 0; i < sfg->num_slots; i++) {
+		filegetter_filestats_t stats;
+		filegetter_stat_aggregate(&sfg->slots[i].fg, &stats);
+
+		total->body_bytes_downloaded += stats.body_bytes_downloaded;
+		total->body_bytes_expected += stats.body_bytes_expected;
+		total->bytes_downloaded += stats.bytes_downloaded;
+		total->bytes_uploaded += stats.bytes_uploaded;
+
+		total->first_byte_time.tv_sec += stats.first_byte_time.tv_sec;
+		total->first_byte_time.tv_nsec += stats.first_byte_time.tv_nsec;
+		while(total->first_byte_time.tv_nsec >= 1000000000) {
+			total->first_byte_time.tv_sec++;
+			total->first_byte_time.tv_nsec -= 1000000000;
+		}
+
+		total->download_time.tv_sec += stats.download_time.tv_sec;
+		total->download_time.tv_nsec += stats.download_time.tv_nsec;
+		while(total->download_time.tv_nsec >= 1000000000) {
+			total->download_time.tv_sec++;
+			total->download_time.tv_nsec -= 1000000000;
+		}
+	}
+}
+
 enum filegetter_code service_filegetter_start_multi(service_filegetter_tp sfg,
 		service_filegetter_multi_args_tp args, gint epolld, gint* sockd_out) {
 	assert(sfg);
@@ -302,19 +777,56 @@ enum filegetter_code service_filegetter_start_multi(service_filegetter_tp sfg,
 		return FG_ERR_INVALID;
 	}
 
+	if(!service_filegetter_parse_sink(sfg, args->sink)) {
+		return FG_ERR_INVALID;
+	}
+
+	service_filegetter_parse_keepalive(sfg, args->keepalive_seconds);
+	service_filegetter_parse_summary(sfg, args->summary_seconds);
+
 	if(args->thinktimes_cdf_filepath != NULL) {
-		sfg->think_times = cdf_new(0, args->thinktimes_cdf_filepath);
+		/* parsed once and shared by all the filegetters of the process */
+		sfg->think_times = cdf_acquire(args->thinktimes_cdf_filepath);
 		if(sfg->think_times == NULL) {
 			service_filegetter_log(sfg, SFG_CRITICAL, "problem importing thinktime cdf.");
 			return FG_ERR_INVALID;
 		}
 	}
 
-	sfg->downloads = service_filegetter_import_download_specs(sfg, args);
-	if(sfg->downloads == NULL) {
-		service_filegetter_log(sfg, SFG_CRITICAL, "problem parsing server download specification file. is the format correct?");
-		cdf_free(sfg->think_times);
-		return FG_ERR_INVALID;
+	if(downloadspec_is_compiled(args->server_specification_filepath)) {
+		/* mapped once and shared by all the filegetters of the process */
+		sfg->compiled_downloads = downloadspec_acquire(args->server_specification_filepath);
+		if(sfg->compiled_downloads == NULL) {
+			service_filegetter_log(sfg, SFG_CRITICAL, "problem mapping compiled download specification file.");
+			cdf_release(sfg->think_times);
+			return FG_ERR_INVALID;
+		}
+		if(args->socks_proxy.host != NULL) {
+			sfg->socks_addr = service_filegetter_getaddr(sfg, &args->socks_proxy, args->hostbyname_cb);
+			sfg->socks_port = htons((in_port_t) atoi(args->socks_proxy.port));
+		}
+
+		/* like a bad line of a text specification, a server we can't reach is an error now */
+		const gchar* hostname = NULL;
+		if(!downloadspec_check_servers(sfg->compiled_downloads, args->hostbyname_cb, sfg->socks_addr != 0, &hostname)) {
+			service_filegetter_log(sfg, SFG_CRITICAL, "server '%s' of the compiled download specification can't be used. "
+					"is it known, and is there a socks proxy for .onion servers?", hostname ? hostname : "(corrupt)");
+			downloadspec_release(sfg->compiled_downloads);
+			sfg->compiled_downloads = NULL;
+			cdf_release(sfg->think_times);
+			return FG_ERR_INVALID;
+		}
+	} else {
+		sfg->downloads = service_filegetter_import_download_specs(sfg, args);
+		if(sfg->downloads == NULL) {
+			service_filegetter_log(sfg, SFG_CRITICAL, "problem parsing server download specification file. is the format correct?");
+			cdf_release(sfg->think_times);
+			return FG_ERR_INVALID;
+		}
+
+		sfg->server_downloads = g_hash_table_new_full(service_filegetter_server_hash, service_filegetter_server_equal,
+				NULL, service_filegetter_free_server_downloads);
+		g_tree_foreach(sfg->downloads, service_filegetter_index_download, sfg->server_downloads);
 	}
 
 	gint runtime_seconds = atoi(args->runtime_seconds);
@@ -327,25 +839,79 @@ enum filegetter_code service_filegetter_start_multi(service_filegetter_tp sfg,
 		sfg->downloads_requested = atoi(args->num_downloads);
 	}
 
+	if(args->pipeline_depth) {
+		sfg->pipeline_depth = atoi(args->pipeline_depth);
+	}
+
+	gint num_parallel = args->num_parallel ? atoi(args->num_parallel) : 1;
+	if(num_parallel > 1) {
+		return service_filegetter_launch_slots(sfg, num_parallel, epolld, sockd_out);
+	}
+
 	return service_filegetter_launch(sfg, epolld, sockd_out);
 }
 
 static enum filegetter_code service_filegetter_expire(service_filegetter_tp sfg) {
-	/* all done */
+	/* all done, for all the slots */
+	sfg = service_filegetter_root(sfg);
+	if(sfg->state == SFG_DONE) {
+		return FG_OK_200;
+	}
+
 	filegetter_filestats_t total;
-	filegetter_stat_aggregate(&sfg->fg, &total);
+	service_filegetter_stat_aggregate(sfg, &total);
 
 	/* report aggregate stats */
 	service_filegetter_report(sfg, SFG_NOTICE, "[fg-finished]", &total, sfg->downloads_completed, sfg->downloads_requested);
 
+	if(sfg->summary_seconds > 0) {
+		service_filegetter_summarize(sfg);
+		service_filegetter_summarize_json(sfg);
+	}
+
 	service_filegetter_stop(sfg);
 
 	return FG_OK_200;
 }
 
+/* hand an event to the slots: a socket event to the slot of the socket, a
+ * wakeup (sockd 0) to all the thinking slots */
+static enum filegetter_code service_filegetter_activate_slots(service_filegetter_tp sfg, gint sockd) {
+	if(sfg->state == SFG_DONE) {
+		return FG_ERR_INVALID;
+	}
+
+	if(sockd == 0) {
+		for(gint i = 0; i < sfg->num_slots; i++) {
+			if(sfg->slots[i].state == SFG_THINKING) {
+				service_filegetter_activate(&sfg->slots[i], 0);
+				if(sfg->state == SFG_DONE) {
+					/* that one finished the service */
+					break;
+				}
+			}
+		}
+		return FG_SUCCESS;
+	}
+
+	for(gint i = 0; i < sfg->num_slots; i++) {
+		if(sfg->slots[i].state == SFG_DOWNLOADING && sfg->slots[i].fg.sockd == sockd) {
+			return service_filegetter_activate(&sfg->slots[i], sockd);
+		}
+	}
+	return FG_ERR_INVALID;
+}
+
 enum filegetter_code service_filegetter_activate(service_filegetter_tp sfg, gint sockd) {
 	assert(sfg);
 
+	if(sfg->slots != NULL) {
+		return service_filegetter_activate_slots(sfg, sockd);
+	}
+
+	/* the counts are shared by all the slots of the service */
+	service_filegetter_tp root = service_filegetter_root(sfg);
+
 start_over:
 
 	if((sfg->state == SFG_THINKING || sfg->state == SFG_DOWNLOADING) &&
@@ -363,7 +929,11 @@ start_over:
 		clock_gettime(CLOCK_REALTIME, &now);
 		if(now.tv_sec >= sfg->wakeup.tv_sec) {
 			/* time to wake up and download the next file */
-			service_filegetter_download_next(sfg);
+			enum filegetter_code result = service_filegetter_download_next(sfg);
+			if(result != FG_SUCCESS) {
+				service_filegetter_log(sfg, SFG_WARNING, "next download not started: %s", filegetter_codetoa(result));
+				return service_filegetter_pause(sfg);
+			}
 		} else {
 			return FG_ERR_WOULDBLOCK;
 		}
@@ -377,21 +947,24 @@ reactivate:;
 
 	enum filegetter_code result = filegetter_activate(&sfg->fg);
 
+	if(result == FG_ERR_404 && sfg->type == SFG_MULTI) {
+		service_filegetter_log(sfg, SFG_WARNING, "filegetter got a 404 for '%s', skipping it", sfg->fg.fspec.remote_path);
+		if(sfg->fg.state == FG_PIPELINE_NEXT) {
+			/* the other pipelined files still come */
+			goto reactivate;
+		}
+
+		/* that was the last file, move on like after a completed one */
+		service_filegetter_pool_park(sfg);
+		sfg->state = SFG_THINKING;
+		goto next_download;
+	}
+
 	if(result == FG_ERR_FATAL || result == FG_ERR_SOCKSCONN) {
 		/* it had to shut down */
 		service_filegetter_log(sfg, SFG_NOTICE, "filegetter shutdown due to error '%s'... retrying in 60 seconds",
 				filegetter_codetoa(result));
-		filegetter_shutdown(&sfg->fg);
-		filegetter_start(&sfg->fg, sfg->fg.epolld);
-
-		/* set wakeup timer and call the sleep function  */
-		sfg->state = SFG_THINKING;
-		clock_gettime(CLOCK_REALTIME, &sfg->wakeup);
-		sfg->wakeup.tv_sec += 60;
-		(*sfg->sleep_cb)(sfg, 60);
-		service_filegetter_log(sfg, SFG_NOTICE, "[fg-pause] pausing for 60 seconds");
-
-		return FG_ERR_WOULDBLOCK;
+		return service_filegetter_pause(sfg);
 	} else if(result != FG_OK_200 && result != FG_ERR_WOULDBLOCK) {
 		service_filegetter_log(sfg, SFG_CRITICAL, "filegetter shutdown due to protocol error '%s'...",
 				filegetter_codetoa(result));
@@ -403,25 +976,52 @@ reactivate:;
 	filegetter_filestats_t stats;
 	filegetter_stat_download(&sfg->fg, &stats);
 
-	service_filegetter_report(sfg, SFG_INFO, "[fg-download-progress]", &stats, sfg->downloads_completed+1, sfg->downloads_requested);
+	service_filegetter_report(sfg, SFG_INFO, "[fg-download-progress]", &stats, root->downloads_completed+1, root->downloads_requested);
 
 	if(result == FG_OK_200) {
 		/* completed a download */
-		sfg->downloads_completed++;
+		root->downloads_completed++;
+
+		if(filegetter_pending(&sfg->fg) == 0) {
+			/* idle until the next download, dont watch it meanwhile */
+			service_filegetter_pool_park(sfg);
+		}
 
 		sfg->state = SFG_THINKING;
 
-		/* report completion stats */
-		service_filegetter_report(sfg, SFG_NOTICE, "[fg-download-complete]", &stats, sfg->downloads_completed, sfg->downloads_requested);
+		/* report completion stats, only in the summaries if there are some */
+		service_filegetter_report(sfg, root->summary_seconds > 0 ? SFG_INFO : SFG_NOTICE, "[fg-download-complete]",
+				&stats, root->downloads_completed, root->downloads_requested);
+
+		if(root->summary_seconds > 0) {
+			service_filegetter_record(root, &stats);
+
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			if(now.tv_sec >= root->next_summary.tv_sec) {
+				service_filegetter_summarize(root);
+				root->next_summary.tv_sec = now.tv_sec + root->summary_seconds;
+			}
+		}
+
+		const gchar* digest = filegetter_sink_digest(&sfg->fg);
+		if(digest != NULL) {
+			service_filegetter_log(sfg, SFG_NOTICE, "[fg-download-digest] %s %s", sfg->fg.fspec.remote_path, digest);
+		}
 
-		if(sfg->downloads_requested > 0 &&
-				sfg->downloads_completed >= sfg->downloads_requested) {
+		if(root->downloads_requested > 0 &&
+				root->downloads_completed >= root->downloads_requested) {
 			return service_filegetter_expire(sfg);
+		} else if(filegetter_pending(&sfg->fg) > 0) {
+			/* the next pipelined file is already on its way, think after the last one */
+			sfg->state = SFG_DOWNLOADING;
+			goto reactivate;
 		} else {
+next_download:
 			if(sfg->type == SFG_MULTI && sfg->think_times != NULL) {
 				/* get think time and set wakeup timer */
 				gdouble percentile = (gdouble)(((gdouble)rand()) / ((gdouble)RAND_MAX));
-				guint sleeptime = (guint) (cdf_getValue(sfg->think_times, percentile) / 1000);
+				guint sleeptime = (guint) (cdf_sampleValue(sfg->think_times, percentile) / 1000);
 
 				clock_gettime(CLOCK_REALTIME, &sfg->wakeup);
 				sfg->wakeup.tv_sec += sleeptime;
@@ -432,11 +1032,15 @@ reactivate:;
 				}
 
 				/* call the sleep function, then check if we are done thinking */
-				(*sfg->sleep_cb)(sfg, sleeptime);
+				(*sfg->sleep_cb)(root, sleeptime);
 				goto start_over;
 			} else {
 				/* reset download file */
-				service_filegetter_download_next(sfg);
+				result = service_filegetter_download_next(sfg);
+				if(result != FG_SUCCESS) {
+					service_filegetter_log(sfg, SFG_WARNING, "next download not started: %s", filegetter_codetoa(result));
+					return service_filegetter_pause(sfg);
+				}
 				goto reactivate;
 			}
 		}
@@ -452,14 +1056,46 @@ enum filegetter_code service_filegetter_stop(service_filegetter_tp sfg) {
 
 	enum filegetter_code result = FG_SUCCESS;
 
-	if(sfg->think_times != NULL) {
-		cdf_free(sfg->think_times);
-		sfg->think_times = NULL;
+	if(sfg->slots != NULL) {
+		for(gint i = 0; i < sfg->num_slots; i++) {
+			service_filegetter_stop(&sfg->slots[i]);
+		}
+		g_free(sfg->slots);
+		sfg->slots = NULL;
+		sfg->num_slots = 0;
+	}
+
+	/* the slots only borrow these from their parent */
+	if(sfg->think_times != NULL && sfg->parent == NULL) {
+		cdf_release(sfg->think_times);
 	}
+	sfg->think_times = NULL;
 
-	if(sfg->downloads != NULL) {
+	/* it points into the downloads */
+	if(sfg->server_downloads != NULL && sfg->parent == NULL) {
+		g_hash_table_destroy(sfg->server_downloads);
+	}
+	sfg->server_downloads = NULL;
+
+	if(sfg->downloads != NULL && sfg->parent == NULL) {
 		g_tree_destroy(sfg->downloads);
-		sfg->downloads = NULL;
+	}
+	sfg->downloads = NULL;
+
+	if(sfg->compiled_downloads != NULL && sfg->parent == NULL) {
+		downloadspec_release(sfg->compiled_downloads);
+	}
+	sfg->compiled_downloads = NULL;
+
+	if(sfg->pool != NULL) {
+		g_queue_free_full(sfg->pool, (GDestroyNotify) service_filegetter_pool_close);
+		sfg->pool = NULL;
+	}
+
+	for(gint c = 0; c < SFG_SIZE_CLASSES; c++) {
+		for(gint t = 0; t < SFG_TIMINGS; t++) {
+			quantilesketch_clear(&sfg->timings[c][t]);
+		}
 	}
 
 	if(sfg->state != SFG_DONE) {
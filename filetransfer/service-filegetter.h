@@ -14,6 +14,8 @@
 #include "filetransfer-defs.h"
 #include "filegetter.h"
 #include "cdf.h"
+#include "download-spec.h"
+#include "quantile-sketch.h"
 
 enum service_filegetter_loglevel {
 	SFG_CRITICAL, SFG_WARNING, SFG_NOTICE, SFG_INFO, SFG_DEBUG
@@ -44,6 +46,9 @@ typedef struct service_filegetter_single_args_s {
 	service_filegetter_hostbyname_cb hostbyname_cb;
 	gchar* num_downloads;
 	gchar* filepath;
+	gchar* sink;
+	gchar* keepalive_seconds;
+	gchar* summary_seconds;
 } service_filegetter_single_args_t, *service_filegetter_single_args_tp;
 
 typedef struct service_filegetter_multi_args_s {
@@ -51,6 +56,11 @@ typedef struct service_filegetter_multi_args_s {
 	gchar* thinktimes_cdf_filepath;
 	gchar* runtime_seconds;
 	gchar* num_downloads;
+	gchar* pipeline_depth;
+	gchar* sink;
+	gchar* keepalive_seconds;
+	gchar* num_parallel;
+	gchar* summary_seconds;
 	service_filegetter_server_args_t socks_proxy;
 	service_filegetter_hostbyname_cb hostbyname_cb;
 	service_filegetter_sleep_cb sleep_cb;
@@ -62,11 +72,41 @@ typedef struct service_filegetter_download_s {
 	filegetter_serverspec_t sspec;
 } service_filegetter_download_t, *service_filegetter_download_tp;
 
-typedef struct service_filegetter_s {
+/* the most idle connections a service keeps */
+#define SFG_POOL_MAX 16
+
+/* an established connection, through the socks proxy if any, kept idle
+ * between the downloads from its server */
+typedef struct service_filegetter_connection_s {
+	filegetter_serverspec_t sspec;
+	gint sockd;
+	struct timespec idle_since;
+} service_filegetter_connection_t, *service_filegetter_connection_tp;
+
+/* the times of a download that are summarized, see service_filegetter_summarize() */
+enum service_filegetter_timing {
+	SFG_TIMING_CONNECT, SFG_TIMING_SOCKS, SFG_TIMING_FIRST_BYTE, SFG_TIMING_DOWNLOAD, SFG_TIMINGS
+};
+
+/* downloads are summarized by size: up to 64 KiB, 2 MiB, 8 MiB, and larger */
+#define SFG_SIZE_CLASSES 4
+
+typedef struct service_filegetter_s service_filegetter_t, *service_filegetter_tp;
+
+struct service_filegetter_s {
 	enum service_filegetter_state state;
 	enum service_filegetter_type type;
 	filegetter_t fg;
 	GTree* downloads;
+	/* the downloads of the tree by server (a GPtrArray for each serverspec), to pipeline them */
+	GHashTable* server_downloads;
+	/* used instead of downloads for a compiled specification, the current
+	 * download is then built in download_buffer from its position */
+	downloadspec_tp compiled_downloads;
+	service_filegetter_download_t download_buffer;
+	guint current_position;
+	in_addr_t socks_addr;
+	in_port_t socks_port;
 	service_filegetter_download_tp current_download;
 	service_filegetter_hostbyname_cb hostbyname_cb;
 	service_filegetter_sleep_cb sleep_cb;
@@ -78,7 +118,27 @@ typedef struct service_filegetter_s {
 	gchar log_buffer[1024];
 	gint downloads_requested;
 	gint downloads_completed;
-} service_filegetter_t, *service_filegetter_tp;
+	/* how many files to request at once from the server of a download */
+	gint pipeline_depth;
+	/* what to do with the downloaded bytes, see service_filegetter_parse_sink() */
+	enum filegetter_sink_type sink;
+	GChecksumType sink_hash;
+	size_t sink_prefix_size;
+	/* idle connections for reuse, oldest first. only used if keepalive_seconds > 0 */
+	GQueue* pool;
+	gint keepalive_seconds;
+	/* with parallel downloads, the service runs a slot for each of them: the
+	 * slots share its epoll, downloads, think times and download counts, and
+	 * it hands them their socket events. each slot has its parent set. */
+	service_filegetter_tp slots;
+	gint num_slots;
+	service_filegetter_tp parent;
+	/* if summary_seconds > 0, the times of the downloads in milliseconds, by
+	 * size class, are summarized that often instead of logging each download */
+	gint summary_seconds;
+	struct timespec next_summary;
+	quantilesketch_t timings[SFG_SIZE_CLASSES][SFG_TIMINGS];
+};
 
 enum filegetter_code service_filegetter_start_single(service_filegetter_tp sfg, service_filegetter_single_args_tp args, gint epolld, gint* sockd_out);
 enum filegetter_code service_filegetter_start_multi(service_filegetter_tp sfg, service_filegetter_multi_args_tp args, gint epolld, gint* sockd_out);
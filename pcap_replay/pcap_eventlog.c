@@ -0,0 +1,128 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pcap_eventlog.h"
+
+static const gchar* _pcap_eventlog_type(guint8 type) {
+	switch(type) {
+		case _PCAP_EVENT_SEND:
+			return "send";
+		case _PCAP_EVENT_WRITE:
+			return "write";
+		case _PCAP_EVENT_RECV:
+			return "recv";
+		case _PCAP_EVENT_DROP:
+			return "drop";
+		default:
+			return "unknown";
+	}
+}
+
+Pcap_Eventlog* pcap_eventlog_open(const gchar* path, gchar* ebuf) {
+	gsize length = sizeof(Pcap_Eventlog_Header) + (gsize) PCAP_EVENTLOG_RECORDS * sizeof(Pcap_Event);
+
+	gint fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+		return NULL;
+	}
+	// the file is sparse, the pages are only allocated as the ring fills up
+	if(ftruncate(fd, (off_t) length) < 0) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	gchar* data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: mmap failed: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	Pcap_Eventlog* eventlog = g_new0(Pcap_Eventlog, 1);
+	eventlog->header = (Pcap_Eventlog_Header*) data;
+	eventlog->events = (Pcap_Event*) (data + sizeof(Pcap_Eventlog_Header));
+	eventlog->length = length;
+
+	eventlog->header->magic = PCAP_EVENTLOG_MAGIC;
+	eventlog->header->version = PCAP_EVENTLOG_VERSION;
+	eventlog->header->record_size = sizeof(Pcap_Event);
+	eventlog->header->capacity = PCAP_EVENTLOG_RECORDS;
+	eventlog->header->count = 0;
+	return eventlog;
+}
+
+void pcap_eventlog_append(Pcap_Eventlog* eventlog, _PCAP_EVENT type, guint8 proto,
+		guint32 flow, guint32 length, guint64 time, guint64 scheduled) {
+	Pcap_Event* event = &eventlog->events[eventlog->header->count % PCAP_EVENTLOG_RECORDS];
+	event->time = time;
+	event->scheduled = scheduled;
+	event->flow = flow;
+	event->length = length;
+	event->type = type;
+	event->proto = proto;
+	eventlog->header->count++;
+}
+
+void pcap_eventlog_close(Pcap_Eventlog* eventlog) {
+	if(!eventlog) {
+		return;
+	}
+	munmap(eventlog->header, eventlog->length);
+	g_free(eventlog);
+}
+
+gboolean pcap_eventlog_dump(const gchar* path, FILE* out, gchar* ebuf) {
+	gint fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(Pcap_Eventlog_Header)) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: not an event log", path);
+		close(fd);
+		return FALSE;
+	}
+
+	gchar* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: mmap failed: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	const Pcap_Eventlog_Header* header = (const Pcap_Eventlog_Header*) data;
+	if(header->magic != PCAP_EVENTLOG_MAGIC || header->version != PCAP_EVENTLOG_VERSION
+			|| header->record_size != sizeof(Pcap_Event) || header->capacity == 0
+			|| sizeof(Pcap_Eventlog_Header) + (gsize) header->capacity * sizeof(Pcap_Event) != (gsize)st.st_size) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: corrupted or incompatible event log", path);
+		munmap(data, (size_t)st.st_size);
+		return FALSE;
+	}
+
+	const Pcap_Event* events = (const Pcap_Event*) (data + sizeof(Pcap_Eventlog_Header));
+	guint64 first = header->count > header->capacity ? header->count - header->capacity : 0;
+
+	fprintf(out, "# event\ttime\tscheduled\tlate\ttype\tproto\tflow\tlength\n");
+	for(guint64 n = first; n < header->count; n++) {
+		const Pcap_Event* event = &events[n % header->capacity];
+		gint64 late = event->scheduled ? (gint64) (event->time - event->scheduled) : 0;
+		fprintf(out, "%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT"\t%"G_GINT64_FORMAT"\t%s\t%s\t%u\t%u\n",
+				n, event->time, event->scheduled, late, _pcap_eventlog_type(event->type),
+				event->proto == 0 /* _TCP_PROTO */ ? "tcp" : "udp", event->flow, event->length);
+	}
+
+	munmap(data, (size_t)st.st_size);
+	return TRUE;
+}
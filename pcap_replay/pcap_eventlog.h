@@ -0,0 +1,72 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#ifndef PCAP_EVENTLOG_H_
+#define PCAP_EVENTLOG_H_
+
+#include <stdio.h>
+#include <glib.h>
+#include <pcap.h>
+
+/* An event log is a binary per-packet trace of the replay, cheap enough to be
+ * kept on at full rate: one fixed-size record per event, appended to a ring
+ * that is memory-mapped from a file. Once the ring is full the oldest records
+ * are overwritten, so the file keeps the last PCAP_EVENTLOG_RECORDS events
+ * and never grows. The file is decoded offline with pcap_eventlog_dump().
+ *
+ * The layout is:
+ *   Pcap_Eventlog_Header | Pcap_Event[capacity]
+ * and the event number n (counted from 0) is in slot n % capacity.
+ * Like schedules, event logs are written in host byte order. */
+
+#define PCAP_EVENTLOG_MAGIC 0x56455250 /* "PREV" */
+#define PCAP_EVENTLOG_VERSION 1
+#define PCAP_EVENTLOG_RECORDS (1 << 20) /* Events kept (32 MiB) */
+
+typedef enum _PCAP_EVENT {
+	_PCAP_EVENT_SEND, /* a packet of the trace is handed to its socket (TCP: to its ring) */
+	_PCAP_EVENT_WRITE, /* the last byte of a queued TCP segment is written */
+	_PCAP_EVENT_RECV, /* bytes received from the peer */
+	_PCAP_EVENT_DROP /* a packet of the trace is dropped, its flow is closed or unknown */
+} _PCAP_EVENT;
+
+typedef struct _Pcap_Eventlog_Header {
+	guint32 magic;
+	guint32 version;
+	guint32 record_size; /* sizeof(Pcap_Event) */
+	guint32 capacity; /* number of slots of the ring */
+	guint64 count; /* events appended so far, the next one goes in slot count % capacity */
+	guint64 reserved;
+} Pcap_Eventlog_Header;
+
+typedef struct _Pcap_Event {
+	guint64 time; /* monotonic clock (usec) */
+	guint64 scheduled; /* clock time (usec) at which the packet was due, 0 if it does not apply */
+	guint32 flow; /* flow of the packet in the schedule */
+	guint32 length; /* payload bytes */
+	guint8 type; /* _PCAP_EVENT */
+	guint8 proto; /* _PROTO */
+	guint8 reserved[6];
+} Pcap_Event;
+
+typedef struct _Pcap_Eventlog {
+	Pcap_Eventlog_Header* header;
+	Pcap_Event* events;
+	gsize length; /* of the mapping */
+} Pcap_Eventlog;
+
+/* Create (or truncate) the event log file at path and map it. On error, NULL
+ * is returned and ebuf (PCAP_ERRBUF_SIZE) holds the reason. */
+Pcap_Eventlog* pcap_eventlog_open(const gchar* path, gchar* ebuf);
+
+void pcap_eventlog_append(Pcap_Eventlog* eventlog, _PCAP_EVENT type, guint8 proto,
+		guint32 flow, guint32 length, guint64 time, guint64 scheduled);
+
+void pcap_eventlog_close(Pcap_Eventlog* eventlog);
+
+/* Decode the event log file at path to out, one line per event from the
+ * oldest one kept. On error, FALSE is returned and ebuf holds the reason. */
+gboolean pcap_eventlog_dump(const gchar* path, FILE* out, gchar* ebuf);
+
+#endif /* PCAP_EVENTLOG_H_ */
@@ -0,0 +1,293 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+/* pcap_prepare: get a directory of traces ready for the replay, in parallel.
+ * For each trace, the client and its local network are guessed from the
+ * trace itself, the trace is indexed into a schedule file, and a line with
+ * the plugin arguments and the statistics of the trace goes to a manifest. */
+
+#include "pcap_replay.h"
+#include "pcap_stream.h"
+
+#define PCAP_PREPARE_SCAN_PACKETS 100000 // Packets looked at to guess the client of a trace
+#define PCAP_PREPARE_MANIFEST "manifest.tsv"
+
+static const gchar* USAGE = "USAGE: [--threads=<n>] [--filter=<bpf>] <trace_dir> <output_dir>\n";
+
+/* One trace of the directory, filled in by a worker */
+typedef struct _Pcap_Prepare_Trace {
+	gchar* path;
+	gchar* schedulePath;
+	gchar* error;
+
+	Pcap_Schedule_Filter filter;
+	guint prefix; /* of the local network */
+
+	guint64 packets;
+	guint32 tcpFlows;
+	guint32 udpFlows;
+	guint64 clientBytes; /* payload bytes sent by the client */
+	guint64 serverBytes; /* payload bytes sent back to the client */
+	guint64 duration; /* usec, between the first and the last packet kept */
+} Pcap_Prepare_Trace;
+
+/* the local network a client address belongs to: its private range, if any */
+static guint _pcap_prepare_local_network(struct in_addr client, struct in_addr* nw_addr) {
+	guint32 addr = ntohl(client.s_addr);
+	guint prefix = 32;
+
+	if((addr & 0xFF000000) == 0x0A000000) {
+		prefix = 8; // 10.0.0.0/8
+	} else if((addr & 0xFFF00000) == 0xAC100000) {
+		prefix = 12; // 172.16.0.0/12
+	} else if((addr & 0xFFFF0000) == 0xC0A80000) {
+		prefix = 16; // 192.168.0.0/16
+	}
+
+	nw_addr->s_addr = htonl(prefix == 32 ? addr : addr & ~((1u << (32 - prefix)) - 1));
+	return prefix;
+}
+
+/* Guess the client of a trace: captures are taken on (or for) one host, so
+ * it is the address seen in the most TCP/UDP packets, as source or destination */
+static gboolean _pcap_prepare_find_client(Pcap_Prepare_Trace* trace, gchar* ebuf) {
+	Pcap_Stream* stream = pcap_stream_open(trace->path, ebuf);
+	if(stream == NULL) {
+		return FALSE;
+	}
+	if(pcap_datalink(stream->pcap) != DLT_EN10MB) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: only ethernet captures are supported", trace->path);
+		pcap_stream_close(stream);
+		return FALSE;
+	}
+
+	// address -> packets, both in the key/value pointers
+	GHashTable* seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	struct pcap_pkthdr *header;
+	const u_char *pkt_data;
+	guint scanned = 0;
+
+	while(scanned < PCAP_PREPARE_SCAN_PACKETS && pcap_next_ex(stream->pcap, &header, &pkt_data) >= 0) {
+		if(header->caplen < SIZE_ETHERNET + 20) {
+			continue;
+		}
+		const struct sniff_ethernet *ethernet = (const struct sniff_ethernet*)(pkt_data);
+		const struct sniff_ip *ip = (const struct sniff_ip*)(pkt_data + SIZE_ETHERNET);
+		if(ntohs(ethernet->ether_type) != 0x0800 || (ip->ip_p != IPPROTO_TCP && ip->ip_p != IPPROTO_UDP)) {
+			continue;
+		}
+
+		in_addr_t addrs[2] = {ip->ip_src.s_addr, ip->ip_dst.s_addr};
+		for(gint i = 0; i < 2; i++) {
+			gpointer key = GUINT_TO_POINTER(addrs[i]);
+			g_hash_table_insert(seen, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(g_hash_table_lookup(seen, key)) + 1));
+		}
+		scanned++;
+	}
+	pcap_stream_close(stream);
+
+	guint best = 0;
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, seen);
+	while(g_hash_table_iter_next(&iter, &key, &value)) {
+		if(GPOINTER_TO_UINT(value) > best) {
+			best = GPOINTER_TO_UINT(value);
+			trace->filter.client_IP_in_pcap.s_addr = GPOINTER_TO_UINT(key);
+		}
+	}
+	g_hash_table_destroy(seen);
+
+	if(best == 0) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: no TCP or UDP packet", trace->path);
+		return FALSE;
+	}
+
+	trace->prefix = _pcap_prepare_local_network(trace->filter.client_IP_in_pcap, &trace->filter.pcap_local_nw_addr);
+	trace->filter.pcap_local_nw_mask = (guint32) 1 << (32 - trace->prefix);
+	return TRUE;
+}
+
+static void _pcap_prepare_count(Pcap_Prepare_Trace* trace, const Pcap_Schedule* schedule) {
+	trace->packets = pcap_schedule_length(schedule);
+	for(guint64 i = 0; i < trace->packets; i++) {
+		const Pcap_Schedule_Record* record = &schedule->records[i];
+		if(record->direction == _CLIENT_TO_SERVER) {
+			trace->clientBytes += record->payload_size;
+		} else {
+			trace->serverBytes += record->payload_size;
+		}
+	}
+	if(trace->packets > 0) {
+		trace->duration = schedule->records[trace->packets - 1].timestamp - schedule->records[0].timestamp;
+	}
+	for(guint32 i = 0; i < pcap_schedule_flow_count(schedule); i++) {
+		if(schedule->flows[i].proto == IPPROTO_TCP) {
+			trace->tcpFlows++;
+		} else {
+			trace->udpFlows++;
+		}
+	}
+}
+
+/* GThreadPool worker: guess the client, index and write the schedule of a trace */
+static void _pcap_prepare_trace(gpointer data, gpointer userData) {
+	Pcap_Prepare_Trace* trace = data;
+	char ebuf[PCAP_ERRBUF_SIZE];
+
+	if(!_pcap_prepare_find_client(trace, ebuf)) {
+		trace->error = g_strdup(ebuf);
+		return;
+	}
+
+	Pcap_Schedule* schedule = pcap_schedule_new_from_pcap(trace->path, &trace->filter, ebuf);
+	if(schedule == NULL) {
+		trace->error = g_strdup(ebuf);
+		return;
+	}
+
+	_pcap_prepare_count(trace, schedule);
+	if(!pcap_schedule_write(schedule, trace->schedulePath, ebuf)) {
+		trace->error = g_strdup(ebuf);
+	}
+	pcap_schedule_free(schedule);
+}
+
+static gboolean _pcap_prepare_write_manifest(GPtrArray* traces, const gchar* path) {
+	FILE* manifest = fopen(path, "w");
+	if(manifest == NULL) {
+		g_printerr("Unable to write the manifest %s: %s\n", path, strerror(errno));
+		return FALSE;
+	}
+
+	guint64 packets = 0, bytes = 0, duration = 0;
+	guint prepared = 0;
+
+	fprintf(manifest, "# trace\tschedule\tclient_ip\tnw_addr\tnw_prefix\tpackets\ttcp_flows\tudp_flows\tclient_bytes\tserver_bytes\tduration_usec\n");
+	for(guint i = 0; i < traces->len; i++) {
+		Pcap_Prepare_Trace* trace = g_ptr_array_index(traces, i);
+		if(trace->error) {
+			continue;
+		}
+		gchar client[INET_ADDRSTRLEN], nw_addr[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &trace->filter.client_IP_in_pcap, client, INET_ADDRSTRLEN);
+		inet_ntop(AF_INET, &trace->filter.pcap_local_nw_addr, nw_addr, INET_ADDRSTRLEN);
+
+		fprintf(manifest, "%s\t%s\t%s\t%s\t%u\t%"G_GUINT64_FORMAT"\t%u\t%u\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT"\t%"G_GUINT64_FORMAT"\n",
+				trace->path, trace->schedulePath, client, nw_addr, trace->prefix, trace->packets,
+				trace->tcpFlows, trace->udpFlows, trace->clientBytes, trace->serverBytes, trace->duration);
+
+		prepared++;
+		packets += trace->packets;
+		bytes += trace->clientBytes + trace->serverBytes;
+		duration += trace->duration;
+	}
+	fprintf(manifest, "# total\t%u traces\t%"G_GUINT64_FORMAT" packets\t%"G_GUINT64_FORMAT" bytes\t%"G_GUINT64_FORMAT" usec\n",
+			prepared, packets, bytes, duration);
+	fclose(manifest);
+
+	g_print("Prepared %u of %u traces: %"G_GUINT64_FORMAT" packets, %"G_GUINT64_FORMAT" payload bytes, %"G_GUINT64_FORMAT" usec of traffic\n",
+			prepared, traces->len, packets, bytes, duration);
+	return TRUE;
+}
+
+static gint _pcap_prepare_compare_names(gconstpointer a, gconstpointer b) {
+	return g_strcmp0(*(const gchar**) a, *(const gchar**) b);
+}
+
+int main(int argc, char *argv[]) {
+	gint threads = g_get_num_processors();
+	gchar* expression = NULL;
+	gint arg_idx = 1;
+
+	/* Optional arguments come first and start with '--' */
+	while(arg_idx < argc && g_str_has_prefix(argv[arg_idx], "--")) {
+		if(g_str_has_prefix(argv[arg_idx], "--threads=")) {
+			threads = atoi(argv[arg_idx] + strlen("--threads="));
+		} else if(g_str_has_prefix(argv[arg_idx], "--filter=")) {
+			// same syntax as the plugin option, commas stand for spaces
+			g_free(expression);
+			expression = g_strdelimit(g_strdup(argv[arg_idx] + strlen("--filter=")), ",", ' ');
+		} else {
+			g_printerr("Unknown option '%s'. %s", argv[arg_idx], USAGE);
+			return -1;
+		}
+		arg_idx++;
+	}
+	if(argc - arg_idx != 2 || threads < 1) {
+		g_printerr("%s", USAGE);
+		return -1;
+	}
+	const gchar* traceDir = argv[arg_idx];
+	const gchar* outputDir = argv[arg_idx + 1];
+
+	GError* error = NULL;
+	GDir* dir = g_dir_open(traceDir, 0, &error);
+	if(dir == NULL) {
+		g_printerr("Unable to open %s: %s\n", traceDir, error->message);
+		g_error_free(error);
+		return -1;
+	}
+	if(g_mkdir_with_parents(outputDir, 0755) < 0) {
+		g_printerr("Unable to create %s: %s\n", outputDir, strerror(errno));
+		g_dir_close(dir);
+		return -1;
+	}
+
+	// the traces, sorted so that the manifest does not depend on the directory order
+	GPtrArray* names = g_ptr_array_new_with_free_func(g_free);
+	const gchar* name;
+	while((name = g_dir_read_name(dir))) {
+		gchar* path = g_build_filename(traceDir, name, NULL);
+		if(g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+			g_ptr_array_add(names, g_strdup(name));
+		}
+		g_free(path);
+	}
+	g_dir_close(dir);
+	g_ptr_array_sort(names, _pcap_prepare_compare_names);
+
+	GPtrArray* traces = g_ptr_array_new();
+	for(guint i = 0; i < names->len; i++) {
+		name = g_ptr_array_index(names, i);
+		Pcap_Prepare_Trace* trace = g_new0(Pcap_Prepare_Trace, 1);
+		gchar* scheduleName = g_strconcat(name, ".schedule", NULL);
+		trace->path = g_build_filename(traceDir, name, NULL);
+		trace->schedulePath = g_build_filename(outputDir, scheduleName, NULL);
+		trace->filter.expression = expression;
+		g_free(scheduleName);
+		g_ptr_array_add(traces, trace);
+	}
+
+	// the traces are independent, a pool of workers indexes them in parallel
+	GThreadPool* pool = g_thread_pool_new(_pcap_prepare_trace, NULL, threads, TRUE, NULL);
+	for(guint i = 0; i < traces->len; i++) {
+		g_thread_pool_push(pool, g_ptr_array_index(traces, i), NULL);
+	}
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	for(guint i = 0; i < traces->len; i++) {
+		Pcap_Prepare_Trace* trace = g_ptr_array_index(traces, i);
+		if(trace->error) {
+			g_printerr("Skipped %s: %s\n", trace->path, trace->error);
+		}
+	}
+
+	gchar* manifestPath = g_build_filename(outputDir, PCAP_PREPARE_MANIFEST, NULL);
+	gboolean isWritten = _pcap_prepare_write_manifest(traces, manifestPath);
+	g_free(manifestPath);
+
+	for(guint i = 0; i < traces->len; i++) {
+		Pcap_Prepare_Trace* trace = g_ptr_array_index(traces, i);
+		g_free(trace->path);
+		g_free(trace->schedulePath);
+		g_free(trace->error);
+		g_free(trace);
+	}
+	g_ptr_array_free(traces, TRUE);
+	g_ptr_array_unref(names);
+	g_free(expression);
+
+	return isWritten ? 0 : -1;
+}
@@ -25,16 +25,23 @@ static const gchar* _pcapmain_logLevelToString(GLogLevelFlags logLevel) {
     }
 }
 
+/* the most verbose level logged, set with --log-level */
+static GLogLevelFlags _pcapmain_logLevel = G_LOG_LEVEL_WARNING;
+
 static void _pcapmain_logHandler(const gchar *logDomain, GLogLevelFlags logLevel,
         const gchar *message, gpointer userData) {
-    if(logLevel > G_LOG_LEVEL_WARNING) {
-	// if(logLevel > G_LOG_LEVEL_DEBUG) {
+    if((logLevel & G_LOG_LEVEL_MASK) > _pcapmain_logLevel) {
         return;
     }
     g_print("%s\n", message);
 }
 
 static void _pcapmain_log(GLogLevelFlags level, const gchar* functionName, const gchar* format, ...) {
+    // skip the timestamp and formatting of the messages that would be dropped anyway
+    if((level & G_LOG_LEVEL_MASK) > _pcapmain_logLevel) {
+        return;
+    }
+
     va_list vargs;
     va_start(vargs, format);
 
@@ -68,6 +75,19 @@ int main(int argc, char *argv[]) {
  //    gethostname(hostname, 128);
 	// mylog("Starting torctl program on host %s", hostname);
 
+	/* offline indexing of a trace, no replay */
+	if(argc > 1 && g_ascii_strcasecmp(argv[1], "index") == 0) {
+		return pcap_replay_index(argc, argv, &_pcapmain_log);
+	}
+
+	/* offline decoding of an event log, no replay */
+	if(argc > 1 && g_ascii_strcasecmp(argv[1], "events") == 0) {
+		return pcap_replay_events(argc, argv, &_pcapmain_log);
+	}
+
+	/* the level also applies while the instance is created */
+	pcap_replay_parseLogLevel(argc, argv, &_pcapmain_logLevel);
+
 	/* create the new state according to user inputs */
 	Pcap_Replay* PcapReplayState = pcap_replay_new(argc, argv, &_pcapmain_log);
 
@@ -137,7 +157,7 @@ int main(int argc, char *argv[]) {
 		close(mainepolld);
 	}
 
-	//pcap_replay_free(PcapReplayState);
+	pcap_replay_free(PcapReplayState);
 
 	mylog("exiting cleanly");
 
@@ -2,88 +2,780 @@
  * See LICENSE for licensing information
  */
 
+#define _GNU_SOURCE /* sendmmsg(), accept4() */
 #include "pcap_replay.h"
 
 #define MAGIC 0xFFEEDDCC
 
-const gchar* USAGE = "USAGE: <node-type> <server-host> <server-port> <pcap_client_ip> <pcap_nw_addr> <pcap_nw_mask> <timeout> <pcap_trace1> <pcap_trace2>..\n";
+const gchar* USAGE = "USAGE: [--burst-window=<usec>] [--multi-flow] [--filter=<bpf>] [--time-scale=<factor>] [--rate=<bps>] [--log-level=<level>] [--event-log=<file>] [--causal] [--socks-optimistic] <node-type> <server-host> <server-port> <pcap_client_ip> <pcap_nw_addr> <pcap_nw_mask> <timeout> <pcap_trace1> <pcap_trace2>..\n"
+		"       index [--filter=<bpf>] <pcap_client_ip> <pcap_nw_addr> <pcap_nw_mask> <pcap_trace> <schedule_file>\n"
+		"       events <event_log>\n";
 
-/* pcap_activateClient() is called when the epoll descriptor has an event for the client */
-void _pcap_activateClient(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
-	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, "Activate client!");
- 
-	char receivedPacket[MTU];
-	struct epoll_event ev;
-	ssize_t numBytes;
+static guint64 _pcap_timeval_to_usec(const struct timeval* tv) {
+	return (guint64)tv->tv_sec * 1000000 + tv->tv_usec;
+}
 
-	/* Save a pointer to the packet to send */
-	Custom_Packet_t *pckt_to_send = pcapReplay->nextPacket;
+/* current time in microseconds, on the clock of our timerfds */
+static guint64 _pcap_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (guint64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-	/* Process event */ 
-	if (sd == pcapReplay->client.tfd_sendtimer && (event & EPOLLIN)) { // time to send the next packet
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Sending packet!");
-		Custom_Packet_t* pckt_to_send = pcapReplay->nextPacket;
+/* the clock time at which a packet of the trace must be sent: its scaled trace
+ * offset, unless the rate pacer holds it back. The pacer is only charged by
+ * _pcap_pacer_consume() so this can be asked again until the packet is sent */
+static guint64 _pcap_due_time(Pcap_Replay* pcapReplay, const Custom_Packet_t* packet) {
+	guint64 ts = _pcap_timeval_to_usec(&packet->timestamp);
+	guint64 due = pcapReplay->anchorClock;
+	if(ts > pcapReplay->anchorTrace && pcapReplay->timeScale > 0) {
+		due += (guint64) ((ts - pcapReplay->anchorTrace) / pcapReplay->timeScale);
+	}
+
+	if(pcapReplay->pacerRate > 0) {
+		// the packet may go once the bucket holds enough tokens for it
+		gdouble release = pcapReplay->pacerFull - PCAP_PACER_BURST / pcapReplay->pacerRate;
+		if(release > due) {
+			due = (guint64) release;
+		}
+	}
+	return due;
+}
+
+/* take the tokens of a packet sent at its due time out of the rate pacer */
+static void _pcap_pacer_consume(Pcap_Replay* pcapReplay, guint64 due, gint size) {
+	if(pcapReplay->pacerRate > 0) {
+		pcapReplay->pacerFull = MAX(pcapReplay->pacerFull, (gdouble) due) + size / pcapReplay->pacerRate;
+	}
+}
+
+/* append to the event log, if there is one */
+static void _pcap_event(Pcap_Replay* pcapReplay, _PCAP_EVENT type, _PROTO proto, guint32 flow,
+		gsize length, guint64 time, guint64 scheduled) {
+	if(pcapReplay->eventlog) {
+		pcap_eventlog_append(pcapReplay->eventlog, type, proto, flow, (guint32) length, time, scheduled);
+	}
+}
+
+/* whether messages of level are logged, to skip costly arguments of the others */
+static gboolean _pcap_logs(Pcap_Replay* pcapReplay, GLogLevelFlags level) {
+	return level <= pcapReplay->logLevel;
+}
+
+/* arm timerfd for nextPacket, or disarm it when there is nothing left to send */
+static void _pcap_arm_send_timer(Pcap_Replay* pcapReplay, gint timerfd, gboolean hasNext) {
+	struct itimerspec itimerspecWait;
+	memset(&itimerspecWait, 0, sizeof(itimerspecWait));
+
+	if(hasNext) {
+		guint64 now = _pcap_now();
+		guint64 due = _pcap_due_time(pcapReplay, &pcapReplay->nextPacket);
+		guint64 wait = due > now ? due - now : 0;
 
-		char message[pckt_to_send->payload_size];
-		memcpy(message, (const char*) pckt_to_send->payload, (size_t)pckt_to_send->payload_size);
+		// a zero it_value would disarm the timer, late packets are sent right away
+		itimerspecWait.it_value.tv_sec = wait / 1000000;
+		itimerspecWait.it_value.tv_nsec = wait > 0 ? (wait % 1000000) * 1000 : 1;
+	} else {
+		/* No packet found! */
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "No packet found! Just going to wait..");
+	}
+
+	if (timerfd_settime(timerfd, 0, &itimerspecWait, NULL) < 0) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Can't set timerFD");
+		exit(1);
+	}
+
+	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Sleeping for %d %d!",
+			itimerspecWait.it_value.tv_sec, itimerspecWait.it_value.tv_nsec);
+}
+
+/* stop timerfd until it is armed again */
+static void _pcap_disarm_send_timer(Pcap_Replay* pcapReplay, gint timerfd) {
+	struct itimerspec itimerspecWait;
+	memset(&itimerspecWait, 0, sizeof(itimerspecWait));
+	if (timerfd_settime(timerfd, 0, &itimerspecWait, NULL) < 0) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Can't set timerFD");
+		exit(1);
+	}
+}
+
+/* read the expirations of timerfd, an expired timer stays readable until then */
+static void _pcap_drain_send_timer(gint timerfd) {
+	guint64 expirations;
+	while(read(timerfd, &expirations, sizeof(expirations)) < 0 && errno == EINTR);
+}
+
+/* how late (usec) a TCP segment is, segments that are not from the trace are never late */
+static guint64 _pcap_ring_lag_of(const Pcap_Tcp_Segment* segment, guint64 now) {
+	return segment->scheduled > 0 && now > segment->scheduled ? now - segment->scheduled : 0;
+}
+
+/* how late (usec) the oldest queued TCP segment is */
+static guint64 _pcap_ring_lag(Pcap_Tcp_Ring* ring, guint64 now) {
+	if(ring->head == ring->tail) {
+		return 0;
+	}
+	return _pcap_ring_lag_of(&ring->segments[ring->head % ring->capacity], now);
+}
+
+static gboolean _pcap_ring_is_full(Pcap_Tcp_Ring* ring) {
+	return ring->tail - ring->head >= PCAP_RING_SIZE;
+}
 
-		if (pckt_to_send->proto == _TCP_PROTO) {
-			numBytes = send(pcapReplay->client.server_sd_tcp, message, (size_t)pckt_to_send->payload_size, 0);
+/* Double the segments of the ring, keeping the queued ones at their running index */
+static void _pcap_ring_grow(Pcap_Tcp_Ring* ring) {
+	guint capacity = ring->capacity ? ring->capacity * 2 : PCAP_RING_MIN;
+	Pcap_Tcp_Segment* segments = g_new(Pcap_Tcp_Segment, capacity);
+	for(guint i = ring->head; i != ring->tail; i++) {
+		segments[i % capacity] = ring->segments[i % ring->capacity];
+	}
+	g_free(ring->segments);
+	ring->segments = segments;
+	ring->capacity = capacity;
+}
+
+static void _pcap_ring_push(Pcap_Tcp_Ring* ring, const gchar* data, gsize length, guint64 scheduled) {
+	if(ring->tail - ring->head == ring->capacity) {
+		_pcap_ring_grow(ring);
+	}
+	Pcap_Tcp_Segment* segment = &ring->segments[ring->tail % ring->capacity];
+	segment->data = data;
+	segment->length = length;
+	segment->scheduled = scheduled;
+	ring->tail++;
+	ring->bytes += length;
+	if(ring->bytes > ring->maxBytes) {
+		ring->maxBytes = ring->bytes;
+	}
+}
+
+/* Write as many of the queued TCP segments of the flow as its socket accepts, in
+ * gather writes of up to PCAP_BURST_MAX segments. Returns the number of bytes
+ * written, or -1 on a socket error. */
+static gssize _pcap_flush_tcp(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	Pcap_Tcp_Ring* ring = &flow->ring;
+	struct iovec iov[PCAP_BURST_MAX];
+	gssize written = 0;
+
+	guint64 now = _pcap_now();
+	guint64 lag = _pcap_ring_lag(ring, now);
+	if(lag > ring->maxLag) {
+		ring->maxLag = lag;
+	}
+
+	while(ring->head != ring->tail) {
+		gint iovcnt = 0;
+		for(guint i = ring->head; i != ring->tail && iovcnt < PCAP_BURST_MAX; i++) {
+			Pcap_Tcp_Segment* segment = &ring->segments[i % ring->capacity];
+			gsize skip = (i == ring->head) ? ring->offset : 0;
+			iov[iovcnt].iov_base = (void*) (segment->data + skip);
+			iov[iovcnt].iov_len = segment->length - skip;
+			iovcnt++;
 		}
-		else if(pckt_to_send->proto == _UDP_PROTO) {
-			numBytes = sendto(pcapReplay->client.server_sd_udp, message, (size_t)pckt_to_send->payload_size, 0,
-								(struct sockaddr *)&pcapReplay->client.serverAddr, sizeof(pcapReplay->client.serverAddr));
+
+		ssize_t numBytes = writev(flow->sd, iov, iovcnt);
+		if(numBytes < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return -1;
 		}
 
-		/* log result */
-		if(numBytes > 0) {
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-					"Successfully sent a '%d' (bytes) packet to the server", numBytes);
-		} else if(numBytes == 0) {
-			/* What is this TODO */
+		written += numBytes;
+		ring->bytes -= numBytes;
+
+		// release the segments written, the last one touched may be written partially
+		while(numBytes > 0) {
+			Pcap_Tcp_Segment* segment = &ring->segments[ring->head % ring->capacity];
+			gsize left = segment->length - ring->offset;
+			if((gsize) numBytes >= left) {
+				numBytes -= left;
+				ring->head++;
+				ring->offset = 0;
+				if(segment->scheduled > 0) {
+					pcap_histogram_record(&pcapReplay->stats.queueDelay, _pcap_ring_lag_of(segment, now));
+					_pcap_event(pcapReplay, _PCAP_EVENT_WRITE, _TCP_PROTO, flow->id, segment->length, now, segment->scheduled);
+				}
+			} else {
+				ring->offset += numBytes;
+				numBytes = 0;
+			}
+		}
+	}
+
+	return written;
+}
+
+/* Drop everything queued, after a socket error */
+static void _pcap_ring_clear(Pcap_Tcp_Ring* ring) {
+	ring->head = ring->tail;
+	ring->offset = 0;
+	ring->bytes = 0;
+	g_free(ring->segments);
+	ring->segments = NULL;
+	ring->capacity = 0;
+}
+
+static void _pcap_flow_free(gpointer data) {
+	Pcap_Flow* flow = data;
+	g_free(flow->ring.segments);
+	g_free(flow);
+}
+
+static gint _pcap_send_timer(Pcap_Replay* pcapReplay) {
+	return pcapReplay->isClient ? pcapReplay->client.tfd_sendtimer : pcapReplay->server.tfd_sendtimer;
+}
+
+/* Stop queueing on the send timer while the ring of flow is full */
+static void _pcap_ring_pause(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	flow->ring.isPaused = TRUE;
+	pcapReplay->pausedRings++;
+	_pcap_disarm_send_timer(pcapReplay, _pcap_send_timer(pcapReplay));
+}
+
+/* Resume the send timer once no ring is paused anymore */
+static void _pcap_ring_resume(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	flow->ring.isPaused = FALSE;
+	pcapReplay->pausedRings--;
+	if(pcapReplay->pausedRings == 0) {
+		_pcap_arm_send_timer(pcapReplay, _pcap_send_timer(pcapReplay), pcapReplay->hasNextPacket);
+	}
+}
+
+/* Close the connection of a flow, its later packets are dropped */
+static void _pcap_close_flow(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	// the server UDP flows share the server socket
+	if(flow->sd >= 0 && (flow->proto == _TCP_PROTO || pcapReplay->isClient)) {
+		g_hash_table_remove(pcapReplay->flowSockets, GINT_TO_POINTER(flow->sd));
+		epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, flow->sd, NULL);
+		close(flow->sd);
+	}
+	flow->sd = -1;
+	flow->isClosed = TRUE;
+
+	_pcap_ring_clear(&flow->ring);
+	flow->ring.isBlocked = FALSE;
+	if(flow->ring.isPaused) {
+		_pcap_ring_resume(pcapReplay, flow);
+	}
+}
+
+/* Flush the TCP ring of a flow and report the result. While bytes are left, the
+ * socket is watched for EPOLLOUT. A send timer paused on a full ring is re-armed
+ * once there is room again. */
+static void _pcap_send_tcp(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	Pcap_Tcp_Ring* ring = &flow->ring;
+	gboolean isClient = pcapReplay->isClient;
+
+	if(flow->sd < 0) {
+		// the client did not announce the connection of the flow yet, keep the segments
+		return;
+	}
+
+	gssize numBytes = _pcap_flush_tcp(pcapReplay, flow);
+
+	/* log result */
+	if(numBytes >= 0) {
+		if(_pcap_logs(pcapReplay, G_LOG_LEVEL_MESSAGE)) {
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"The last packet to send was an ACK. Skipped sending.", numBytes);
+					"Successfully sent '%d' (bytes) to the %s on flow %u, '%d' (bytes) queued, %"G_GUINT64_FORMAT" usec behind",
+					numBytes, isClient ? "server" : "client", flow->id, ring->bytes, _pcap_ring_lag(ring, _pcap_now()));
+		}
+	} else if(pcapReplay->isMultiFlow) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to send message on flow %u! Closing it", flow->id);
+		_pcap_close_flow(pcapReplay, flow);
+		return;
+	} else {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to send message!");
+		if(!isClient) {
+			exit(1);
+		}
+		// drop what is left, the next packets will be sent on time
+		_pcap_ring_clear(ring);
+	}
+
+	if(ring->bytes > 0 && !ring->isBlocked) {
+		// the socket is full, resume once it drains
+		_pcap_epoll(pcapReplay, EPOLL_CTL_MOD, EPOLLIN|EPOLLOUT, flow->sd);
+		ring->isBlocked = TRUE;
+	} else if(ring->bytes == 0 && ring->isBlocked) {
+		_pcap_epoll(pcapReplay, EPOLL_CTL_MOD, EPOLLIN, flow->sd);
+		ring->isBlocked = FALSE;
+	}
+
+	if(ring->isPaused && !_pcap_ring_is_full(ring)) {
+		_pcap_ring_resume(pcapReplay, flow);
+	}
+}
+
+/* Client side of a new flow: open its connection (TCP) or socket (UDP) and
+ * announce the flow id to the server. The TCP connect completes in the
+ * background, the hello and the first segments are written on EPOLLOUT. */
+static void _pcap_open_flow(Pcap_Replay* pcapReplay, Pcap_Flow* flow) {
+	struct sockaddr_in serverAddress = pcapReplay->client.serverAddr;
+
+	if(flow->proto == _TCP_PROTO) {
+		flow->sd = socket(AF_INET, (SOCK_STREAM | SOCK_NONBLOCK), 0);
+		serverAddress.sin_port = pcapReplay->serverPortTCP;
+		if(flow->sd == -1 || (connect(flow->sd, (struct sockaddr *) &serverAddress, sizeof(serverAddress)) == -1
+				&& errno != EINPROGRESS)) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to open the connection of flow %u", flow->id);
+			if(flow->sd != -1) {
+				close(flow->sd);
+			}
+			flow->sd = -1;
+			flow->isClosed = TRUE;
+			return;
+		}
+
+		// the hello goes first on the connection
+		_pcap_ring_push(&flow->ring, (const gchar*) &flow->hello, sizeof(Pcap_Flow_Hello), _pcap_now());
+		_pcap_epoll(pcapReplay, EPOLL_CTL_ADD, EPOLLIN|EPOLLOUT, flow->sd);
+		flow->ring.isBlocked = TRUE;
+	} else {
+		flow->sd = socket(AF_INET, (SOCK_DGRAM | SOCK_NONBLOCK), 0);
+		if(flow->sd == -1 || sendto(flow->sd, &flow->hello, sizeof(Pcap_Flow_Hello), 0,
+				(struct sockaddr *) &serverAddress, sizeof(serverAddress)) < 0) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to open the socket of flow %u", flow->id);
+			if(flow->sd != -1) {
+				close(flow->sd);
+			}
+			flow->sd = -1;
+			flow->isClosed = TRUE;
+			return;
+		}
+		_pcap_epoll(pcapReplay, EPOLL_CTL_ADD, EPOLLIN, flow->sd);
+	}
+
+	g_hash_table_insert(pcapReplay->flowSockets, GINT_TO_POINTER(flow->sd), flow);
+	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Opened flow %u", flow->id);
+}
+
+static Pcap_Flow* _pcap_lookup_flow(Pcap_Replay* pcapReplay, guint32 id, _PROTO proto) {
+	Pcap_Flow* flow = g_hash_table_lookup(pcapReplay->flows, GUINT_TO_POINTER(id));
+	if(flow == NULL) {
+		flow = g_new0(Pcap_Flow, 1);
+		flow->id = id;
+		flow->proto = proto;
+		flow->sd = -1;
+		flow->hello.magic = htonl(PCAP_FLOW_MAGIC);
+		flow->hello.flow = htonl(id);
+		g_hash_table_insert(pcapReplay->flows, GUINT_TO_POINTER(id), flow);
+
+		// the client opens the flows as they start, the server waits for them
+		if(pcapReplay->isClient) {
+			_pcap_open_flow(pcapReplay, flow);
+		}
+	}
+	return flow;
+}
+
+/* the flow a packet is replayed on */
+static Pcap_Flow* _pcap_packet_flow(Pcap_Replay* pcapReplay, const Custom_Packet_t* packet) {
+	if(!pcapReplay->isMultiFlow) {
+		return &pcapReplay->defaultFlow;
+	}
+	return _pcap_lookup_flow(pcapReplay, packet->flow, packet->proto);
+}
+
+/* where the UDP packets of a flow go, FALSE if we do not know yet */
+static gboolean _pcap_udp_endpoint(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gint* sd, struct sockaddr_in** addr) {
+	if(pcapReplay->isMultiFlow) {
+		*sd = flow->sd;
+		*addr = pcapReplay->isClient ? &pcapReplay->client.serverAddr : &flow->peerAddr;
+		return flow->sd >= 0;
+	}
+	if(pcapReplay->isClient) {
+		*sd = pcapReplay->client.server_sd_udp;
+		*addr = &pcapReplay->client.serverAddr;
+		return TRUE;
+	}
+	*sd = pcapReplay->server.sd_udp;
+	*addr = &pcapReplay->server.clientaddr;
+	return pcapReplay->server.clientaddr.sin_port != 0;
+}
+
+/* Send a batch of datagrams from one socket with a single sendmmsg() */
+static void _pcap_send_udp(Pcap_Replay* pcapReplay, gint sd, struct mmsghdr* msgs, gint nmb_msgs) {
+	gint numMsgs = sendmmsg(sd, msgs, nmb_msgs, 0);
+	if(numMsgs < 0 && errno == ENOSYS) {
+		// no batching available, send the datagrams one by one
+		for(numMsgs = 0; numMsgs < nmb_msgs; numMsgs++) {
+			if(sendmsg(sd, &msgs[numMsgs].msg_hdr, 0) < 0) {
+				break;
+			}
+		}
+	}
+
+	/* log result */
+	if(numMsgs >= 0) {
+		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+				"Successfully sent '%d' of '%d' UDP packets to the %s", numMsgs, nmb_msgs, pcapReplay->isClient ? "server" : "client");
+	} else {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to send message!");
+		if(!pcapReplay->isClient) {
+			exit(1);
+		}
+	}
+}
+
+/* causal mode: whether what the packet depends on was received from the peer */
+static gboolean _pcap_causal_ready(Pcap_Replay* pcapReplay, const Custom_Packet_t* packet) {
+	if(!pcapReplay->isCausal) {
+		return TRUE;
+	}
+	if(!pcapReplay->isMultiFlow) {
+		return pcapReplay->causalReceived >= packet->depends.bytes;
+	}
+	// a flow the peer did not open yet received nothing, a closed one drops the packet anyway
+	Pcap_Flow* flow = g_hash_table_lookup(pcapReplay->flows, GUINT_TO_POINTER(packet->flow));
+	if(flow == NULL) {
+		return packet->depends.bytes == 0;
+	}
+	return flow->isClosed || flow->received >= packet->depends.bytes;
+}
+
+/* causal mode: count the stream bytes received from the peer (flow is NULL for the
+ * single TCP connection). Once they complete what nextPacket depends on, the
+ * timeline is anchored on the peer's packet, whether the send timer was
+ * waiting for them or not, and the timer is armed again */
+static void _pcap_causal_received(Pcap_Replay* pcapReplay, Pcap_Flow* flow, gssize numBytes) {
+	if(!pcapReplay->isCausal || (flow && flow->proto != _TCP_PROTO)) {
+		return;
+	}
+	gboolean wasReady = !pcapReplay->hasNextPacket || _pcap_causal_ready(pcapReplay, &pcapReplay->nextPacket);
+
+	if(pcapReplay->isMultiFlow && flow) {
+		flow->received += numBytes;
+	} else {
+		pcapReplay->causalReceived += numBytes;
+	}
+
+	if(!wasReady && _pcap_causal_ready(pcapReplay, &pcapReplay->nextPacket)) {
+		// we answer after the think time of the trace since the peer's packet
+		pcapReplay->isWaitingPeer = FALSE;
+		pcapReplay->anchorTrace = pcapReplay->nextPacket.depends.timestamp;
+		pcapReplay->anchorClock = _pcap_now();
+		if(pcapReplay->pausedRings == 0) {
+			_pcap_arm_send_timer(pcapReplay, _pcap_send_timer(pcapReplay), TRUE);
+		}
+	}
+}
+
+/* Send nextPacket and, in burst mode, every following packet that is already due
+ * or due within the coalescing window. TCP payloads are queued on the outbound
+ * ring of their flow and flushed straight from the schedule, UDP datagrams go out
+ * with one sendmmsg() per socket. The send timer is then re-armed once, or
+ * disarmed while a ring is full. */
+static void _pcap_send_due_packets(Pcap_Replay* pcapReplay, gboolean isClient) {
+	Pcap_Flow* tcpFlows[PCAP_BURST_MAX];
+	Pcap_Flow* fullFlow = NULL;
+	struct iovec udp_iov[PCAP_BURST_MAX];
+	struct mmsghdr udp_msgs[PCAP_BURST_MAX];
+	gint nmb_packets = 0, nmb_tcp_flows = 0, nmb_udp = 0;
+	gint udp_sd = -1;
+
+	_pcap_drain_send_timer(_pcap_send_timer(pcapReplay));
+	if(pcapReplay->pausedRings > 0) {
+		// nothing is queued until the full rings drain, see _pcap_ring_resume()
+		return;
+	}
+
+	guint64 now = _pcap_now();
+	if(pcapReplay->anchorClock == 0) {
+		// first packet ever sent, the replay timeline starts now
+		pcapReplay->anchorTrace = _pcap_timeval_to_usec(&pcapReplay->nextPacket.timestamp);
+		pcapReplay->anchorClock = now;
+	}
+
+	if(!_pcap_causal_ready(pcapReplay, &pcapReplay->nextPacket)) {
+		// the send timer stays disarmed until the peer's packets arrive, see _pcap_causal_received()
+		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Waiting for the peer before sending");
+		pcapReplay->isWaitingPeer = TRUE;
+		_pcap_disarm_send_timer(pcapReplay, _pcap_send_timer(pcapReplay));
+		return;
+	}
+
+	// collect the packets to send, the payloads stay in the schedule
+	do {
+		Custom_Packet_t* packet = &pcapReplay->nextPacket;
+		Pcap_Flow* flow = _pcap_packet_flow(pcapReplay, packet);
+		guint64 due = _pcap_due_time(pcapReplay, packet);
+		nmb_packets++;
+
+		if(due > now) {
+			pcapReplay->stats.early++;
+		}
+		pcap_histogram_record(&pcapReplay->stats.sendSkew, now > due ? now - due : 0);
+
+		if(flow->isClosed) {
+			// the connection of the flow is gone
+			pcapReplay->stats.dropped++;
+			_pcap_event(pcapReplay, _PCAP_EVENT_DROP, packet->proto, packet->flow, packet->payload_size, now, due);
+		} else if(packet->proto == _TCP_PROTO) {
+			_pcap_ring_push(&flow->ring, packet->payload, (gsize) packet->payload_size, due);
+			pcapReplay->stats.packets[_TCP_PROTO]++;
+			pcapReplay->stats.bytes[_TCP_PROTO] += packet->payload_size;
+			_pcap_event(pcapReplay, _PCAP_EVENT_SEND, _TCP_PROTO, packet->flow, packet->payload_size, now, due);
+
+			gint i = 0;
+			while(i < nmb_tcp_flows && tcpFlows[i] != flow) {
+				i++;
+			}
+			if(i == nmb_tcp_flows) {
+				tcpFlows[nmb_tcp_flows++] = flow;
+			}
+			if(_pcap_ring_is_full(&flow->ring)) {
+				fullFlow = flow;
+			}
 		} else {
-			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to send message!");
+			gint sd;
+			struct sockaddr_in* addr;
+			if(!_pcap_udp_endpoint(pcapReplay, flow, &sd, &addr)) {
+				// ensure we have a connection
+				pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "No UDP connection yet!");
+				pcapReplay->stats.dropped++;
+				_pcap_event(pcapReplay, _PCAP_EVENT_DROP, _UDP_PROTO, packet->flow, packet->payload_size, now, due);
+			} else {
+				// a batch only holds datagrams of one socket
+				if(nmb_udp > 0 && sd != udp_sd) {
+					_pcap_send_udp(pcapReplay, udp_sd, udp_msgs, nmb_udp);
+					nmb_udp = 0;
+				}
+				udp_sd = sd;
+
+				udp_iov[nmb_udp].iov_base = (void*) packet->payload;
+				udp_iov[nmb_udp].iov_len = (size_t) packet->payload_size;
+				memset(&udp_msgs[nmb_udp], 0, sizeof(struct mmsghdr));
+				udp_msgs[nmb_udp].msg_hdr.msg_name = addr;
+				udp_msgs[nmb_udp].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+				udp_msgs[nmb_udp].msg_hdr.msg_iov = &udp_iov[nmb_udp];
+				udp_msgs[nmb_udp].msg_hdr.msg_iovlen = 1;
+				nmb_udp++;
+				pcapReplay->stats.packets[_UDP_PROTO]++;
+				pcapReplay->stats.bytes[_UDP_PROTO] += packet->payload_size;
+				_pcap_event(pcapReplay, _PCAP_EVENT_SEND, _UDP_PROTO, packet->flow, packet->payload_size, now, due);
+			}
 		}
 
+		_pcap_pacer_consume(pcapReplay, due, packet->payload_size);
+
 		//  now prepare next packet
-		if(!get_next_packet(pcapReplay, TRUE)) {
-			/* No packet found! */
-			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "No packet found! Just going to wait..");
+		pcapReplay->hasNextPacket = get_next_packet(pcapReplay, isClient);
+	} while(pcapReplay->hasNextPacket && pcapReplay->isBurstMode
+			&& nmb_packets < PCAP_BURST_MAX && fullFlow == NULL
+			&& _pcap_due_time(pcapReplay, &pcapReplay->nextPacket) <= now + pcapReplay->burstWindow
+			&& _pcap_causal_ready(pcapReplay, &pcapReplay->nextPacket));
+
+	if(nmb_udp > 0) {
+		_pcap_send_udp(pcapReplay, udp_sd, udp_msgs, nmb_udp);
+	}
 
-			// hack to simulate long delay
-			pcapReplay->nextPacket->timestamp.tv_sec = 999999;
-			pcapReplay->nextPacket->timestamp.tv_usec = 0;
+	// write the TCP payloads, unless we already wait for the sockets to drain
+	for(gint i = 0; i < nmb_tcp_flows; i++) {
+		if(!tcpFlows[i]->ring.isBlocked && !tcpFlows[i]->isClosed) {
+			_pcap_send_tcp(pcapReplay, tcpFlows[i]);
 		}
+	}
 
-		struct timespec timeToWait;
-		timeval_subtract (&timeToWait, &pckt_to_send->timestamp, &pcapReplay->nextPacket->timestamp);
+	if(fullFlow && _pcap_ring_is_full(&fullFlow->ring)) {
+		// the network can't keep up, stop queueing until EPOLLOUT makes room
+		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+				"TCP queue of flow %u full, '%d' (bytes) queued. Pausing replay", fullFlow->id, fullFlow->ring.bytes);
+		_pcap_ring_pause(pcapReplay, fullFlow);
+		return;
+	}
+	_pcap_arm_send_timer(pcapReplay, _pcap_send_timer(pcapReplay), pcapReplay->hasNextPacket);
+}
 
-		// sleep for timeToWait time 
-		struct itimerspec itimerspecWait;
-		itimerspecWait.it_interval.tv_nsec = 0;
-		itimerspecWait.it_interval.tv_sec = 0;
-		itimerspecWait.it_value = timeToWait;
-		if (timerfd_settime(pcapReplay->client.tfd_sendtimer, 0, &itimerspecWait, NULL) < 0) {
-			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Can't set timerFD");
-			exit(1);
+static gboolean _pcap_parse_log_level(const gchar* name, GLogLevelFlags* level) {
+	const gchar* names[] = {"error", "critical", "warning", "message", "info", "debug"};
+	for(gint i = 0; i < G_N_ELEMENTS(names); i++) {
+		if(g_ascii_strcasecmp(name, names[i]) == 0) {
+			*level = G_LOG_LEVEL_ERROR << i;
+			return TRUE;
 		}
+	}
+	return FALSE;
+}
+
+static gboolean _pcap_parse_option(Pcap_Replay* pcapReplay, const gchar* option) {
+	if(g_str_has_prefix(option, "--burst-window=")) {
+		/* send everything due within this many microseconds on each wakeup */
+		pcapReplay->isBurstMode = TRUE;
+		pcapReplay->burstWindow = g_ascii_strtoull(option + strlen("--burst-window="), NULL, 10);
+		return TRUE;
+	}
+	if(g_str_has_prefix(option, "--filter=")) {
+		/* only replay the packets also matching this BPF expression.
+		 * plugin arguments are split on spaces, so commas stand for spaces */
+		g_free(pcapReplay->filterExpression);
+		pcapReplay->filterExpression = g_strdelimit(g_strdup(option + strlen("--filter=")), ",", ' ');
+		return TRUE;
+	}
+	if(g_str_equal(option, "--causal")) {
+		/* only answer the peer once its preceding packets were received */
+		pcapReplay->isCausal = TRUE;
+		return TRUE;
+	}
+	if(g_str_equal(option, "--socks-optimistic")) {
+		/* client-tor: do not wait for the proxy replies before sending the first payload */
+		pcapReplay->isSocksOptimistic = TRUE;
+		return TRUE;
+	}
+	if(g_str_equal(option, "--multi-flow")) {
+		/* one connection per flow of the trace */
+		pcapReplay->isMultiFlow = TRUE;
+		return TRUE;
+	}
+	if(g_str_has_prefix(option, "--time-scale=")) {
+		/* replay the trace this many times faster (< 1: slower) */
+		pcapReplay->timeScale = g_ascii_strtod(option + strlen("--time-scale="), NULL);
+		return pcapReplay->timeScale > 0;
+	}
+	if(g_str_has_prefix(option, "--log-level=")) {
+		/* the most verbose level logged, messages above it are skipped before being formatted */
+		return _pcap_parse_log_level(option + strlen("--log-level="), &pcapReplay->logLevel);
+	}
+	if(g_str_has_prefix(option, "--event-log=")) {
+		/* keep a binary trace of every packet in this file, see pcap_eventlog.h */
+		char ebuf[PCAP_ERRBUF_SIZE];
+		pcap_eventlog_close(pcapReplay->eventlog);
+		pcapReplay->eventlog = pcap_eventlog_open(option + strlen("--event-log="), ebuf);
+		if(pcapReplay->eventlog == NULL) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to create the event log : %s", ebuf);
+			return FALSE;
+		}
+		return TRUE;
+	}
+	if(g_str_has_prefix(option, "--rate=")) {
+		/* target throughput in bits per second, with an optional k, M or G suffix */
+		gchar* unit = NULL;
+		gdouble bps = g_ascii_strtod(option + strlen("--rate="), &unit);
+		switch(*unit) {
+			case 'k': case 'K': bps *= 1e3; unit++; break;
+			case 'm': case 'M': bps *= 1e6; unit++; break;
+			case 'g': case 'G': bps *= 1e9; unit++; break;
+		}
+		pcapReplay->pacerRate = bps / 8 / 1e6;
+		return *unit == '\0' && pcapReplay->pacerRate > 0;
+	}
+	return FALSE;
+}
+
+/* Optimistic Socks5: steps 2) and 4) of the negociation, parsed from the head of
+ * the received stream. Returns how many bytes of buffer belong to the replies,
+ * or -1 if the proxy refused. isSocksPending is cleared once both are complete. */
+static gssize _pcap_socks_reply(Pcap_Replay* pcapReplay, const gchar* buffer, gsize length) {
+	guchar* reply = pcapReplay->socksReply;
+	gsize consumed = 0;
+
+	while(pcapReplay->isSocksPending && consumed < length) {
+		// the method choice (2 bytes) then the CONNECT reply, whose length depends on its address type
+		gsize expected = 2 + 4;
+		if(pcapReplay->socksReplyLength >= expected) {
+			switch(reply[2 + 3]) {
+				case 0x01: expected += 4 + 2; break; // IPv4
+				case 0x04: expected += 16 + 2; break; // IPv6
+				case 0x03: // domain name, its length comes first
+					expected += 1;
+					if(pcapReplay->socksReplyLength >= expected) {
+						expected += reply[2 + 4] + 2;
+					}
+					break;
+				default: return -1;
+			}
+		}
+
+		if(pcapReplay->socksReplyLength < expected) {
+			reply[pcapReplay->socksReplyLength++] = (guchar) buffer[consumed++];
+			continue;
+		}
+
+		if(reply[0] != 0x05 || reply[1] != 0x00 || reply[2] != 0x05 || reply[3] != 0x00) {
+			return -1;
+		}
+		pcapReplay->isSocksPending = FALSE;
+	}
+
+	if(pcapReplay->isSocksPending && pcapReplay->socksReplyLength >= 4
+			&& (reply[0] != 0x05 || reply[1] != 0x00 || reply[2] != 0x05 || reply[3] != 0x00)) {
+		// a refusal is known before the end of the reply
+		return -1;
+	}
+	return consumed;
+}
+
+/* pcap_activateClient() is called when the epoll descriptor has an event for the client */
+void _pcap_activateClient(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
+	pcapReplay->slogf(G_LOG_LEVEL_DEBUG, __FUNCTION__, "Activate client!");
+ 
+	char receivedPacket[MTU];
+	struct epoll_event ev;
+	ssize_t numBytes;
+	Pcap_Flow* flow = g_hash_table_lookup(pcapReplay->flowSockets, GINT_TO_POINTER(sd));
+
+	/* Process event */ 
+	if(flow && (event & EPOLLOUT) && flow->ring.isBlocked) { // room to resume a partial write
+		_pcap_send_tcp(pcapReplay, flow);
+		flow = g_hash_table_lookup(pcapReplay->flowSockets, GINT_TO_POINTER(sd));
+	}
 
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Sleeping for %d %d!", timeToWait.tv_sec, timeToWait.tv_nsec);
+	if (sd == pcapReplay->client.tfd_sendtimer && (event & EPOLLIN)) { // time to send the next packet
+		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Sending packet!");
+		_pcap_send_due_packets(pcapReplay, TRUE);
+	}
 
-		free(pckt_to_send);
+	else if(flow && flow != &pcapReplay->defaultFlow && (event & EPOLLIN)) { // receive a message on one of the flows
+		numBytes = recv(sd, receivedPacket, (size_t)MTU, 0);
 
+		/* log result */
+		if(numBytes > 0) {
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+						"Successfully received a packet from server on flow %u: %d bytes", flow->id, numBytes);
+			_pcap_event(pcapReplay, _PCAP_EVENT_RECV, flow->proto, flow->id, numBytes, _pcap_now(), 0);
+			_pcap_causal_received(pcapReplay, flow, numBytes);
+		} else if(numBytes == 0 && flow->proto == _TCP_PROTO) {
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+						"Server closed flow %u", flow->id);
+			_pcap_close_flow(pcapReplay, flow);
+		} else if(numBytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to receive message on flow %u", flow->id);
+		}
 	}
 
 	else if(sd == pcapReplay->client.server_sd_tcp && (event & EPOLLIN)) { // receive a message from the server
 		memset(receivedPacket, 0, (size_t)MTU);
 		numBytes = recv(sd, receivedPacket, (size_t)MTU, 0);
 
+		// with optimistic Socks5, the proxy replies come first on the stream
+		gssize replyBytes = 0;
+		if(numBytes > 0 && pcapReplay->isSocksPending) {
+			replyBytes = _pcap_socks_reply(pcapReplay, receivedPacket, numBytes);
+			if(replyBytes >= 0) {
+				numBytes -= replyBytes;
+				if(!pcapReplay->isSocksPending) {
+					pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+							"Socks5 negociation finished : TCP connection to remote server created.");
+				}
+			}
+		}
+
 		/* log result */
-		if(numBytes > 0) {
+		if(replyBytes < 0) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+						"The Tor proxy refused the connection to the server! Shutting down..");
+			shutdown_client(pcapReplay);
+		} else if(replyBytes > 0 && numBytes == 0) {
+			// only the proxy replies so far
+		} else if(numBytes > 0) {
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
 						"Successfully received a TCP packet from server: %d bytes", numBytes);
+			_pcap_event(pcapReplay, _PCAP_EVENT_RECV, _TCP_PROTO, 0, numBytes, _pcap_now(), 0);
+			_pcap_causal_received(pcapReplay, NULL, numBytes);
 		} else if(numBytes==0) {
 			/* The connection have been closed by the distant peer. Terminate */
 			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
@@ -105,6 +797,7 @@ void _pcap_activateClient(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 		if(numBytes > 0) {
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
 						"Successfully received a UDP packet from the client: %d bytes", numBytes);
+			_pcap_event(pcapReplay, _PCAP_EVENT_RECV, _UDP_PROTO, 0, numBytes, _pcap_now(), 0);
 		} else if(numBytes == 0) {
 			/* What is this TODO */
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
@@ -117,14 +810,52 @@ void _pcap_activateClient(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 	}
 
 	/*  If the timeout is reached, close the plugin ! */
-	GDateTime* dt = g_date_time_new_now_local();
-	if(g_date_time_to_unix(dt) >= pcapReplay->timeout) {
+	if(_pcap_now() >= pcapReplay->deadline) {
 		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,  "Timeout reached!");
 		shutdown_client(pcapReplay);
 	}
 }
 
 
+/* Server side: read the hello of a new flow connection and attach the connection
+ * to its flow. Segments the flow already queued are written right away. */
+static void _pcap_accept_flow(Pcap_Replay* pcapReplay, gint sd) {
+	Pcap_Flow_Hello hello;
+	ssize_t numBytes = recv(sd, &hello, sizeof(Pcap_Flow_Hello), MSG_PEEK);
+
+	if(numBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return;
+	}
+	if(numBytes > 0 && numBytes < sizeof(Pcap_Flow_Hello)) {
+		// wait for the rest of the hello
+		return;
+	}
+	if(numBytes <= 0 || recv(sd, &hello, sizeof(Pcap_Flow_Hello), 0) != sizeof(Pcap_Flow_Hello)
+			|| ntohl(hello.magic) != PCAP_FLOW_MAGIC) {
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Connection closed before announcing its flow");
+		epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, sd, NULL);
+		close(sd);
+		return;
+	}
+
+	Pcap_Flow* flow = _pcap_lookup_flow(pcapReplay, ntohl(hello.flow), _TCP_PROTO);
+	if(flow->sd >= 0) {
+		// the flow already has a connection, keep the first one
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Flow %u announced twice", flow->id);
+		epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, sd, NULL);
+		close(sd);
+		return;
+	}
+
+	flow->sd = sd;
+	g_hash_table_insert(pcapReplay->flowSockets, GINT_TO_POINTER(sd), flow);
+	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Client opened flow %u", flow->id);
+
+	if(flow->ring.bytes > 0) {
+		_pcap_send_tcp(pcapReplay, flow);
+	}
+}
+
 gboolean _pcap_init_server_sending(Pcap_Replay* pcapReplay) {
 	// get the time delay between the first packet sent by client and the server
 	// the server must transmit only after this time.
@@ -139,7 +870,7 @@ gboolean _pcap_init_server_sending(Pcap_Replay* pcapReplay) {
 		exit(1);
 	}
 
-	struct timeval first_clientpkt_time = pcapReplay->nextPacket->timestamp;
+	struct timeval first_clientpkt_time = pcapReplay->nextPacket.timestamp;
 
 	//  now get the first server packet
 	if(!get_next_packet(pcapReplay, FALSE)) {
@@ -150,23 +881,14 @@ gboolean _pcap_init_server_sending(Pcap_Replay* pcapReplay) {
 		exit(1);
 	}
 
-	struct timeval first_serverpkt_time = pcapReplay->nextPacket->timestamp;
-	struct timespec timeToWait;
-
-	timeval_subtract (&timeToWait, &first_clientpkt_time,&first_serverpkt_time);
+	// the server timeline starts now, at the time of the first client packet
+	pcapReplay->anchorTrace = _pcap_timeval_to_usec(&first_clientpkt_time);
+	pcapReplay->anchorClock = _pcap_now();
 
-	// create timerfd and sleep for timetowait
-	pcapReplay->server.tfd_sendtimer = timerfd_create(CLOCK_MONOTONIC, 0);
-
-	struct itimerspec itimerspecWait;
-	itimerspecWait.it_interval.tv_nsec = 0;
-	itimerspecWait.it_interval.tv_sec = 0;
-	itimerspecWait.it_value = timeToWait;
-	if (timerfd_settime(pcapReplay->server.tfd_sendtimer, 0, &itimerspecWait, NULL) < 0) {
-		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Can't set timerFD");
-		exit(1);
-	}
-	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Sleeping for %d %d!", timeToWait.tv_sec, timeToWait.tv_nsec);
+	// create timerfd and sleep until the first server packet is due
+	pcapReplay->server.tfd_sendtimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	_pcap_arm_send_timer(pcapReplay, pcapReplay->server.tfd_sendtimer, TRUE);
+	pcapReplay->hasNextPacket = TRUE;
 
 	// finally monitor by epoll
 	struct epoll_event ev;
@@ -186,13 +908,19 @@ void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 	char receivedPacket[MTU];
 	struct epoll_event ev;
 	ssize_t numBytes;
+	Pcap_Flow* flow = g_hash_table_lookup(pcapReplay->flowSockets, GINT_TO_POINTER(sd));
 
 	/* Process events */
+	if(flow && (event & EPOLLOUT) && flow->ring.isBlocked) { /* room to resume a partial write */
+		_pcap_send_tcp(pcapReplay, flow);
+		flow = g_hash_table_lookup(pcapReplay->flowSockets, GINT_TO_POINTER(sd));
+	}
+
 	if(sd == pcapReplay->server.sd_tcp && (event & EPOLLIN))  { /* data on a listening socket means a new client tcp connection */
 		/* accept new connection from a remote client */
 		struct sockaddr_in clientaddr;
     	socklen_t clientaddr_size = sizeof(clientaddr);
-		int newClientSD = accept(sd,  (struct sockaddr *)&clientaddr, &clientaddr_size);
+		int newClientSD = accept4(sd,  (struct sockaddr *)&clientaddr, &clientaddr_size, SOCK_NONBLOCK);
 
 			
 		int len=20;
@@ -211,8 +939,16 @@ void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 		ev.data.fd = newClientSD;
 		epoll_ctl(pcapReplay->ed, EPOLL_CTL_ADD, newClientSD, &ev);
 
-		// save reference to client
-		pcapReplay->server.client_sd_tcp = newClientSD;
+		if(!pcapReplay->isMultiFlow) {
+			// save reference to client, all the TCP packets go through it
+			g_hash_table_remove(pcapReplay->flowSockets, GINT_TO_POINTER(pcapReplay->defaultFlow.sd));
+			pcapReplay->server.client_sd_tcp = newClientSD;
+			pcapReplay->defaultFlow.sd = newClientSD;
+			g_hash_table_insert(pcapReplay->flowSockets, GINT_TO_POINTER(newClientSD), &pcapReplay->defaultFlow);
+		} else if(pcapReplay->server.client_sd_tcp == 0) {
+			// the first connection of the client is the control one, the flows announce themselves
+			pcapReplay->server.client_sd_tcp = newClientSD;
+		}
 
 		// initialize sending if not done
 		if (!pcapReplay->isServerSending) {
@@ -231,6 +967,7 @@ void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 		if(numBytes > 0) {
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
 						"Successfully received a UDP packet from the client: %d bytes", numBytes);
+			_pcap_event(pcapReplay, _PCAP_EVENT_RECV, _UDP_PROTO, 0, numBytes, _pcap_now(), 0);
 		} else if(numBytes == 0) {
 			/* What is this TODO */
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
@@ -241,6 +978,15 @@ void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 			exit(1);
 		}
 
+		// in multi-flow mode, a hello tells us where the datagrams of a flow go
+		Pcap_Flow_Hello* hello = (Pcap_Flow_Hello*) receivedPacket;
+		if(pcapReplay->isMultiFlow && numBytes == sizeof(Pcap_Flow_Hello) && ntohl(hello->magic) == PCAP_FLOW_MAGIC) {
+			Pcap_Flow* udpFlow = _pcap_lookup_flow(pcapReplay, ntohl(hello->flow), _UDP_PROTO);
+			udpFlow->sd = pcapReplay->server.sd_udp;
+			udpFlow->peerAddr = pcapReplay->server.clientaddr;
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Client opened flow %u", udpFlow->id);
+		}
+
 		// initialize sending if not done
 		if (!pcapReplay->isServerSending) {
 			_pcap_init_server_sending(pcapReplay);
@@ -249,65 +995,29 @@ void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 
 	else if (sd == pcapReplay->server.tfd_sendtimer && (event & EPOLLIN)) { /* time to send the next packet */
 		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Sending packet!");
-		Custom_Packet_t* pckt_to_send = pcapReplay->nextPacket;
+		_pcap_send_due_packets(pcapReplay, FALSE);
+	}
 
-		char message[pckt_to_send->payload_size];
-		memcpy(message, (const char*) pckt_to_send->payload, (size_t)pckt_to_send->payload_size);
+	else if(pcapReplay->isMultiFlow && flow == NULL && sd != pcapReplay->server.client_sd_tcp && (event & EPOLLIN)) {
+		// a new connection of the client, waiting for the hello of its flow
+		_pcap_accept_flow(pcapReplay, sd);
+	}
 
-		if (pckt_to_send->proto == _TCP_PROTO) {
-			numBytes = send(pcapReplay->server.client_sd_tcp, message, (size_t)pckt_to_send->payload_size, 0);
-		}
-		else if(pckt_to_send->proto == _UDP_PROTO) {
-			// ensure we have a connection
-			if (pcapReplay->server.clientaddr.sin_port == 0) {
-				pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "No UDP connection yet!");
-				numBytes = 0; // hack
-			} else {
-				numBytes = sendto(pcapReplay->server.sd_udp, message, (size_t)pckt_to_send->payload_size, 0,
-									(struct sockaddr *)&pcapReplay->server.clientaddr, sizeof(pcapReplay->server.clientaddr));
-			}
-		}
+	else if(flow && flow != &pcapReplay->defaultFlow && (event & EPOLLIN)) { // receive a message on one of the flows
+		numBytes = recv(sd, receivedPacket, (size_t)MTU, 0);
 
 		/* log result */
 		if(numBytes > 0) {
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-					"Successfully sent a '%d' (bytes) packet to the client", numBytes);
+					"Successfully received a TCP message for the client on flow %u: %d bytes", flow->id, numBytes);
+			_pcap_event(pcapReplay, _PCAP_EVENT_RECV, flow->proto, flow->id, numBytes, _pcap_now(), 0);
+			_pcap_causal_received(pcapReplay, flow, numBytes);
 		} else if(numBytes == 0) {
-			/* What is this TODO */
-			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-						"The last packet to send was an ACK. Skipped sending.", numBytes);
-		} else {
-			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
-						"Unable to send message");
-			exit(1);
-		}
-
-		//  now prepare next packet
-		if(!get_next_packet(pcapReplay, FALSE)) {
-			/* No packet found! */
-			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "No packet found! Just going to wait..");
-
-			// hack to simulate long delay
-			pcapReplay->nextPacket->timestamp.tv_sec = 999999;
-			pcapReplay->nextPacket->timestamp.tv_usec = 0;
+			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Client closed flow %u", flow->id);
+			_pcap_close_flow(pcapReplay, flow);
+		} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to receive message on flow %u", flow->id);
 		}
-
-		struct timespec timeToWait;
-		timeval_subtract (&timeToWait, &pckt_to_send->timestamp, &pcapReplay->nextPacket->timestamp);
-
-		// sleep for timeToWait time 
-		struct itimerspec itimerspecWait;
-		itimerspecWait.it_interval.tv_nsec = 0;
-		itimerspecWait.it_interval.tv_sec = 0;
-		itimerspecWait.it_value = timeToWait;
-		if (timerfd_settime(pcapReplay->server.tfd_sendtimer, 0, &itimerspecWait, NULL) < 0) {
-			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Can't set timerFD");
-			exit(1);
-		}
-
-		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Sleeping for %d %d!", timeToWait.tv_sec, timeToWait.tv_nsec);
-
-		free(pckt_to_send);
 	}
 
 	else if(event & EPOLLIN) { // receive a message from some TCP client
@@ -318,6 +1028,8 @@ void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 		if(numBytes > 0) {
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
 					"Successfully received a TCP message for the client: %d bytes", numBytes);
+			_pcap_event(pcapReplay, _PCAP_EVENT_RECV, _TCP_PROTO, 0, numBytes, _pcap_now(), 0);
+			_pcap_causal_received(pcapReplay, NULL, numBytes);
 		} else if(numBytes == 0) {
 			/* Client closed the remote connection.. shutdown */
 			shutdown_server(pcapReplay);
@@ -328,8 +1040,7 @@ void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t event) {
 	}
 
 	/* If timeout expired, close connection and exit plugin */
-	GDateTime* dt = g_date_time_new_now_local();
-	if(g_date_time_to_unix(dt) >= pcapReplay->timeout) {
+	if(_pcap_now() >= pcapReplay->deadline) {
 		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,  "Timeout reached!");
 		shutdown_server(pcapReplay);
 	}
@@ -396,6 +1107,13 @@ gboolean pcap_StartClient(Pcap_Replay* pcapReplay) {
 	/* Tell Epoll to watch this socket */
 	_pcap_epoll(pcapReplay, EPOLL_CTL_ADD, EPOLLIN, pcapReplay->client.server_sd_tcp);
 
+	// without multi-flow, all the TCP packets go through this connection
+	// with it, it only serves as the control connection of the replay
+	if(!pcapReplay->isMultiFlow) {
+		pcapReplay->defaultFlow.sd = pcapReplay->client.server_sd_tcp;
+		g_hash_table_insert(pcapReplay->flowSockets, GINT_TO_POINTER(pcapReplay->defaultFlow.sd), &pcapReplay->defaultFlow);
+	}
+
 	/************* UDP *************/
 	/* create the client socket and get a socket descriptor */
 	// this can be non-blocking at the outset cause connectionless
@@ -468,6 +1186,15 @@ gboolean pcap_StartClientTor(Pcap_Replay* pcapReplay) {
 	/* Tell Epoll to watch this socket */
 	_pcap_epoll(pcapReplay, EPOLL_CTL_ADD, EPOLLIN, pcapReplay->client.server_sd_tcp);
 
+	// all the TCP packets go through this connection
+	pcapReplay->defaultFlow.sd = pcapReplay->client.server_sd_tcp;
+	g_hash_table_insert(pcapReplay->flowSockets, GINT_TO_POINTER(pcapReplay->defaultFlow.sd), &pcapReplay->defaultFlow);
+
+	if(pcapReplay->isSocksPending) {
+		// the optimistic greeting and request go out now, the payloads are queued behind them
+		_pcap_send_tcp(pcapReplay, &pcapReplay->defaultFlow);
+	}
+
 	// NOTE Tor does not support UDP
 
 	return TRUE;
@@ -570,9 +1297,30 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 
 	pcapReplay->magic = MAGIC;
 	pcapReplay->slogf = slogf;
+	pcapReplay->logLevel = G_LOG_LEVEL_WARNING;
 	pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
 					"Creating a new instance of the pcap replayer plugin:");
-	
+
+	/* Optional arguments come first and start with '--' */
+	while(arg_idx < argc && g_str_has_prefix(argv[arg_idx], "--")) {
+		if(!_pcap_parse_option(pcapReplay, argv[arg_idx])) {
+			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+						"Unknown or invalid option '%s'. %s", argv[arg_idx], USAGE);
+			pcap_replay_free(pcapReplay);
+			return NULL;
+		}
+		arg_idx++;
+	}
+	if(pcapReplay->timeScale == 0 && pcapReplay->pacerRate == 0) {
+		// replay at the pace of the trace
+		pcapReplay->timeScale = 1;
+	}
+
+	pcapReplay->causalFlowExpected = g_array_new(FALSE, TRUE, sizeof(Pcap_Causal_Point));
+	pcapReplay->flows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, _pcap_flow_free);
+	pcapReplay->flowSockets = g_hash_table_new(g_direct_hash, g_direct_equal);
+	pcapReplay->defaultFlow.proto = _TCP_PROTO;
+	pcapReplay->defaultFlow.sd = -1;
 
 	const GString* nodeType = g_string_new(argv[arg_idx++]); // client or server ?
 	const GString* client_str = g_string_new("client");
@@ -582,6 +1330,14 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 	const GString* serverVpn_str = g_string_new("server-vpn");
 	const GString* serverTor_str = g_string_new("server-tor");
 
+	if(pcapReplay->isMultiFlow && !g_string_equal(nodeType,client_str) && !g_string_equal(nodeType,server_str)) {
+		// the flows are neither tunneled (vpn) nor proxied (tor)
+		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+					"--multi-flow is only supported with the 'client' and 'server' node types");
+		pcap_replay_free(pcapReplay);
+		return NULL;
+	}
+
 	if(g_string_equal(nodeType,clientTor_str)) {
 		/* If tor client, get SocksPort */
 		pcapReplay->proxyPort = htons(atoi(argv[arg_idx++]));
@@ -615,37 +1371,45 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 
 	// return NULL;
 	// Get the timeout of the experiment
-	GDateTime* dt = g_date_time_new_now_local();
-	pcapReplay->timeout = atoi(argv[arg_idx++]) + g_date_time_to_unix(dt);
+	pcapReplay->deadline = _pcap_now() + (guint64) atoi(argv[arg_idx++]) * 1000000;
 
-	// Get pcap paths and then open the file using pcap_open()
+	// Get pcap paths and then index the traces (or map their schedule files)
 	pcapReplay->nmb_pcap_file = argc-arg_idx;
-	// We open all the pcap file here in order to know directly if there is an error ;)
-	// The paths of the pcap file are stored in a queue as well as the pcap_t pointers.
-	// Path & pcap_t pointers are stored in the same order !
+	// We load all the traces here in order to know directly if there is an error ;)
+	// The paths of the pcap file are stored in a queue as well as the schedules.
+	// Path & schedules are stored in the same order !
 	pcapReplay->pcapFilePathQueue = g_queue_new();
-	pcapReplay->pcapStructQueue = g_queue_new();
+	pcapReplay->scheduleQueue = g_queue_new();
+
+	Pcap_Schedule_Filter filter;
+	filter.client_IP_in_pcap = pcapReplay->client_IP_in_pcap;
+	filter.pcap_local_nw_addr = pcapReplay->pcap_local_nw_addr;
+	filter.pcap_local_nw_mask = pcapReplay->pcap_local_nw_mask;
+	filter.expression = pcapReplay->filterExpression;
 
 	for(gint i=arg_idx; i < arg_idx+pcapReplay->nmb_pcap_file ;i++) {
-		// Open the pcap file 
-		pcap_t *pcap = NULL;
 		char ebuf[PCAP_ERRBUF_SIZE];
-		if ((pcap = pcap_open_offline(argv[i], ebuf)) == NULL) {
+		// traces are shared with the other instances replaying them
+		Pcap_Schedule* schedule = pcap_schedule_acquire(argv[i], &filter, ebuf);
+		if (schedule == NULL) {
 			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
-					"Unable to open the pcap file :");
+					"Unable to open the pcap file : %s", ebuf);
+			// gives back the schedules acquired so far
+			pcap_replay_free(pcapReplay);
 			return NULL;
 		} else {
 			pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
-					"Pcap file opened (%s) ",argv[i]);
+					"Pcap file opened (%s): %"G_GUINT64_FORMAT" packets to replay", argv[i], pcap_schedule_length(schedule));
 		}
-		//Add the file paths & pcap_t pointer to the queues
+		//Add the file paths & schedules to the queues
 		g_queue_push_tail(pcapReplay->pcapFilePathQueue, g_string_new(argv[i]));
-		g_queue_push_tail(pcapReplay->pcapStructQueue, pcap);
+		g_queue_push_tail(pcapReplay->scheduleQueue, schedule);
 	}
 
-	// Attach the first pcap_t struct to the instance state
+	// Attach the first schedule to the instance state
 	// The pcap files are used in the order the appear in arguments
-	pcapReplay->pcap = (pcap_t*) g_queue_peek_head(pcapReplay->pcapStructQueue);
+	pcapReplay->schedule = (Pcap_Schedule*) g_queue_peek_head(pcapReplay->scheduleQueue);
+	pcapReplay->cursor = 0;
 
 	/* If the first argument is equal to "client" 
 	 * Then create a new client instance of the  pcap replayer plugin */
@@ -741,7 +1505,7 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 		}
 
 		// create timerfd and start sending right away
-		pcapReplay->client.tfd_sendtimer = timerfd_create(CLOCK_MONOTONIC, 0);
+		pcapReplay->client.tfd_sendtimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
 
 		struct itimerspec itimerspecWait;
 		itimerspecWait.it_interval.tv_nsec = 0;
@@ -752,6 +1516,7 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 			pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Can't set timerFD");
 			exit(1);
 		}
+		pcapReplay->hasNextPacket = TRUE;
 
 		// finally monitor by epoll
 		struct epoll_event ev;
@@ -784,6 +1549,76 @@ Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf)
 	return pcapReplay;
 }
 
+/* The pcap_replay_index() function is the offline indexing stage.
+ * It converts a pcap trace into a schedule file that replay instances can map directly. */
+gint pcap_replay_index(gint argc, gchar* argv[], PcapReplayLogFunc slogf) {
+	/* Expected args:
+		./pcap_replay-exe index [--filter=<bpf>] <pcap_client_ip> <pcap_nw_addr> <pcap_nw_mask> <pcap_trace> <schedule_file>
+	*/
+	g_assert(slogf);
+	Pcap_Schedule_Filter filter;
+	memset(&filter, 0, sizeof(Pcap_Schedule_Filter));
+
+	// skip the optional filter, the positional arguments then start at argv[2]
+	gchar* expression = NULL;
+	if(argc > 2 && g_str_has_prefix(argv[2], "--filter=")) {
+		expression = g_strdelimit(g_strdup(argv[2] + strlen("--filter=")), ",", ' ');
+		filter.expression = expression;
+		argc--;
+		argv++;
+	}
+	if(argc != 7) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "%s", USAGE);
+		g_free(expression);
+		return -1;
+	}
+
+	if(inet_aton(argv[2], &filter.client_IP_in_pcap) == 0 || inet_aton(argv[3], &filter.pcap_local_nw_addr) == 0) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+				"Cannot get the client IP or local network used in pcap file : Err in the arguments ");
+		g_free(expression);
+		return -1;
+	}
+	filter.pcap_local_nw_mask = (guint32) 1 << (32 - atoi(argv[4]));
+
+	char ebuf[PCAP_ERRBUF_SIZE];
+	Pcap_Schedule* schedule = pcap_schedule_new_from_pcap(argv[5], &filter, ebuf);
+	g_free(expression);
+	if(schedule == NULL) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to index the pcap file : %s", ebuf);
+		return -1;
+	}
+
+	gboolean written = pcap_schedule_write(schedule, argv[6], ebuf);
+	if(written) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Wrote %"G_GUINT64_FORMAT" packets (%"G_GUINT64_FORMAT" payload bytes) to %s",
+				pcap_schedule_length(schedule), schedule->header->payload_bytes, argv[6]);
+	} else {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to write the schedule file : %s", ebuf);
+	}
+
+	pcap_schedule_free(schedule);
+	return written ? 0 : -1;
+}
+
+gint pcap_replay_events(gint argc, gchar* argv[], PcapReplayLogFunc slogf) {
+	/* Expected args:
+		./pcap_replay-exe events <event_log>
+	*/
+	g_assert(slogf);
+	if(argc != 3) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "%s", USAGE);
+		return -1;
+	}
+
+	char ebuf[PCAP_ERRBUF_SIZE];
+	if(!pcap_eventlog_dump(argv[2], stdout, ebuf)) {
+		slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__, "Unable to decode the event log : %s", ebuf);
+		return -1;
+	}
+	return 0;
+}
+
 void pcap_replay_ready(Pcap_Replay* pcapReplay) {
 	g_assert(pcapReplay && (pcapReplay->magic == MAGIC));
 
@@ -798,7 +1633,7 @@ void pcap_replay_ready(Pcap_Replay* pcapReplay) {
 		for(gint i = 0; i < nfds; i++) {
 			gint d = epevs[i].data.fd;
 			uint32_t e = epevs[i].events;
-			if(d == pcapReplay->client.server_sd_tcp || d == pcapReplay->client.server_sd_udp || d == pcapReplay->client.tfd_sendtimer) {
+			if(pcapReplay->isClient) {
 				_pcap_activateClient(pcapReplay, d, e);
 			} else {
 				_pcap_activateServer(pcapReplay, d, e);
@@ -826,14 +1661,71 @@ gint pcap_replay_getEpollDescriptor(Pcap_Replay* pcapReplay) {
 	return pcapReplay->ed;
 }
 
+void pcap_replay_parseLogLevel(gint argc, gchar* argv[], GLogLevelFlags* level) {
+	for(gint arg_idx = 1; arg_idx < argc && g_str_has_prefix(argv[arg_idx], "--"); arg_idx++) {
+		if(g_str_has_prefix(argv[arg_idx], "--log-level=")) {
+			_pcap_parse_log_level(argv[arg_idx] + strlen("--log-level="), level);
+		}
+	}
+}
+
+gsize pcap_replay_getTcpQueueDepth(Pcap_Replay* pcapReplay) {
+	g_assert(pcapReplay && (pcapReplay->magic == MAGIC));
+
+	gsize bytes = pcapReplay->defaultFlow.ring.bytes;
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, pcapReplay->flows);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		bytes += ((Pcap_Flow*) value)->ring.bytes;
+	}
+	return bytes;
+}
+
+guint64 pcap_replay_getTcpQueueLag(Pcap_Replay* pcapReplay) {
+	g_assert(pcapReplay && (pcapReplay->magic == MAGIC));
+
+	guint64 now = _pcap_now();
+	guint64 lag = _pcap_ring_lag(&pcapReplay->defaultFlow.ring, now);
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, pcapReplay->flows);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		lag = MAX(lag, _pcap_ring_lag(&((Pcap_Flow*) value)->ring, now));
+	}
+	return lag;
+}
+
 gboolean pcap_replay_isDone(Pcap_Replay* pcapReplay) {
 	g_assert(pcapReplay && (pcapReplay->magic == MAGIC));
 	return pcapReplay->isDone;
 }
 
+/* Log how faithfully the trace schedule was followed and what was replayed */
+static void _pcap_log_stats(Pcap_Replay* pcapReplay) {
+	Pcap_Stats* stats = &pcapReplay->stats;
+	gchar* sendSkew = pcap_histogram_summary(&stats->sendSkew);
+	gchar* queueDelay = pcap_histogram_summary(&stats->queueDelay);
+
+	pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+			"Send skew (usec behind schedule): %s, %"G_GUINT64_FORMAT" early", sendSkew, stats->early);
+	pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+			"TCP queueing delay (usec): %s", queueDelay);
+	pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+			"Replayed TCP %"G_GUINT64_FORMAT" packets %"G_GUINT64_FORMAT" bytes, "
+			"UDP %"G_GUINT64_FORMAT" packets %"G_GUINT64_FORMAT" bytes, %"G_GUINT64_FORMAT" dropped",
+			stats->packets[_TCP_PROTO], stats->bytes[_TCP_PROTO],
+			stats->packets[_UDP_PROTO], stats->bytes[_UDP_PROTO], stats->dropped);
+
+	g_free(sendSkew);
+	g_free(queueDelay);
+}
+
 void pcap_replay_free(Pcap_Replay* pcapReplay) {
 	g_assert(pcapReplay && (pcapReplay->magic == MAGIC));
 
+	_pcap_log_stats(pcapReplay);
+
 	if(pcapReplay->ed) {
 		close(pcapReplay->ed);
 	}
@@ -849,156 +1741,114 @@ void pcap_replay_free(Pcap_Replay* pcapReplay) {
 	if(pcapReplay->serverHostName) {
 		g_string_free(pcapReplay->serverHostName, TRUE);
 	}
-	while(!g_queue_is_empty(pcapReplay->pcapStructQueue)) {
-		pcap_t * pcap = g_queue_pop_head(pcapReplay->pcapStructQueue);
-		if(pcap) {
-			pcap_close(pcap);
+	g_free(pcapReplay->filterExpression);
+	pcap_eventlog_close(pcapReplay->eventlog);
+	if(pcapReplay->causalFlowExpected) {
+		g_array_free(pcapReplay->causalFlowExpected, TRUE);
+	}
+	if(pcapReplay->flowSockets) {
+		g_hash_table_destroy(pcapReplay->flowSockets);
+	}
+	if(pcapReplay->flows) {
+		g_hash_table_destroy(pcapReplay->flows);
+	}
+	g_free(pcapReplay->defaultFlow.ring.segments);
+	if(pcapReplay->scheduleQueue) {
+		while(!g_queue_is_empty(pcapReplay->scheduleQueue)) {
+			pcap_schedule_release(g_queue_pop_head(pcapReplay->scheduleQueue));
 		}
+		g_queue_free(pcapReplay->scheduleQueue);
 	}
-	while(!g_queue_is_empty(pcapReplay->pcapFilePathQueue)) {
-		GString * s = g_queue_pop_head(pcapReplay->pcapFilePathQueue);
-		if(s) {
-			g_string_free(s,TRUE);
+	if(pcapReplay->pcapFilePathQueue) {
+		while(!g_queue_is_empty(pcapReplay->pcapFilePathQueue)) {
+			GString * s = g_queue_pop_head(pcapReplay->pcapFilePathQueue);
+			if(s) {
+				g_string_free(s,TRUE);
+			}
 		}
+		g_queue_free(pcapReplay->pcapFilePathQueue);
 	}
-	g_queue_free(pcapReplay->pcapStructQueue);
-	g_queue_free(pcapReplay->pcapFilePathQueue);
 	pcapReplay->magic = 0;
 	g_free(pcapReplay);
 }
 
-gboolean get_next_packet(Pcap_Replay* pcapReplay, gboolean isClient) {
-	/* Get first the first pcap packet matching the IP:PORT received in argv 
-	 * Example : 
-	 * If in the pcap file the client have the IP:Port address 192.168.1.2:5555 
-	 * and the server have the IP:Port address 192.168.1.3:80. 
-	 * Then, if the plugin is instanciated as a client, the client needs to resend
-	 * the packet with ip.source=192.168.1.2 & ip.destination=192.168.1.3 & port.dest=80
-	 * to the remote server.
-	 * On the contrary, if the plugin is instanciated as a server, the server needs to wait
-	 * for a client connection. When the a client is connected, it starts to resend packets 
-	 * with ip.source=192.168.1.3 & ip.dest=192.168.1.2 & port.dest=5555 */
-
-	struct pcap_pkthdr *header;
-	const u_char *pkt_data;
-	int size = 0;
-	gboolean exists = FALSE;
-
-	//tcp info
-	const struct sniff_ethernet *ethernet; /* The ethernet header */
-	const struct sniff_ip *ip; /* The IP header */
-	const struct sniff_tcp *tcp; /* The TCP header */
-	u_int size_ip_header;
-	u_int size_tcp_header;
-	u_int size_payload;
-	char *payload;
-
-	_PROTO proto;
-
-	while((size = pcap_next_ex(pcapReplay->pcap, &header, &pkt_data)) >= 0) {
-		// There exists a next packet in the pcap file
-		// Retrieve header information
-		ethernet = (struct sniff_ethernet*)(pkt_data);
-		// ensure we are dealing with an ipv4 packet
-		if (ethernet->ether_type != 8) {
-			continue;
-		}
+/* causal mode: account for a packet of the peer the cursor goes past. Only what
+ * the peer sends over TCP counts, its datagrams may be lost. */
+static void _pcap_causal_expect(Pcap_Replay* pcapReplay, const Pcap_Schedule_Record* record) {
+	guint8 peerDirection = pcapReplay->isClient ? _SERVER_TO_CLIENT : _CLIENT_TO_SERVER;
+	if(!pcapReplay->isCausal || record->direction != peerDirection) {
+		return;
+	}
 
-		ip = (struct sniff_ip*)(pkt_data + SIZE_ETHERNET);
-		size_ip_header = IP_HL(ip)*4;
-		// ensure that we are dealing with tcp
-		// or if we're interested in tunneling udp over tcp in the case of vpn
-		if (ip->ip_p == '\x06') {
-			// tcp
-			proto = _TCP_PROTO;
-			tcp = (struct sniff_tcp*)(pkt_data + SIZE_ETHERNET + size_ip_header);
-			size_tcp_header = TH_OFF(tcp)*4;
-			size_payload = ntohs(ip->ip_len) - (size_ip_header + size_tcp_header);
-
-			if (size_payload <= 0) {
-				// does not have any payload, probably an ACK or keep alive
-				continue;
-			}
+	guint64 bytes;
+	if(pcapReplay->isVpn) {
+		// the whole packet is tunneled
+		bytes = record->header_size + record->payload_size;
+	} else if(record->proto == IPPROTO_TCP) {
+		bytes = record->payload_size;
+	} else {
+		return;
+	}
 
-			// if vpn, then encapsulate the entire TCP packet
-			if (pcapReplay->isVpn) {
-				payload = (char *)(pkt_data + SIZE_ETHERNET + size_ip_header);
-				size_payload = ntohs(ip->ip_len) - size_ip_header;
-			}
-			else {
-				// only extract payload
-				payload = (char *)(pkt_data + SIZE_ETHERNET + size_ip_header + size_tcp_header);
-			}
+	Pcap_Causal_Point* point = &pcapReplay->causalExpected;
+	if(pcapReplay->isMultiFlow) {
+		if(record->flow >= pcapReplay->causalFlowExpected->len) {
+			g_array_set_size(pcapReplay->causalFlowExpected, record->flow + 1);
 		}
-		else if (ip->ip_p == '\x11' && !pcapReplay->isTorClient) {
-			// udp (tor does not support udp)
-			// if vpn, then encapsulate the entire UDP packet in TCP
-			if (pcapReplay->isVpn) {
-				proto = _TCP_PROTO; // underlying protocol will be tcp even if packet is udp
-
-				payload = (char *)(pkt_data + SIZE_ETHERNET + size_ip_header);
-				size_payload = ntohs(ip->ip_len) - size_ip_header;
-			} else {
-				// plain udp
-				proto = _UDP_PROTO;
+		point = &g_array_index(pcapReplay->causalFlowExpected, Pcap_Causal_Point, record->flow);
+	}
+	point->bytes += bytes;
+	point->timestamp = record->timestamp;
+}
 
-				payload = (char *)(pkt_data + SIZE_ETHERNET + size_ip_header + UDP_HEADER_SIZE);
-				size_payload = ntohs(ip->ip_len) - (size_ip_header + UDP_HEADER_SIZE);
-			}
+gboolean get_next_packet(Pcap_Replay* pcapReplay, gboolean isClient) {
+	/* Get the next packet of the schedule that our side has to send.
+	 * The trace was already filtered on the IPs received in argv when it was indexed
+	 * (see pcap_schedule_new_from_pcap()), so we only need to pick the right direction:
+	 * the client resends the packets the client sent in the trace, and
+	 * the server resends the packets going back to the client in the trace. */
+	const Pcap_Schedule* schedule = pcapReplay->schedule;
+	guint8 direction = isClient ? _CLIENT_TO_SERVER : _SERVER_TO_CLIENT;
+
+	while(pcapReplay->cursor < pcap_schedule_length(schedule)) {
+		const Pcap_Schedule_Record* record = &schedule->records[pcapReplay->cursor++];
+		_pcap_causal_expect(pcapReplay, record);
+
+		if(record->direction != direction) {
+			continue;
 		}
-		else {
-			// not of interest
+		if(record->proto == IPPROTO_UDP && pcapReplay->isTorClient) {
+			// tor does not support udp
 			continue;
 		}
 
-		// Client scenario
-		if(isClient) {
-			// next packet must be one with ip.src == client_IP_in_pcap.s_addr
-			if(ip->ip_src.s_addr == pcapReplay->client_IP_in_pcap.s_addr) {
-				// AND ip.dst must not be a local address (e.g., should not belong to 192.168.0.0/16)
-				// or (ip.dst < pcapReplay->local_net_addr OR ip.dst > pcapReplay->local_net_addr + pcapReplay->local_net_mask)
-				if( ntohl(ip->ip_dst.s_addr) < ntohl(pcapReplay->pcap_local_nw_addr.s_addr)
-					|| ntohl(ip->ip_dst.s_addr) > ntohl(pcapReplay->pcap_local_nw_addr.s_addr) + pcapReplay->pcap_local_nw_mask) {
-
-					pcapReplay->nextPacket = g_new0(Custom_Packet_t, 1);
-					pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Found at least one matching packet in next_packet. Destination -> %s",
-						inet_ntoa(ip->ip_dst));
-					exists = TRUE;
-					pcapReplay->nextPacket->timestamp.tv_sec = header->ts.tv_sec;
-					pcapReplay->nextPacket->timestamp.tv_usec = header->ts.tv_usec;
-					pcapReplay->nextPacket->payload_size = size_payload;
-					pcapReplay->nextPacket->payload = payload;
-					pcapReplay->nextPacket->proto = proto;
+		const gchar* transport = pcap_schedule_payload(schedule, record);
+		Custom_Packet_t* packet = &pcapReplay->nextPacket;
 
-					break;
-				}
-			}	
-		} 
-		// Server scenario 
-		else {
-			// ip.src must not be a local address (e.g., should not belong to 192.168.0.0/16)
-			// or (ip.src < pcapReplay->local_net_addr OR ip.src > pcapReplay->local_net_addr + pcapReplay->local_net_mask)
-			if(ntohl(ip->ip_src.s_addr) < ntohl(pcapReplay->pcap_local_nw_addr.s_addr)
-				|| ntohl(ip->ip_src.s_addr) > ntohl(pcapReplay->pcap_local_nw_addr.s_addr) + pcapReplay->pcap_local_nw_mask) {
-				// AND next packet must be one with ip.dst == client_IP_in_pcap.s_addr (reverse flow) 
-				if(ip->ip_dst.s_addr == pcapReplay->client_IP_in_pcap.s_addr) {
-
-					pcapReplay->nextPacket = g_new0(Custom_Packet_t, 1);
-					pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__, "Found at least one matching packet in next_packet. Destination -> %s",
-						inet_ntoa(ip->ip_dst));
-					exists = TRUE;
-					pcapReplay->nextPacket->timestamp.tv_sec = header->ts.tv_sec;
-					pcapReplay->nextPacket->timestamp.tv_usec = header->ts.tv_usec;
-					pcapReplay->nextPacket->payload_size = size_payload;
-					pcapReplay->nextPacket->payload = payload;
-					pcapReplay->nextPacket->proto = proto;
+		packet->timestamp.tv_sec = record->timestamp / 1000000;
+		packet->timestamp.tv_usec = record->timestamp % 1000000;
+		packet->flow = record->flow;
 
-					break;
-				}
-			}		
+		if(pcapReplay->isVpn) {
+			// if vpn, then encapsulate the entire TCP/UDP packet in TCP
+			packet->payload = transport;
+			packet->payload_size = record->header_size + record->payload_size;
+			packet->proto = _TCP_PROTO;
+		} else {
+			// only extract payload
+			packet->payload = transport + record->header_size;
+			packet->payload_size = record->payload_size;
+			packet->proto = record->proto == IPPROTO_TCP ? _TCP_PROTO : _UDP_PROTO;
 		}
-	} 
-	return exists;
+
+		if(pcapReplay->isCausal) {
+			packet->depends = pcapReplay->isMultiFlow && record->flow < pcapReplay->causalFlowExpected->len
+					? g_array_index(pcapReplay->causalFlowExpected, Pcap_Causal_Point, record->flow)
+					: pcapReplay->causalExpected;
+		}
+		return TRUE;
+	}
+	return FALSE;
 }
 
 void deinstanciate(Pcap_Replay* pcapReplay, gint sd) {
@@ -1034,30 +1884,47 @@ int timeval_subtract (struct timespec *result, struct timeval *y, struct timeval
 }
 
 gboolean change_pcap_file_to_send(Pcap_Replay* pcapReplay) {
-	pcap_t * pcap = g_queue_pop_head(pcapReplay->pcapStructQueue);
-	pcap_close(pcap);
-
-	pcap= NULL;
-	char ebuf[PCAP_ERRBUF_SIZE];
-	GString * pcap_to_reset = g_queue_peek_head(pcapReplay->pcapFilePathQueue);
+	/* Schedules are never consumed, so the trace we leave only needs its cursor
+	 * rewound, which happens whenever it becomes the current one again */
+	g_queue_push_tail(pcapReplay->scheduleQueue, g_queue_pop_head(pcapReplay->scheduleQueue));
+	g_queue_push_tail(pcapReplay->pcapFilePathQueue, g_queue_pop_head(pcapReplay->pcapFilePathQueue));
 
-	if ((pcap = pcap_open_offline(pcap_to_reset->str, ebuf)) == NULL) {
-		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
-				"Unable to re-open the pcap file : %s",pcap_to_reset->str);
-		return FALSE;
-	} else{
-		pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
-				"Successfully reset pcap file : %s",pcap_to_reset->str);
+	pcapReplay->schedule = g_queue_peek_head(pcapReplay->scheduleQueue);
+	pcapReplay->cursor = 0;
+	// the new trace gets its own timeline, anchored on its first packet sent
+	pcapReplay->anchorClock = 0;
 
-		g_queue_push_tail(pcapReplay->pcapFilePathQueue,  g_queue_pop_head(pcapReplay->pcapFilePathQueue));
-		g_queue_push_tail(pcapReplay->pcapStructQueue, pcap);																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																																				
+	GString* path = g_queue_peek_head(pcapReplay->pcapFilePathQueue);
+	pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+			"Successfully reset pcap file : %s", path->str);
+	return TRUE;
+}
 
-		pcapReplay->pcap =  g_queue_peek_head(pcapReplay->pcapStructQueue);
-		return TRUE;
+/* Log the peak depth and lag of the TCP queues and close the flows */
+static void _pcap_close_flows(Pcap_Replay* pcapReplay) {
+	gsize maxBytes = pcapReplay->defaultFlow.ring.maxBytes;
+	guint64 maxLag = pcapReplay->defaultFlow.ring.maxLag;
+
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, pcapReplay->flows);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		Pcap_Flow* flow = value;
+		maxBytes = MAX(maxBytes, flow->ring.maxBytes);
+		maxLag = MAX(maxLag, flow->ring.maxLag);
+		if(!flow->isClosed) {
+			_pcap_close_flow(pcapReplay, flow);
+		}
 	}
+
+	pcapReplay->slogf(G_LOG_LEVEL_CRITICAL, __FUNCTION__,
+			"TCP queue peaked at '%d' (bytes) and %"G_GUINT64_FORMAT" usec behind schedule over %u flows",
+			maxBytes, maxLag, MAX(g_hash_table_size(pcapReplay->flows), 1));
 }
 
 gboolean shutdown_server(Pcap_Replay* pcapReplay) {
+	_pcap_close_flows(pcapReplay);
+
 	epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, pcapReplay->server.sd_tcp, NULL);
 	epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, pcapReplay->server.sd_udp, NULL);
 	epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, pcapReplay->server.client_sd_tcp, NULL);
@@ -1078,6 +1945,8 @@ gboolean shutdown_server(Pcap_Replay* pcapReplay) {
 }
 
 gboolean shutdown_client(Pcap_Replay* pcapReplay) {
+	_pcap_close_flows(pcapReplay);
+
 	epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, pcapReplay->client.server_sd_tcp, NULL);
 	epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, pcapReplay->client.server_sd_udp, NULL);
 	epoll_ctl(pcapReplay->ed, EPOLL_CTL_DEL, pcapReplay->client.tfd_sendtimer, NULL);
@@ -1092,6 +1961,24 @@ gboolean shutdown_client(Pcap_Replay* pcapReplay) {
 	return FALSE;
 }
 
+/* Step 3) of the Socks5 negociation: the 10 bytes request asking the proxy
+ * to connect to the server, by IPv4 address */
+static void _pcap_socks_connect_request(Pcap_Replay* pcapReplay, gchar* buffer) {
+	struct addrinfo* info;
+	if(getaddrinfo(pcapReplay->serverHostName->str, NULL, NULL, &info) == 0) {
+		pcapReplay->serverIP = ((struct sockaddr_in*)(info->ai_addr))->sin_addr.s_addr;
+		freeaddrinfo(info);
+	}
+
+	/* case 3a - IPv4 */
+	in_addr_t ip = pcapReplay->serverIP;
+	in_port_t port = pcapReplay->serverPortTCP;
+
+	g_memmove(&buffer[0], "\x05\x01\x00\x01", 4);
+	g_memmove(&buffer[4], &ip, 4);
+	g_memmove(&buffer[8], &port, 2);
+}
+
 gboolean initiate_conn_to_proxy(Pcap_Replay* pcapReplay) {
 	/* This function is used to connect to the Tor proxy.
 	 * The client needs to respect the Socks5 protocol to create 
@@ -1108,6 +1995,18 @@ gboolean initiate_conn_to_proxy(Pcap_Replay* pcapReplay) {
 	 *   See shd-tgen-transport.c for more information about the negociation protocol !
 	 **/
 
+	if(pcapReplay->isSocksOptimistic) {
+		/* Steps 1) and 3) go out as soon as the connection is set up, the payloads
+		 * follow without waiting for steps 2) and 4), see _pcap_socks_reply() */
+		g_memmove(&pcapReplay->socksRequest[0], "\x05\x01\x00", 3);
+		_pcap_socks_connect_request(pcapReplay, &pcapReplay->socksRequest[3]);
+		_pcap_ring_push(&pcapReplay->defaultFlow.ring, pcapReplay->socksRequest, PCAP_SOCKS_REQUEST_SIZE, 0);
+		pcapReplay->isSocksPending = TRUE;
+		pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
+				"Socks5 greeting and request queued ahead of the payloads");
+		return TRUE;
+	}
+
 	/* Step 1)
 	* Send authentication (5,1,0) to Tor proxy (Socks V.5) */
 	pcapReplay->slogf(G_LOG_LEVEL_MESSAGE, __FUNCTION__,
@@ -1161,23 +2060,9 @@ gboolean initiate_conn_to_proxy(Pcap_Replay* pcapReplay) {
 	 * We use method 3a !
 	 */
 
-	struct addrinfo* info;
-	int ret = getaddrinfo(pcapReplay->serverHostName->str, NULL, NULL, &info);
-	if(ret >= 0) {
-		pcapReplay->serverIP = ((struct sockaddr_in*)(info->ai_addr))->sin_addr.s_addr;
-	}
-	freeaddrinfo(info);
-
-	/* case 3a - IPv4 */
-	in_addr_t ip = pcapReplay->serverIP;
-	in_addr_t port = pcapReplay->serverPortTCP;
-
 	gchar step3_buffer[16];
 	memset(step3_buffer, 0, 16);
-
-	g_memmove(&step3_buffer[0], "\x05\x01\x00\x01", 4);
-	g_memmove(&step3_buffer[4], &ip, 4);
-	g_memmove(&step3_buffer[8], &port, 2);
+	_pcap_socks_connect_request(pcapReplay, step3_buffer);
 
 	bytesSent = send_to_proxy(pcapReplay, step3_buffer, 10);
 	g_assert(bytesSent == 10);
@@ -23,9 +23,19 @@
 #include <netinet/tcp.h>
 #include <sys/timerfd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
+#include "pcap_schedule.h"
+#include "pcap_stats.h"
+#include "pcap_eventlog.h"
 
 #define MTU 2000 // Size of the buffer for recv() function (in bytes)
+#define PCAP_BURST_MAX 64 // Max packets sent per wakeup in burst mode
+#define PCAP_RING_SIZE 4096 // Max TCP segments queued per connection, replay pauses there (power of two)
+#define PCAP_RING_MIN 16 // TCP segments of a ring when it is first used, doubled as needed (power of two)
+#define PCAP_PACER_BURST 65536 // Depth of the --rate token bucket (in bytes)
+#define PCAP_SOCKS_REQUEST_SIZE 13 // Socks5 greeting (3) and IPv4 CONNECT request (10)
+#define PCAP_SOCKS_REPLY_MAX 264 // Socks5 method choice (2) and the longest CONNECT reply (262)
 
 typedef void (*PcapReplayLogFunc)(GLogLevelFlags level, const char* functionName, const char* format, ...);
 
@@ -34,14 +44,74 @@ typedef enum _PROTO{
 	_UDP_PROTO
 } _PROTO;
 
-/* Custom packets are used to store the packets we read in the pacp file */
+/* In causal mode, how much of the peer's stream precedes a point of the trace:
+ * the bytes of the peer carried over TCP up to there, and the capture time
+ * (usec) of the last of its packets */
+typedef struct _Pcap_Causal_Point {
+	guint64 bytes;
+	guint64 timestamp;
+} Pcap_Causal_Point;
+
+/* Custom packets describe the next packet to send. The payload points
+ * straight into the schedule of the trace, see get_next_packet() */
 typedef struct Custom_Packet {
 	struct timeval timestamp;
-	char* payload;
+	const char* payload;
 	gint payload_size;
 	_PROTO proto;
+	guint32 flow; /* index of the packet's flow in the schedule */
+	Pcap_Causal_Point depends; /* causal mode: what we must receive before sending it */
 } Custom_Packet_t;
 
+/* A TCP segment waiting to be written. The data points into the schedule */
+typedef struct _Pcap_Tcp_Segment {
+	const gchar* data;
+	gsize length;
+	guint64 scheduled; /* clock time (usec) at which the segment was due, 0 if it is not from the trace */
+} Pcap_Tcp_Segment;
+
+/* The outbound ring of a TCP connection. The send timer queues the trace
+ * segments on schedule and they are written as fast as the socket accepts
+ * them, the rest being drained on EPOLLOUT. See _pcap_flush_tcp()
+ * The segments are allocated on the first push and grow up to PCAP_RING_SIZE,
+ * so that idle flows cost nothing. */
+typedef struct _Pcap_Tcp_Ring {
+	Pcap_Tcp_Segment* segments;
+	guint capacity; /* segments allocated, 0 or a power of two */
+	guint head; /* running index of the next segment to write */
+	guint tail; /* running index of the next free slot */
+	gsize offset; /* bytes of the head segment already written */
+	gsize bytes; /* bytes queued, the queue depth */
+	gboolean isBlocked; /* the socket is watched for EPOLLOUT */
+	gboolean isPaused; /* the ring is full and the send timer waits for it to drain */
+
+	/* high-water marks, reported when the connection is shut down */
+	gsize maxBytes;
+	guint64 maxLag;
+} Pcap_Tcp_Ring;
+
+#define PCAP_FLOW_MAGIC 0x50524657 /* "PRFW" */
+
+/* A flow (5-tuple) of the trace. In multi-flow mode every flow is replayed
+ * over its own connection (TCP) or socket (UDP). The client announces the
+ * flow id to the server with a hello (see Pcap_Flow_Hello) sent first on
+ * the connection, or as a datagram before the first one of the flow. */
+typedef struct _Pcap_Flow_Hello {
+	guint32 magic; /* PCAP_FLOW_MAGIC, network order */
+	guint32 flow; /* network order */
+} Pcap_Flow_Hello;
+
+typedef struct _Pcap_Flow {
+	guint32 id; /* index of the flow in the schedule */
+	_PROTO proto;
+	gint sd; /* TCP connection or UDP socket of the flow, -1 until it is known */
+	gboolean isClosed; /* the peer closed the connection, later packets are dropped */
+	struct sockaddr_in peerAddr; /* server only: UDP endpoint of the client flow */
+	guint64 received; /* causal mode: bytes received on the TCP connection of the flow */
+	Pcap_Flow_Hello hello;
+	Pcap_Tcp_Ring ring;
+} Pcap_Flow;
+
 /* all state for the pcap replayer is stored here */
 typedef struct _Pcap_Replay {
 	guint magic;
@@ -53,8 +123,11 @@ typedef struct _Pcap_Replay {
 	 * we use this descriptor with epoll to watch events on our sockets. */
 	gint ed;
 
-	/* Timeout of the pcap replayer. Instance stops when timeout is reached */
-	guint64 timeout;
+	/* Timeout of the pcap replayer: the monotonic clock time (usec) at which the instance stops */
+	guint64 deadline;
+
+	/* Messages above this level are not even formatted, see --log-level */
+	GLogLevelFlags logLevel;
 
 	gboolean isClient; /* client or server */
 	gboolean isVpn; /* flag that allows encapsulation */
@@ -64,21 +137,76 @@ typedef struct _Pcap_Replay {
 
 	/* The following queues are used to keep tack of the pcap files
 	 * the plugin has to send */
-	GQueue* pcapStructQueue;
+	GQueue* scheduleQueue;
 	GQueue* pcapFilePathQueue;
 
-	/* Pcap structure that is used to progress in the pcap file */
- 	pcap_t *pcap; // Current pcap structure in use 	
+	/* Schedule of the trace in use and our position in it */
+	Pcap_Schedule* schedule;
+	guint64 cursor;
 	gint nmb_pcap_file; // nmb of pcap files received in argument
 
-	/* nextPacket is a pointer to the next packet to send 
+	/* nextPacket is the next packet to send 
 	 * See get_next_packet() */
-	Custom_Packet_t * nextPacket;
+	Custom_Packet_t nextPacket;
+
+	/* The replay timeline: the trace time anchorTrace (usec) is replayed
+	 * at the monotonic clock time anchorClock (usec) */
+	guint64 anchorTrace;
+	guint64 anchorClock;
+
+	/* Without multi-flow, all the TCP packets go through defaultFlow whose socket
+	 * is the client/server TCP connection. hasNextPacket tells whether nextPacket
+	 * is valid when the send timer is re-armed. */
+	Pcap_Flow defaultFlow;
+	gboolean hasNextPacket;
+	/* the TCP rings paused while full, the send timer stays disarmed until they drain */
+	guint pausedRings;
+
+	/* In multi-flow mode, the flows of the trace by id and by socket */
+	gboolean isMultiFlow;
+	GHashTable* flows;
+	GHashTable* flowSockets;
+
+	/* In burst mode, each wakeup also sends the packets due within burstWindow (usec) */
+	gboolean isBurstMode;
+	guint64 burstWindow;
+
+	/* Pacing: trace time offsets are divided by timeScale (0 when only --rate
+	 * is given: the trace times are ignored). With --rate, a token bucket of
+	 * PCAP_PACER_BURST bytes refilled at pacerRate (bytes/usec) also holds the
+	 * packets back; pacerFull is the clock time (usec) at which it is full again */
+	gdouble timeScale;
+	gdouble pacerRate;
+	gdouble pacerFull;
+
+	/* Causal mode: a packet is only sent once the peer's packets preceding it in
+	 * the trace were received, counted on the whole TCP connection (causalExpected,
+	 * causalReceived) or per flow in multi-flow mode (causalFlowExpected by flow id,
+	 * Pcap_Flow.received). isWaitingPeer when the send timer waits for them */
+	gboolean isCausal;
+	gboolean isWaitingPeer;
+	Pcap_Causal_Point causalExpected;
+	GArray* causalFlowExpected;
+	guint64 causalReceived;
+
+	/* timing and volume of the replay, logged by pcap_replay_free() */
+	Pcap_Stats stats;
+	/* optional binary per-packet event log, see --event-log */
+	Pcap_Eventlog* eventlog;
 
 	/* Infos used by the client to connect to the Tor proxy */
 	in_addr_t proxyIP; /* stored in network order */
 	in_port_t proxyPort; /*  Tor SocksPort (default 9000) */
 
+	/* Optimistic Socks5: the greeting and the CONNECT request (socksRequest) are
+	 * queued ahead of the first payload, and both replies are parsed out of the
+	 * received stream (socksReply) while isSocksPending */
+	gboolean isSocksOptimistic;
+	gboolean isSocksPending;
+	gchar socksRequest[PCAP_SOCKS_REQUEST_SIZE];
+	guchar socksReply[PCAP_SOCKS_REPLY_MAX];
+	gsize socksReplyLength;
+
 	/* Infos used by the client to connect to the remote server */
 	GString* serverHostName;
 	in_addr_t serverIP; /* stored in network order */
@@ -90,6 +218,8 @@ typedef struct _Pcap_Replay {
 	struct in_addr client_IP_in_pcap;
 	struct in_addr pcap_local_nw_addr;
 	guint32 pcap_local_nw_mask;
+	/* optional user BPF expression, see --filter */
+	gchar* filterExpression;
 
 	struct {	 
 		int tfd_sendtimer; /* timerfd to notify server to send */
@@ -110,6 +240,8 @@ typedef struct _Pcap_Replay {
 } Pcap_Replay;
 
 Pcap_Replay* pcap_replay_new(gint argc, gchar* argv[], PcapReplayLogFunc slogf); 
+gint pcap_replay_index(gint argc, gchar* argv[], PcapReplayLogFunc slogf);
+gint pcap_replay_events(gint argc, gchar* argv[], PcapReplayLogFunc slogf);
 
 gboolean pcap_StartClient(Pcap_Replay* pcapReplay);
 gboolean pcap_StartServer(Pcap_Replay* pcapReplay);
@@ -128,6 +260,12 @@ void _pcap_activateClient(Pcap_Replay* pcapReplay, gint sd, uint32_t events);
 void _pcap_activateServer(Pcap_Replay* pcapReplay, gint sd, uint32_t events);
 
 gint pcap_replay_getEpollDescriptor(Pcap_Replay* pcapReplay);
+/* set level to the one given with --log-level among the options of argv, if
+ * any, so that the logs of pcap_replay_new() are already filtered */
+void pcap_replay_parseLogLevel(gint argc, gchar* argv[], GLogLevelFlags* level);
+/* Bytes queued on the TCP connections and how late (usec) the oldest of them is */
+gsize pcap_replay_getTcpQueueDepth(Pcap_Replay* pcapReplay);
+guint64 pcap_replay_getTcpQueueLag(Pcap_Replay* pcapReplay);
 void _pcap_epoll(Pcap_Replay* pcapReplay, gint operation, guint32 events, int sd);
 // void _pcap_server_epoll(Pcap_Replay* pcapReplay, gint operation, guint32 events);
 // void _pcap_client_epoll(Pcap_Replay* pcapReplay, gint operation, guint32 events);
@@ -0,0 +1,444 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcap_replay.h"
+#include "pcap_stream.h"
+
+/* Schedules shared by all the replay instances of the process, keyed by
+ * trace path and filter. Instances only hold a cursor into them. */
+static GHashTable* scheduleCache = NULL;
+G_LOCK_DEFINE_STATIC(scheduleCache);
+/* pcap_compile() is not reentrant before libpcap 1.8, and traces may be indexed
+ * by several threads (see pcap_prepare.c) */
+G_LOCK_DEFINE_STATIC(bpfCompiler);
+
+static Pcap_Schedule* _pcap_schedule_attach(gchar* data, gsize length, gboolean isMapped) {
+	Pcap_Schedule* schedule = g_new0(Pcap_Schedule, 1);
+
+	schedule->data = data;
+	schedule->length = length;
+	schedule->isMapped = isMapped;
+
+	schedule->header = (const Pcap_Schedule_Header*) data;
+	schedule->records = (const Pcap_Schedule_Record*) (data + sizeof(Pcap_Schedule_Header));
+	schedule->flows = (const Pcap_Schedule_Flow*) (schedule->records + schedule->header->nmb_records);
+	schedule->payloads = (const gchar*) (schedule->flows + schedule->header->nmb_flows);
+
+	return schedule;
+}
+
+/* returns TRUE if addr belongs to the local network of the trace
+ * (e.g., belongs to 192.168.0.0/16) */
+static gboolean _pcap_schedule_is_local(const Pcap_Schedule_Filter* filter, struct in_addr addr) {
+	guint32 nw_addr = ntohl(filter->pcap_local_nw_addr.s_addr);
+	return ntohl(addr.s_addr) >= nw_addr && ntohl(addr.s_addr) <= nw_addr + filter->pcap_local_nw_mask;
+}
+
+static guint32 _pcap_schedule_expression_hash(const gchar* expression) {
+	return (expression && *expression) ? MAX(g_str_hash(expression), 1) : 0;
+}
+
+/* Compile the filter into a BPF program selecting the packets between the client
+ * and the hosts outside of the local network. It matches a superset of what the
+ * indexing loop keeps, the loop still checks every packet it is handed. */
+static gboolean _pcap_schedule_set_bpf(pcap_t* pcap, const Pcap_Schedule_Filter* filter, gchar* ebuf) {
+	gchar client[INET_ADDRSTRLEN], nw_addr[INET_ADDRSTRLEN], nw_mask[INET_ADDRSTRLEN];
+	struct in_addr mask, network;
+	mask.s_addr = htonl(~(filter->pcap_local_nw_mask - 1));
+	// libpcap rejects a net with host bits set
+	network.s_addr = filter->pcap_local_nw_addr.s_addr & mask.s_addr;
+
+	inet_ntop(AF_INET, &filter->client_IP_in_pcap, client, INET_ADDRSTRLEN);
+	inet_ntop(AF_INET, &network, nw_addr, INET_ADDRSTRLEN);
+	inet_ntop(AF_INET, &mask, nw_mask, INET_ADDRSTRLEN);
+
+	GString* program = g_string_new(NULL);
+	if(network.s_addr == filter->pcap_local_nw_addr.s_addr) {
+		g_string_printf(program, "ip and (tcp or udp)"
+				" and ((src host %s and not dst net %s mask %s) or (dst host %s and not src net %s mask %s))",
+				client, nw_addr, nw_mask, client, nw_addr, nw_mask);
+	} else {
+		// the indexing loop counts the local network from the given address, so
+		// the masked net would drop the hosts before it: leave the network to the loop
+		g_string_printf(program, "ip and (tcp or udp) and host %s", client);
+	}
+	if(filter->expression && *filter->expression) {
+		g_string_append_printf(program, " and (%s)", filter->expression);
+	}
+
+	struct bpf_program bpf;
+	G_LOCK(bpfCompiler);
+	gboolean isSet = pcap_compile(pcap, &bpf, program->str, 1, PCAP_NETMASK_UNKNOWN) == 0;
+	G_UNLOCK(bpfCompiler);
+	if(isSet) {
+		isSet = pcap_setfilter(pcap, &bpf) == 0;
+		pcap_freecode(&bpf);
+	}
+	if(!isSet) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "invalid filter \"%s\": %s", program->str, pcap_geterr(pcap));
+	}
+
+	g_string_free(program, TRUE);
+	return isSet;
+}
+
+static guint _pcap_schedule_flow_hash(gconstpointer key) {
+	const Pcap_Schedule_Flow* flow = key;
+	return flow->server_ip ^ ((guint)flow->client_port << 16 | flow->server_port) ^ flow->proto;
+}
+
+static gboolean _pcap_schedule_flow_equal(gconstpointer a, gconstpointer b) {
+	const Pcap_Schedule_Flow* fa = a;
+	const Pcap_Schedule_Flow* fb = b;
+	return fa->server_ip == fb->server_ip && fa->client_port == fb->client_port
+			&& fa->server_port == fb->server_port && fa->proto == fb->proto;
+}
+
+Pcap_Schedule* pcap_schedule_new_from_pcap(const gchar* path, const Pcap_Schedule_Filter* filter, gchar* ebuf) {
+	/* Pick the packets that either side of the replay will have to send
+	 * Example :
+	 * If in the pcap file the client have the IP address 192.168.1.2
+	 * and the server have the IP address 172.16.1.3.
+	 * Then the client needs to resend the packets with ip.source=192.168.1.2 & ip.destination=172.16.1.3,
+	 * and the server the ones with ip.source=172.16.1.3 & ip.dest=192.168.1.2.
+	 * The direction is recorded so that both sides can share the same schedule. */
+	// the trace may be pcap or pcapng, and compressed, see pcap_stream_open()
+	Pcap_Stream* stream = pcap_stream_open(path, ebuf);
+	if(stream == NULL) {
+		return NULL;
+	}
+	pcap_t* pcap = stream->pcap;
+
+	if(pcap_datalink(pcap) != DLT_EN10MB) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: only ethernet captures are supported", path);
+		pcap_stream_close(stream);
+		return NULL;
+	}
+
+	if(!_pcap_schedule_set_bpf(pcap, filter, ebuf)) {
+		pcap_stream_close(stream);
+		return NULL;
+	}
+
+	GArray* records = g_array_new(FALSE, FALSE, sizeof(Pcap_Schedule_Record));
+	GArray* flows = g_array_new(FALSE, FALSE, sizeof(Pcap_Schedule_Flow));
+	GString* payloads = g_string_new(NULL);
+	/* flow 5-tuple -> index in flows. the keys are the flows themselves,
+	 * copied since the array moves when it grows */
+	GHashTable* flowIndex = g_hash_table_new_full(_pcap_schedule_flow_hash, _pcap_schedule_flow_equal, g_free, NULL);
+
+	struct pcap_pkthdr *header;
+	const u_char *pkt_data;
+	gint res;
+
+	while((res = pcap_next_ex(pcap, &header, &pkt_data)) >= 0) {
+		if(header->caplen < SIZE_ETHERNET + 20) {
+			continue;
+		}
+
+		// ensure we are dealing with an ipv4 packet
+		const struct sniff_ethernet *ethernet = (const struct sniff_ethernet*)(pkt_data);
+		if(ntohs(ethernet->ether_type) != 0x0800) {
+			continue;
+		}
+
+		const struct sniff_ip *ip = (const struct sniff_ip*)(pkt_data + SIZE_ETHERNET);
+		guint size_ip_header = IP_HL(ip)*4;
+		guint ip_len = ntohs(ip->ip_len);
+		if(size_ip_header < 20 || header->caplen < SIZE_ETHERNET + size_ip_header) {
+			continue;
+		}
+
+		// next, only keep the flows we are interested in
+		Pcap_Schedule_Record record;
+		memset(&record, 0, sizeof(Pcap_Schedule_Record));
+
+		if(ip->ip_src.s_addr == filter->client_IP_in_pcap.s_addr && !_pcap_schedule_is_local(filter, ip->ip_dst)) {
+			record.direction = _CLIENT_TO_SERVER;
+		} else if(!_pcap_schedule_is_local(filter, ip->ip_src) && ip->ip_dst.s_addr == filter->client_IP_in_pcap.s_addr) {
+			record.direction = _SERVER_TO_CLIENT;
+		} else {
+			continue;
+		}
+
+		const u_char* transport = pkt_data + SIZE_ETHERNET + size_ip_header;
+		guint captured = header->caplen - (SIZE_ETHERNET + size_ip_header);
+		u_short sport, dport;
+
+		if(ip->ip_p == IPPROTO_TCP) {
+			if(captured < sizeof(struct sniff_tcp)) {
+				continue;
+			}
+			const struct sniff_tcp *tcp = (const struct sniff_tcp*)(transport);
+			sport = tcp->th_sport;
+			dport = tcp->th_dport;
+			record.header_size = TH_OFF(tcp)*4;
+			if(ip_len <= size_ip_header + record.header_size) {
+				// does not have any payload, probably an ACK or keep alive
+				continue;
+			}
+		} else if(ip->ip_p == IPPROTO_UDP) {
+			if(captured < sizeof(struct sniff_udp)) {
+				continue;
+			}
+			const struct sniff_udp *udp = (const struct sniff_udp*)(transport);
+			sport = udp->udph_sport;
+			dport = udp->udph_dport;
+			record.header_size = UDP_HEADER_SIZE;
+			if(ip_len < size_ip_header + record.header_size) {
+				continue;
+			}
+		} else {
+			// not of interest
+			continue;
+		}
+
+		if(captured < record.header_size) {
+			continue;
+		}
+
+		record.proto = ip->ip_p;
+		record.payload_size = ip_len - (size_ip_header + record.header_size);
+		record.timestamp = (guint64)header->ts.tv_sec * 1000000 + header->ts.tv_usec;
+		record.payload_offset = payloads->len;
+
+		// find the flow of the packet, seen from the client
+		Pcap_Schedule_Flow flow;
+		memset(&flow, 0, sizeof(Pcap_Schedule_Flow));
+		flow.proto = ip->ip_p;
+		if(record.direction == _CLIENT_TO_SERVER) {
+			flow.server_ip = ip->ip_dst.s_addr;
+			flow.client_port = sport;
+			flow.server_port = dport;
+		} else {
+			flow.server_ip = ip->ip_src.s_addr;
+			flow.client_port = dport;
+			flow.server_port = sport;
+		}
+
+		gpointer index;
+		if(g_hash_table_lookup_extended(flowIndex, &flow, NULL, &index)) {
+			record.flow = GPOINTER_TO_UINT(index);
+		} else {
+			record.flow = flows->len;
+			flow.first_timestamp = record.timestamp;
+			g_array_append_val(flows, flow);
+			g_hash_table_insert(flowIndex, g_memdup(&flow, sizeof(Pcap_Schedule_Flow)), GUINT_TO_POINTER(record.flow));
+		}
+
+		// traces are often captured with a small snaplen, in which case we only
+		// have part of the payload. we keep the on-wire size and pad with zeros.
+		gsize wire_size = record.header_size + record.payload_size;
+		gsize copy_size = MIN(captured, wire_size);
+		g_string_append_len(payloads, (const gchar*)transport, copy_size);
+		if(copy_size < wire_size) {
+			gsize old_len = payloads->len;
+			g_string_set_size(payloads, old_len + (wire_size - copy_size));
+			memset(payloads->str + old_len, 0, wire_size - copy_size);
+		}
+
+		g_array_append_val(records, record);
+	}
+
+	// the error of libpcap, before pcap_stream_check() closes it
+	if(res == -1) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, pcap_geterr(pcap));
+	}
+
+	// a decompression error shows as a truncated trace, report the cause
+	gchar stream_ebuf[PCAP_ERRBUF_SIZE];
+	if(!pcap_stream_check(stream, stream_ebuf)) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, stream_ebuf);
+		res = -1;
+	}
+
+	if(res == -1) {
+		pcap_stream_close(stream);
+		g_array_free(records, TRUE);
+		g_array_free(flows, TRUE);
+		g_hash_table_destroy(flowIndex);
+		g_string_free(payloads, TRUE);
+		return NULL;
+	}
+	pcap_stream_close(stream);
+	g_hash_table_destroy(flowIndex);
+
+	// now lay out header, records, flows and payloads contiguously
+	gsize records_size = records->len * sizeof(Pcap_Schedule_Record);
+	gsize flows_size = flows->len * sizeof(Pcap_Schedule_Flow);
+	gsize length = sizeof(Pcap_Schedule_Header) + records_size + flows_size + payloads->len;
+	gchar* data = g_malloc(length);
+
+	Pcap_Schedule_Header* schedule_header = (Pcap_Schedule_Header*) data;
+	memset(schedule_header, 0, sizeof(Pcap_Schedule_Header));
+	schedule_header->magic = PCAP_SCHEDULE_MAGIC;
+	schedule_header->version = PCAP_SCHEDULE_VERSION;
+	schedule_header->client_IP_in_pcap = filter->client_IP_in_pcap.s_addr;
+	schedule_header->pcap_local_nw_addr = filter->pcap_local_nw_addr.s_addr;
+	schedule_header->pcap_local_nw_mask = filter->pcap_local_nw_mask;
+	schedule_header->nmb_flows = flows->len;
+	schedule_header->expression_hash = _pcap_schedule_expression_hash(filter->expression);
+	schedule_header->nmb_records = records->len;
+	schedule_header->payload_bytes = payloads->len;
+
+	memcpy(data + sizeof(Pcap_Schedule_Header), records->data, records_size);
+	memcpy(data + sizeof(Pcap_Schedule_Header) + records_size, flows->data, flows_size);
+	memcpy(data + sizeof(Pcap_Schedule_Header) + records_size + flows_size, payloads->str, payloads->len);
+
+	g_array_free(records, TRUE);
+	g_array_free(flows, TRUE);
+	g_string_free(payloads, TRUE);
+
+	return _pcap_schedule_attach(data, length, FALSE);
+}
+
+Pcap_Schedule* pcap_schedule_new_from_file(const gchar* path, gchar* ebuf) {
+	gint fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < sizeof(Pcap_Schedule_Header)) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: not a schedule file", path);
+		close(fd);
+		return NULL;
+	}
+
+	gchar* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: mmap failed: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	// make sure the file is what it pretends to be before handing out records
+	const Pcap_Schedule_Header* header = (const Pcap_Schedule_Header*) data;
+	gsize expected = sizeof(Pcap_Schedule_Header) + header->nmb_records * sizeof(Pcap_Schedule_Record)
+			+ header->nmb_flows * sizeof(Pcap_Schedule_Flow) + header->payload_bytes;
+	if(header->magic != PCAP_SCHEDULE_MAGIC || header->version != PCAP_SCHEDULE_VERSION || expected != (gsize)st.st_size) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: corrupted or incompatible schedule file", path);
+		munmap(data, (size_t)st.st_size);
+		return NULL;
+	}
+
+	return _pcap_schedule_attach(data, (gsize)st.st_size, TRUE);
+}
+
+Pcap_Schedule* pcap_schedule_load(const gchar* path, const Pcap_Schedule_Filter* filter, gchar* ebuf) {
+	// peek at the magic to know if we are given a schedule or a trace
+	guint32 magic = 0;
+	FILE* f = fopen(path, "rb");
+	if(f == NULL) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+		return NULL;
+	}
+	size_t n = fread(&magic, sizeof(magic), 1, f);
+	fclose(f);
+
+	if(n != 1 || magic != PCAP_SCHEDULE_MAGIC) {
+		return pcap_schedule_new_from_pcap(path, filter, ebuf);
+	}
+
+	Pcap_Schedule* schedule = pcap_schedule_new_from_file(path, ebuf);
+	if(schedule && !pcap_schedule_matches(schedule, filter)) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: schedule was built for another client ip/local network/filter", path);
+		pcap_schedule_free(schedule);
+		return NULL;
+	}
+	return schedule;
+}
+
+Pcap_Schedule* pcap_schedule_acquire(const gchar* path, const Pcap_Schedule_Filter* filter, gchar* ebuf) {
+	gchar* key = g_strdup_printf("%s|%08x|%08x|%u|%s", path, filter->client_IP_in_pcap.s_addr,
+			filter->pcap_local_nw_addr.s_addr, filter->pcap_local_nw_mask, filter->expression ? filter->expression : "");
+
+	G_LOCK(scheduleCache);
+
+	if(scheduleCache == NULL) {
+		scheduleCache = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	Pcap_Schedule* schedule = g_hash_table_lookup(scheduleCache, key);
+	if(schedule) {
+		schedule->refcount++;
+		g_free(key);
+	} else {
+		/* first user of this trace, we hold the lock while indexing so that
+		 * concurrent instances wait for it instead of indexing it again */
+		schedule = pcap_schedule_load(path, filter, ebuf);
+		if(schedule) {
+			schedule->cacheKey = key;
+			schedule->refcount = 1;
+			g_hash_table_insert(scheduleCache, schedule->cacheKey, schedule);
+		} else {
+			g_free(key);
+		}
+	}
+
+	G_UNLOCK(scheduleCache);
+
+	return schedule;
+}
+
+void pcap_schedule_release(Pcap_Schedule* schedule) {
+	if(!schedule) {
+		return;
+	}
+	if(!schedule->cacheKey) {
+		/* never was in the cache */
+		pcap_schedule_free(schedule);
+		return;
+	}
+
+	G_LOCK(scheduleCache);
+	gboolean isLastUser = (--schedule->refcount == 0);
+	if(isLastUser) {
+		g_hash_table_remove(scheduleCache, schedule->cacheKey);
+	}
+	G_UNLOCK(scheduleCache);
+
+	if(isLastUser) {
+		pcap_schedule_free(schedule);
+	}
+}
+
+gboolean pcap_schedule_write(const Pcap_Schedule* schedule, const gchar* path, gchar* ebuf) {
+	FILE* f = fopen(path, "wb");
+	if(f == NULL) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	size_t written = fwrite(schedule->data, 1, schedule->length, f);
+	if(fclose(f) != 0 || written != schedule->length) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: short write", path);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+gboolean pcap_schedule_matches(const Pcap_Schedule* schedule, const Pcap_Schedule_Filter* filter) {
+	return schedule->header->client_IP_in_pcap == filter->client_IP_in_pcap.s_addr
+			&& schedule->header->pcap_local_nw_addr == filter->pcap_local_nw_addr.s_addr
+			&& schedule->header->pcap_local_nw_mask == filter->pcap_local_nw_mask
+			&& schedule->header->expression_hash == _pcap_schedule_expression_hash(filter->expression);
+}
+
+void pcap_schedule_free(Pcap_Schedule* schedule) {
+	if(!schedule) {
+		return;
+	}
+	if(schedule->isMapped) {
+		munmap(schedule->data, schedule->length);
+	} else {
+		g_free(schedule->data);
+	}
+	g_free(schedule->cacheKey);
+	g_free(schedule);
+}
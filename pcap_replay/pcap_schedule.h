@@ -0,0 +1,126 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#ifndef PCAP_SCHEDULE_H_
+#define PCAP_SCHEDULE_H_
+
+#include <glib.h>
+#include <pcap.h>
+#include <netinet/in.h>
+
+/* A schedule is the pre-indexed form of a pcap trace: one fixed-size record
+ * per packet that matches the client/local network filter, the table of the
+ * flows (5-tuples) those packets belong to, and a blob holding the transport
+ * header and payload of each of the packets.
+ *
+ * On disk (and in memory) the layout is:
+ *   Pcap_Schedule_Header | Pcap_Schedule_Record[nmb_records] | Pcap_Schedule_Flow[nmb_flows] | payload blob
+ *
+ * Schedule files are written in host byte order, they are meant to be
+ * produced and replayed on the same kind of machine. */
+
+#define PCAP_SCHEDULE_MAGIC 0x43535250 /* "PRSC" */
+#define PCAP_SCHEDULE_VERSION 3
+
+typedef enum _PCAP_DIRECTION {
+	_CLIENT_TO_SERVER,
+	_SERVER_TO_CLIENT
+} _PCAP_DIRECTION;
+
+/* The values used to pick the packets of interest in the trace */
+typedef struct _Pcap_Schedule_Filter {
+	struct in_addr client_IP_in_pcap;
+	struct in_addr pcap_local_nw_addr;
+	guint32 pcap_local_nw_mask;
+	/* optional BPF expression (pcap-filter syntax) the packets must also match, or NULL */
+	const gchar* expression;
+} Pcap_Schedule_Filter;
+
+typedef struct _Pcap_Schedule_Header {
+	guint32 magic;
+	guint32 version;
+	/* the filter used to build the schedule (addresses in network order) */
+	guint32 client_IP_in_pcap;
+	guint32 pcap_local_nw_addr;
+	guint32 pcap_local_nw_mask;
+	guint32 nmb_flows;
+	guint32 expression_hash; /* g_str_hash() of the BPF expression, 0 if none */
+	guint32 reserved;
+	guint64 nmb_records;
+	guint64 payload_bytes;
+} Pcap_Schedule_Header;
+
+typedef struct _Pcap_Schedule_Record {
+	guint64 timestamp; /* capture time in microseconds */
+	guint64 payload_offset; /* offset of the transport header in the payload blob */
+	guint32 payload_size; /* size of the payload following the transport header */
+	guint16 header_size; /* size of the transport header (needed for vpn encapsulation) */
+	guint8 direction; /* _PCAP_DIRECTION */
+	guint8 proto; /* IPPROTO_TCP or IPPROTO_UDP, as found in the trace */
+	guint32 flow; /* index of the packet's flow in the flow table */
+	guint32 reserved;
+} Pcap_Schedule_Record;
+
+/* A flow of the trace, seen from the client: the client IP is the one of the filter */
+typedef struct _Pcap_Schedule_Flow {
+	guint32 server_ip; /* network order */
+	guint16 client_port; /* network order */
+	guint16 server_port; /* network order */
+	guint8 proto; /* IPPROTO_TCP or IPPROTO_UDP */
+	guint8 reserved[7];
+	guint64 first_timestamp; /* capture time (usec) of the first packet of the flow */
+} Pcap_Schedule_Flow;
+
+typedef struct _Pcap_Schedule {
+	/* the whole schedule, either mmap'd from a schedule file or built in memory */
+	gchar* data;
+	gsize length;
+	gboolean isMapped;
+
+	const Pcap_Schedule_Header* header;
+	const Pcap_Schedule_Record* records;
+	const Pcap_Schedule_Flow* flows;
+	const gchar* payloads;
+
+	/* set when the schedule is shared through the trace cache */
+	gchar* cacheKey;
+	gint refcount;
+} Pcap_Schedule;
+
+/* Index the pcap trace at path, keeping only the packets matching filter.
+ * The filter is compiled into a BPF program so that libpcap drops the packets
+ * of other hosts before they are even looked at.
+ * On error, NULL is returned and ebuf (PCAP_ERRBUF_SIZE) holds the reason. */
+Pcap_Schedule* pcap_schedule_new_from_pcap(const gchar* path, const Pcap_Schedule_Filter* filter, gchar* ebuf);
+
+/* Map a schedule file previously written with pcap_schedule_write() */
+Pcap_Schedule* pcap_schedule_new_from_file(const gchar* path, gchar* ebuf);
+
+/* Load path as a schedule file if it is one, otherwise index it as a pcap trace.
+ * A schedule file must have been built with the same filter. */
+Pcap_Schedule* pcap_schedule_load(const gchar* path, const Pcap_Schedule_Filter* filter, gchar* ebuf);
+
+/* Same as pcap_schedule_load(), but through a process-wide cache so that all
+ * the instances replaying the same trace share one read-only schedule.
+ * Each call must be balanced with pcap_schedule_release(). */
+Pcap_Schedule* pcap_schedule_acquire(const gchar* path, const Pcap_Schedule_Filter* filter, gchar* ebuf);
+void pcap_schedule_release(Pcap_Schedule* schedule);
+
+gboolean pcap_schedule_write(const Pcap_Schedule* schedule, const gchar* path, gchar* ebuf);
+gboolean pcap_schedule_matches(const Pcap_Schedule* schedule, const Pcap_Schedule_Filter* filter);
+void pcap_schedule_free(Pcap_Schedule* schedule);
+
+static inline guint64 pcap_schedule_length(const Pcap_Schedule* schedule) {
+	return schedule->header->nmb_records;
+}
+
+static inline guint32 pcap_schedule_flow_count(const Pcap_Schedule* schedule) {
+	return schedule->header->nmb_flows;
+}
+
+static inline const gchar* pcap_schedule_payload(const Pcap_Schedule* schedule, const Pcap_Schedule_Record* record) {
+	return schedule->payloads + record->payload_offset;
+}
+
+#endif /* PCAP_SCHEDULE_H_ */
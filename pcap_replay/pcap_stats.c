@@ -0,0 +1,70 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include "pcap_stats.h"
+
+/* The first 32 values have their own bucket. Above, a value whose highest bit
+ * is bit b >= 5 is shifted right by b-4 to keep its 5 highest bits, which
+ * select one of the 16 buckets of the [2^b, 2^(b+1)) range. */
+static guint _pcap_histogram_index(guint64 value) {
+	if(value < 32) {
+		return (guint) value;
+	}
+	guint shift = g_bit_storage(value) - 5;
+	return shift * 16 + (guint) (value >> shift);
+}
+
+/* the largest value counted in a bucket */
+static guint64 _pcap_histogram_value(guint index) {
+	if(index < 32) {
+		return index;
+	}
+	guint shift = index / 16 - 1;
+	guint64 sub = index - shift * 16;
+	return ((sub + 1) << shift) - 1;
+}
+
+void pcap_histogram_record(Pcap_Histogram* histogram, guint64 value) {
+	if(histogram->total == 0 || value < histogram->min) {
+		histogram->min = value;
+	}
+	if(value > histogram->max) {
+		histogram->max = value;
+	}
+	histogram->sum += value;
+	histogram->total++;
+	histogram->counts[_pcap_histogram_index(MIN(value, PCAP_HISTOGRAM_MAX))]++;
+}
+
+guint64 pcap_histogram_percentile(const Pcap_Histogram* histogram, gdouble percentile) {
+	if(histogram->total == 0) {
+		return 0;
+	}
+
+	guint64 rank = (guint64) (percentile / 100 * histogram->total + 0.5);
+	rank = CLAMP(rank, 1, histogram->total);
+
+	guint64 seen = 0;
+	for(guint i = 0; i < PCAP_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if(seen >= rank) {
+			// the bucket bound, but never beyond what was actually recorded
+			return CLAMP(_pcap_histogram_value(i), histogram->min, histogram->max);
+		}
+	}
+	return histogram->max;
+}
+
+gchar* pcap_histogram_summary(const Pcap_Histogram* histogram) {
+	return g_strdup_printf("n=%"G_GUINT64_FORMAT" min=%"G_GUINT64_FORMAT" mean=%.1f"
+			" p50=%"G_GUINT64_FORMAT" p90=%"G_GUINT64_FORMAT" p99=%"G_GUINT64_FORMAT
+			" p99.9=%"G_GUINT64_FORMAT" max=%"G_GUINT64_FORMAT,
+			histogram->total, histogram->min,
+			histogram->total ? histogram->sum / histogram->total : 0.0,
+			pcap_histogram_percentile(histogram, 50),
+			pcap_histogram_percentile(histogram, 90),
+			pcap_histogram_percentile(histogram, 99),
+			pcap_histogram_percentile(histogram, 99.9),
+			histogram->max);
+}
@@ -0,0 +1,52 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#ifndef PCAP_STATS_H_
+#define PCAP_STATS_H_
+
+#include <glib.h>
+
+/* Log-linear (HDR-style) histogram of non-negative values, in usec. Every
+ * power of two range is split in 16 buckets, so a recorded value is known
+ * within 1/16 (6%) whatever its magnitude, in a fixed amount of memory and
+ * O(1) per record. Values from PCAP_HISTOGRAM_MAX (about 12 days) on land in
+ * the last bucket. */
+
+#define PCAP_HISTOGRAM_MAX_BITS 40
+#define PCAP_HISTOGRAM_MAX ((G_GUINT64_CONSTANT(1) << PCAP_HISTOGRAM_MAX_BITS) - 1)
+#define PCAP_HISTOGRAM_BUCKETS ((PCAP_HISTOGRAM_MAX_BITS - 3) * 16)
+
+typedef struct _Pcap_Histogram {
+	guint64 counts[PCAP_HISTOGRAM_BUCKETS];
+	guint64 total;
+	guint64 min;
+	guint64 max;
+	gdouble sum;
+} Pcap_Histogram;
+
+/* What the replay did, recorded as the packets are sent */
+typedef struct _Pcap_Stats {
+	/* how late the packets were handed to the socket with respect to the
+	 * (paced) trace schedule: the send timer and event loop skew */
+	Pcap_Histogram sendSkew;
+	guint64 early; /* packets sent ahead of schedule, within the burst window */
+	/* from the schedule until the last byte of a TCP segment is written:
+	 * the time spent on the outbound ring because of the network */
+	Pcap_Histogram queueDelay;
+
+	/* packets and payload bytes replayed, by _PROTO */
+	guint64 packets[2];
+	guint64 bytes[2];
+	guint64 dropped; /* packets of closed flows or unknown endpoints */
+} Pcap_Stats;
+
+void pcap_histogram_record(Pcap_Histogram* histogram, guint64 value);
+
+/* the value below which percentile (0-100) percent of the values fall, 0 when empty */
+guint64 pcap_histogram_percentile(const Pcap_Histogram* histogram, gdouble percentile);
+
+/* one-line summary: count, min, mean, p50, p90, p99, p99.9 and max. Free with g_free() */
+gchar* pcap_histogram_summary(const Pcap_Histogram* histogram);
+
+#endif /* PCAP_STATS_H_ */
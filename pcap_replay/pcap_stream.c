@@ -0,0 +1,265 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef PCAP_REPLAY_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PCAP_REPLAY_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "pcap_stream.h"
+
+/* recognize the compressed traces by their magic */
+static _PCAP_STREAM_CODEC _pcap_stream_codec(FILE* input) {
+	guchar magic[4];
+	size_t n = fread(magic, 1, sizeof(magic), input);
+	rewind(input);
+
+	if(n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+		return _PCAP_STREAM_GZIP;
+	}
+	if(n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+		return _PCAP_STREAM_ZSTD;
+	}
+	return _PCAP_STREAM_PLAIN;
+}
+
+/* hand decompressed bytes over to libpcap, blocking while the read-ahead is full.
+ * FALSE once libpcap is gone (the stream was closed before its end). */
+static gboolean _pcap_stream_write(Pcap_Stream* stream, const gchar* buffer, gsize length) {
+	while(length > 0) {
+		ssize_t n = send(stream->writeFd, buffer, length, MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return FALSE;
+		}
+		buffer += n;
+		length -= n;
+	}
+	return TRUE;
+}
+
+#ifdef PCAP_REPLAY_HAVE_ZLIB
+static void _pcap_stream_gunzip(Pcap_Stream* stream) {
+	gchar in[PCAP_STREAM_CHUNK], out[PCAP_STREAM_CHUNK];
+	z_stream zs;
+	memset(&zs, 0, sizeof(z_stream));
+
+	// 15+32: any window size, gzip or zlib header detected automatically
+	if(inflateInit2(&zs, 15 + 32) != Z_OK) {
+		stream->error = g_strdup("unable to initialize zlib");
+		return;
+	}
+
+	gboolean isComplete = FALSE;
+	while(TRUE) {
+		if(zs.avail_in == 0) {
+			zs.avail_in = fread(in, 1, sizeof(in), stream->input);
+			zs.next_in = (Bytef*) in;
+			if(zs.avail_in == 0) {
+				break;
+			}
+		}
+
+		zs.next_out = (Bytef*) out;
+		zs.avail_out = sizeof(out);
+		gint res = inflate(&zs, Z_NO_FLUSH);
+		if(res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+			stream->error = g_strdup_printf("corrupted gzip data: %s", zs.msg ? zs.msg : "unknown error");
+			break;
+		}
+		isComplete = (res == Z_STREAM_END);
+
+		if(!_pcap_stream_write(stream, out, sizeof(out) - zs.avail_out)) {
+			break;
+		}
+
+		// traces compressed in several runs are concatenated gzip members
+		if(res == Z_STREAM_END) {
+			inflateReset(&zs);
+		}
+	}
+
+	if(!stream->error && !isComplete && feof(stream->input)) {
+		// the input ended in the middle of a member
+		stream->error = g_strdup("truncated gzip data");
+	}
+	inflateEnd(&zs);
+}
+#endif
+
+#ifdef PCAP_REPLAY_HAVE_ZSTD
+static void _pcap_stream_unzstd(Pcap_Stream* stream) {
+	gchar in[PCAP_STREAM_CHUNK], out[PCAP_STREAM_CHUNK];
+	ZSTD_DStream* zds = ZSTD_createDStream();
+	if(zds == NULL) {
+		stream->error = g_strdup("unable to initialize zstd");
+		return;
+	}
+	ZSTD_initDStream(zds);
+
+	size_t res = 0;
+	size_t n;
+	while((n = fread(in, 1, sizeof(in), stream->input)) > 0) {
+		ZSTD_inBuffer input = { in, n, 0 };
+		while(input.pos < input.size) {
+			ZSTD_outBuffer output = { out, sizeof(out), 0 };
+			res = ZSTD_decompressStream(zds, &output, &input);
+			if(ZSTD_isError(res)) {
+				stream->error = g_strdup_printf("corrupted zstd data: %s", ZSTD_getErrorName(res));
+				break;
+			}
+			if(!_pcap_stream_write(stream, out, output.pos)) {
+				break;
+			}
+		}
+		if(input.pos < input.size) {
+			break;
+		}
+	}
+
+	// res is 0 only when a frame was completely decoded and flushed
+	if(!stream->error && res != 0 && feof(stream->input)) {
+		stream->error = g_strdup("truncated zstd data");
+	}
+	ZSTD_freeDStream(zds);
+}
+#endif
+
+/* the helper thread: decompress the trace until its end, or until libpcap stops reading */
+static gpointer _pcap_stream_run(gpointer data) {
+	Pcap_Stream* stream = data;
+
+#ifdef PCAP_REPLAY_HAVE_ZLIB
+	if(stream->codec == _PCAP_STREAM_GZIP) {
+		_pcap_stream_gunzip(stream);
+	}
+#endif
+#ifdef PCAP_REPLAY_HAVE_ZSTD
+	if(stream->codec == _PCAP_STREAM_ZSTD) {
+		_pcap_stream_unzstd(stream);
+	}
+#endif
+
+	if(!stream->error && ferror(stream->input)) {
+		stream->error = g_strdup_printf("read error: %s", strerror(errno));
+	}
+
+	// libpcap sees the end of the trace
+	close(stream->writeFd);
+	stream->writeFd = -1;
+	return NULL;
+}
+
+Pcap_Stream* pcap_stream_open(const gchar* path, gchar* ebuf) {
+	FILE* input = fopen(path, "rb");
+	if(input == NULL) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	Pcap_Stream* stream = g_new0(Pcap_Stream, 1);
+	stream->codec = _pcap_stream_codec(input);
+	stream->writeFd = -1;
+
+	if(stream->codec == _PCAP_STREAM_PLAIN) {
+		// libpcap reads pcap and pcapng on its own
+		stream->pcap = pcap_fopen_offline(input, ebuf);
+		if(stream->pcap == NULL) {
+			fclose(input);
+			g_free(stream);
+			return NULL;
+		}
+		return stream;
+	}
+
+#ifndef PCAP_REPLAY_HAVE_ZLIB
+	if(stream->codec == _PCAP_STREAM_GZIP) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: gzip compressed, but built without zlib", path);
+		fclose(input);
+		g_free(stream);
+		return NULL;
+	}
+#endif
+#ifndef PCAP_REPLAY_HAVE_ZSTD
+	if(stream->codec == _PCAP_STREAM_ZSTD) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: zstd compressed, but built without zstd", path);
+		fclose(input);
+		g_free(stream);
+		return NULL;
+	}
+#endif
+
+	// a socket pair rather than a pipe so that the thread never gets SIGPIPE
+	gint sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: socketpair failed: %s", path, strerror(errno));
+		fclose(input);
+		g_free(stream);
+		return NULL;
+	}
+	gint readahead = PCAP_STREAM_READAHEAD;
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &readahead, sizeof(readahead));
+
+	stream->input = input;
+	stream->writeFd = sv[1];
+	stream->thread = g_thread_new("pcap-stream", _pcap_stream_run, stream);
+
+	FILE* output = fdopen(sv[0], "rb");
+	stream->pcap = output ? pcap_fopen_offline(output, ebuf) : NULL;
+	if(stream->pcap == NULL) {
+		if(output) {
+			fclose(output);
+		} else {
+			g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: fdopen failed: %s", path, strerror(errno));
+			close(sv[0]);
+		}
+		pcap_stream_close(stream);
+		return NULL;
+	}
+	return stream;
+}
+
+gboolean pcap_stream_check(Pcap_Stream* stream, gchar* ebuf) {
+	// the thread may be blocked writing if libpcap stopped early, close its end first
+	if(stream->pcap) {
+		pcap_close(stream->pcap);
+		stream->pcap = NULL;
+	}
+	if(stream->thread) {
+		g_thread_join(stream->thread);
+		stream->thread = NULL;
+	}
+	if(stream->error) {
+		g_snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", stream->error);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void pcap_stream_close(Pcap_Stream* stream) {
+	if(!stream) {
+		return;
+	}
+	// closing libpcap's end first unblocks the thread if it is still writing
+	if(stream->pcap) {
+		pcap_close(stream->pcap);
+	}
+	if(stream->thread) {
+		g_thread_join(stream->thread);
+	}
+	if(stream->input) {
+		fclose(stream->input);
+	}
+	g_free(stream->error);
+	g_free(stream);
+}
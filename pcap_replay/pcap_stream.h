@@ -0,0 +1,51 @@
+/*
+ * See LICENSE for licensing information
+ */
+
+#ifndef PCAP_STREAM_H_
+#define PCAP_STREAM_H_
+
+#include <glib.h>
+#include <pcap.h>
+
+/* A stream opens a trace for sequential reading with libpcap, whatever its
+ * format: pcap or pcapng (both handled by libpcap), optionally compressed
+ * with gzip or zstd. Compressed traces are decompressed by a helper thread
+ * into a socket pair that libpcap reads from, so the whole trace is never
+ * staged on disk or in memory: the socket buffer bounds the read-ahead.
+ *
+ * gzip and zstd support depend on PCAP_REPLAY_HAVE_ZLIB and
+ * PCAP_REPLAY_HAVE_ZSTD, set by the build when the libraries are found. */
+
+#define PCAP_STREAM_CHUNK 65536 /* Size of the decompression buffers (in bytes) */
+#define PCAP_STREAM_READAHEAD (1 << 20) /* Max decompressed bytes waiting for libpcap */
+
+typedef enum _PCAP_STREAM_CODEC {
+	_PCAP_STREAM_PLAIN,
+	_PCAP_STREAM_GZIP,
+	_PCAP_STREAM_ZSTD
+} _PCAP_STREAM_CODEC;
+
+typedef struct _Pcap_Stream {
+	pcap_t* pcap;
+	_PCAP_STREAM_CODEC codec;
+
+	/* decompression, when the trace is compressed */
+	GThread* thread;
+	FILE* input; /* the compressed trace, read by the thread */
+	gint writeFd; /* the thread's end of the socket pair */
+	gchar* error; /* set by the thread if the trace can't be decompressed */
+} Pcap_Stream;
+
+/* Open the trace at path. On error, NULL is returned and ebuf
+ * (PCAP_ERRBUF_SIZE) holds the reason. */
+Pcap_Stream* pcap_stream_open(const gchar* path, gchar* ebuf);
+
+/* Once libpcap reports the end of the trace or an error, tells whether the
+ * decompression failed, in which case ebuf holds the reason. The libpcap
+ * handle is closed first, so the trace can't be read anymore. */
+gboolean pcap_stream_check(Pcap_Stream* stream, gchar* ebuf);
+
+void pcap_stream_close(Pcap_Stream* stream);
+
+#endif /* PCAP_STREAM_H_ */